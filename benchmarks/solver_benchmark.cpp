@@ -0,0 +1,129 @@
+// Measures the latency of the scale and shift minimal solvers in solver.h on
+// random noise-free samples. For every solver, prints the minimum over
+// kNumRuns runs of the time per call, the number of heap allocations per call
+// and the mean number of solutions.
+
+#include "solver.h"
+
+#include <Eigen/Core>
+#include <Eigen/Geometry>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+#include <new>
+#include <random>
+#include <vector>
+
+namespace {
+
+// Number of calls of the global operator new.
+std::atomic<long long> num_allocations{0};
+
+} // namespace
+
+void *operator new(std::size_t size) {
+    ++num_allocations;
+    void *ptr = std::malloc(size);
+    if (ptr == nullptr)
+        throw std::bad_alloc();
+    return ptr;
+}
+
+// The sized and array forms call this one.
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+
+namespace madpose {
+namespace {
+
+constexpr int kNumSamples = 20000;
+constexpr int kNumRuns = 15;
+
+// A minimal sample of N correspondences in the layout of the solvers.
+template <int N> struct Sample {
+    Eigen::Matrix<double, 3, N> x_homo, y_homo;
+    Eigen::Matrix<double, N, 1> depth_x, depth_y;
+};
+
+// Random samples of points in front of both cameras, with homogeneous image
+// coordinates for the focal lengths focal0 and focal1 and depths that are
+// scaled and shifted.
+template <int N>
+std::vector<Sample<N>> RandomSamples(const double focal0, const double focal1, std::mt19937 *rng) {
+    std::uniform_real_distribution<double> uniform(-1.0, 1.0);
+    std::vector<Sample<N>> samples(kNumSamples);
+    for (Sample<N> &sample : samples) {
+        const Eigen::Vector3d kAxis = Eigen::Vector3d(uniform(*rng), uniform(*rng), uniform(*rng)).normalized();
+        const Eigen::Matrix3d R = Eigen::AngleAxisd(0.5 * uniform(*rng), kAxis).toRotationMatrix();
+        const Eigen::Vector3d t(uniform(*rng), uniform(*rng), uniform(*rng));
+        for (int i = 0; i < N; i++) {
+            const Eigen::Vector3d X(uniform(*rng), uniform(*rng), 4.0 + uniform(*rng));
+            const Eigen::Vector3d Y = R * X + t;
+            sample.x_homo.col(i) << focal0 * X.hnormalized(), 1.0;
+            sample.y_homo.col(i) << focal1 * Y.hnormalized(), 1.0;
+            sample.depth_x(i) = X(2) - 0.3;
+            sample.depth_y(i) = Y(2) / 1.7 - 0.5;
+        }
+    }
+    return samples;
+}
+
+// Runs solve, which returns the number of solutions, on all samples kNumRuns
+// times and prints the statistics of the fastest run.
+template <int N, typename Function>
+void Benchmark(const char *name, const std::vector<Sample<N>> &samples, Function solve) {
+    double min_ns = std::numeric_limits<double>::infinity();
+    long long allocations = 0, num_solutions = 0;
+    for (int run = 0; run < kNumRuns; run++) {
+        const long long kAllocationsBefore = num_allocations;
+        num_solutions = 0;
+        const auto kStart = std::chrono::steady_clock::now();
+        for (const Sample<N> &sample : samples)
+            num_solutions += solve(sample);
+        const auto kEnd = std::chrono::steady_clock::now();
+        min_ns = std::min(min_ns, std::chrono::duration<double, std::nano>(kEnd - kStart).count());
+        allocations = num_allocations - kAllocationsBefore;
+    }
+    std::printf("%-38s %9.0f ns/call %6.2f allocations/call %5.2f solutions/call\n", name, min_ns / samples.size(),
+                static_cast<double>(allocations) / samples.size(), static_cast<double>(num_solutions) / samples.size());
+}
+
+} // namespace
+} // namespace madpose
+
+int main() {
+    using namespace madpose;
+    std::mt19937 rng(0);
+    const std::vector<Sample<3>> kCalibrated = RandomSamples<3>(1.0, 1.0, &rng);
+    const std::vector<Sample<4>> kSharedFocal = RandomSamples<4>(600.0, 600.0, &rng);
+    const std::vector<Sample<4>> kTwoFocal = RandomSamples<4>(500.0, 700.0, &rng);
+
+    Benchmark("solve_scale_and_shift", kCalibrated, [](const Sample<3> &s) {
+        Eigen::Matrix4d solutions;
+        return solve_scale_and_shift(s.x_homo, s.y_homo, s.depth_x, s.depth_y, &solutions);
+    });
+    Benchmark("solve_scale_shift_pose", kCalibrated, [](const Sample<3> &s) {
+        ScaleShiftPoses poses;
+        return solve_scale_shift_pose(s.x_homo, s.y_homo, s.depth_x, s.depth_y, &poses);
+    });
+    Benchmark("solve_scale_and_shift_shared_focal", kSharedFocal, [](const Sample<4> &s) {
+        Eigen::Matrix<double, 5, 8> solutions;
+        return solve_scale_and_shift_shared_focal(s.x_homo, s.y_homo, s.depth_x, s.depth_y, &solutions);
+    });
+    Benchmark("solve_scale_shift_pose_shared_focal", kSharedFocal, [](const Sample<4> &s) {
+        ScaleShiftSharedFocalPoses poses;
+        return solve_scale_shift_pose_shared_focal(s.x_homo, s.y_homo, s.depth_x, s.depth_y, &poses);
+    });
+    Benchmark("solve_scale_and_shift_two_focal", kTwoFocal, [](const Sample<4> &s) {
+        Eigen::Matrix<double, 6, 4> solutions;
+        return solve_scale_and_shift_two_focal(s.x_homo, s.y_homo, s.depth_x, s.depth_y, &solutions);
+    });
+    Benchmark("solve_scale_shift_pose_two_focal", kTwoFocal, [](const Sample<4> &s) {
+        ScaleShiftTwoFocalPoses poses;
+        return solve_scale_shift_pose_two_focal(s.x_homo, s.y_homo, s.depth_x, s.depth_y, &poses);
+    });
+    return 0;
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <Eigen/Dense>
+#include <Eigen/Geometry>
+
+#include <cmath>
+
+namespace madpose {
+
+// Rotation R that maximizes trace(R^T S), i.e. the rotation of the least
+// squares alignment sum_i w_i ||R x_i - y_i||^2 of centered points with the
+// cross-covariance S = sum_i w_i y_i x_i^T. Uses Horn's quaternion method
+// [Horn, Closed-form solution of absolute orientation using unit quaternions,
+// JOSA A 1987]: the quaternion of R is the eigenvector of the largest
+// eigenvalue of a symmetric 4 x 4 matrix, which is found by Newton's method on
+// its characteristic polynomial and refined by inverse iteration. When the two
+// largest eigenvalues are too close to separate the eigenvector (nearly
+// collinear points), falls back to the SVD. Always returns a proper rotation
+// and does not allocate.
+inline Eigen::Matrix3d RotationFromCrossCovariance(const Eigen::Matrix3d &S) {
+    // M(a, b) = sum_i w_i x_i(a) y_i(b).
+    const Eigen::Matrix3d M = S.transpose();
+    Eigen::Matrix4d N;
+    N << M(0, 0) + M(1, 1) + M(2, 2), M(1, 2) - M(2, 1), M(2, 0) - M(0, 2), M(0, 1) - M(1, 0),
+        M(1, 2) - M(2, 1), M(0, 0) - M(1, 1) - M(2, 2), M(0, 1) + M(1, 0), M(2, 0) + M(0, 2),
+        M(2, 0) - M(0, 2), M(0, 1) + M(1, 0), -M(0, 0) + M(1, 1) - M(2, 2), M(1, 2) + M(2, 1),
+        M(0, 1) - M(1, 0), M(2, 0) + M(0, 2), M(1, 2) + M(2, 1), -M(0, 0) - M(1, 1) + M(2, 2);
+
+    // N is traceless, its characteristic polynomial is
+    // x^4 + c2 x^2 + c1 x + c0. All its roots are real, so Newton's method
+    // started above the largest one decreases monotonically towards it.
+    const double kSquaredNorm = S.squaredNorm();
+    if (kSquaredNorm == 0.0)
+        return Eigen::Matrix3d::Identity();
+    const double c2 = -2.0 * kSquaredNorm;
+    const double c1 = -8.0 * S.determinant();
+    const double c0 = N.determinant();
+    // The largest eigenvalue is at most the sum of the singular values of S.
+    double lambda = std::sqrt(3.0 * kSquaredNorm);
+    for (int iter = 0; iter < 50; ++iter) {
+        const double kLambda2 = lambda * lambda;
+        const double kValue = (kLambda2 + c2) * kLambda2 + c1 * lambda + c0;
+        const double kDerivative = (4.0 * kLambda2 + 2.0 * c2) * lambda + c1;
+        const double kNext = lambda - kValue / kDerivative;
+        if (!(kNext < lambda))
+            break;
+        lambda = kNext;
+    }
+
+    // p'(lambda) is the product of the gaps to the other three eigenvalues,
+    // each at most 4 lambda, so a small value means the top two are nearly equal.
+    const double kDerivative = (4.0 * lambda * lambda + 2.0 * c2) * lambda + c1;
+    if (kDerivative > 1e-4 * lambda * lambda * lambda) {
+        // Inverse iteration with a shift just above lambda: the column of the
+        // inverse with the largest diagonal entry is already close to the
+        // eigenvector, and one more step polishes it.
+        Eigen::Matrix4d B = N;
+        B.diagonal().array() -= lambda * (1.0 + 1e-12);
+        const Eigen::Matrix4d B_inv = B.inverse();
+        Eigen::Index k;
+        B_inv.diagonal().cwiseAbs().maxCoeff(&k);
+        const Eigen::Vector4d q = (B_inv * B_inv.col(k).normalized()).normalized();
+        if (q.allFinite())
+            return Eigen::Quaterniond(q(0), q(1), q(2), q(3)).toRotationMatrix();
+    }
+
+    const Eigen::JacobiSVD<Eigen::Matrix3d> svd(S, Eigen::ComputeFullU | Eigen::ComputeFullV);
+    Eigen::Matrix3d V = svd.matrixV();
+    if ((svd.matrixU() * V.transpose()).determinant() < 0.0)
+        V.col(2) *= -1.0;
+    return svd.matrixU() * V.transpose();
+}
+
+// Weighted centroids c_X, c_Y of the columns of X and Y and their
+// cross-covariance S = sum_i W(i) (Y_i - c_Y) (X_i - c_X)^T. Accumulates in
+// place, so it does not allocate for dynamic sizes either.
+template <typename DerivedX, typename DerivedY, typename DerivedW>
+void CenteredCrossCovariance(const Eigen::MatrixBase<DerivedX> &X, const Eigen::MatrixBase<DerivedY> &Y,
+                             const Eigen::MatrixBase<DerivedW> &W, Eigen::Vector3d *centroid_X,
+                             Eigen::Vector3d *centroid_Y, Eigen::Matrix3d *S) {
+    double weight_sum = 0.0;
+    centroid_X->setZero();
+    centroid_Y->setZero();
+    for (Eigen::Index i = 0; i < X.cols(); ++i) {
+        *centroid_X += W(i) * X.col(i);
+        *centroid_Y += W(i) * Y.col(i);
+        weight_sum += W(i);
+    }
+    *centroid_X /= weight_sum;
+    *centroid_Y /= weight_sum;
+
+    S->setZero();
+    for (Eigen::Index i = 0; i < X.cols(); ++i)
+        S->noalias() += (W(i) * (Y.col(i) - *centroid_Y)) * (X.col(i) - *centroid_X).transpose();
+}
+
+// Rigid alignment of the columns of X to those of Y: the rotation R and
+// translation t that minimize sum_i ||R X_i + t - Y_i||^2.
+template <typename DerivedX, typename DerivedY>
+void AlignPoints(const Eigen::MatrixBase<DerivedX> &X, const Eigen::MatrixBase<DerivedY> &Y, Eigen::Matrix3d *R,
+                 Eigen::Vector3d *t) {
+    Eigen::Vector3d centroid_X, centroid_Y;
+    Eigen::Matrix3d S;
+    CenteredCrossCovariance(X, Y, Eigen::Matrix<double, DerivedX::ColsAtCompileTime, 1>::Ones(X.cols()), &centroid_X,
+                            &centroid_Y, &S);
+    *R = RotationFromCrossCovariance(S);
+    *t = centroid_Y - *R * centroid_X;
+}
+
+} // namespace madpose
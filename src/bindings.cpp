@@ -75,6 +75,26 @@ void bind_ransaclib(py::module &m) {
         .def_readwrite("inlier_indices", &ransac_lib::HybridRansacStatistics::inlier_indices)
         .def_readwrite("number_lo_iterations", &ransac_lib::HybridRansacStatistics::number_lo_iterations);
 
+    py::class_<HybridRansacProfile>(m, "HybridRansacProfile")
+        .def(py::init<>())
+        .def_readwrite("minimal_solver_ns", &HybridRansacProfile::minimal_solver_ns)
+        .def_readwrite("scoring_ns", &HybridRansacProfile::scoring_ns)
+        .def_readwrite("local_optimization_ns", &HybridRansacProfile::local_optimization_ns)
+        .def_readwrite("final_least_squares_ns", &HybridRansacProfile::final_least_squares_ns)
+        .def_readwrite("num_minimal_solver_calls", &HybridRansacProfile::num_minimal_solver_calls)
+        .def_readwrite("num_models", &HybridRansacProfile::num_models)
+        .def_readwrite("num_models_rejected_min_depth", &HybridRansacProfile::num_models_rejected_min_depth)
+        .def_readwrite("num_point_evaluations", &HybridRansacProfile::num_point_evaluations)
+        .def_readwrite("num_ceres_solves", &HybridRansacProfile::num_ceres_solves)
+        .def_readwrite("num_ceres_iterations", &HybridRansacProfile::num_ceres_iterations)
+        .def_readwrite("num_refiner_solves", &HybridRansacProfile::num_refiner_solves)
+        .def_readwrite("num_refiner_iterations", &HybridRansacProfile::num_refiner_iterations);
+
+    py::class_<ExtendedHybridRansacStatistics, ransac_lib::HybridRansacStatistics>(m, "ExtendedHybridRansacStatistics")
+        .def(py::init<>())
+        .def_readwrite("time_budget_exhausted", &ExtendedHybridRansacStatistics::time_budget_exhausted)
+        .def_readwrite("profile", &ExtendedHybridRansacStatistics::profile);
+
     py::class_<ExtendedHybridLORansacOptions>(m, "HybridLORansacOptions")
         .def(py::init<>())
         .def_readwrite("min_num_iterations", &ExtendedHybridLORansacOptions::min_num_iterations_)
@@ -90,7 +110,20 @@ void bind_ransaclib(py::module &m) {
         .def_readwrite("min_sample_multiplicator", &ExtendedHybridLORansacOptions::min_sample_multiplicator_)
         .def_readwrite("non_min_sample_multiplier", &ExtendedHybridLORansacOptions::non_min_sample_multiplier_)
         .def_readwrite("lo_starting_iterations", &ExtendedHybridLORansacOptions::lo_starting_iterations_)
-        .def_readwrite("final_least_squares", &ExtendedHybridLORansacOptions::final_least_squares_);
+        .def_readwrite("final_least_squares", &ExtendedHybridLORansacOptions::final_least_squares_)
+        .def_readwrite("num_threads", &ExtendedHybridLORansacOptions::num_threads_)
+        .def_readwrite("batch_size", &ExtendedHybridLORansacOptions::batch_size_)
+        .def_readwrite("use_sprt", &ExtendedHybridLORansacOptions::use_sprt_)
+        .def_readwrite("sprt_initial_epsilon", &ExtendedHybridLORansacOptions::sprt_initial_epsilon_)
+        .def_readwrite("sprt_initial_delta", &ExtendedHybridLORansacOptions::sprt_initial_delta_)
+        .def_readwrite("sprt_time_model", &ExtendedHybridLORansacOptions::sprt_time_model_)
+        .def_readwrite("sprt_models_per_sample", &ExtendedHybridLORansacOptions::sprt_models_per_sample_)
+        .def_readwrite("prosac_beta", &ExtendedHybridLORansacOptions::prosac_beta_)
+        .def_readwrite("time_budget_ms", &ExtendedHybridLORansacOptions::time_budget_ms_)
+        .def_readwrite("lo_time_fraction", &ExtendedHybridLORansacOptions::lo_time_fraction_)
+        .def_readwrite("final_least_squares_time_fraction",
+                       &ExtendedHybridLORansacOptions::final_least_squares_time_fraction_)
+        .def_readwrite("collect_profile", &ExtendedHybridLORansacOptions::collect_profile_);
 }
 
 void bind_estimator(py::module &m) {
@@ -101,13 +134,17 @@ void bind_estimator(py::module &m) {
         .def_readwrite("constant_offset", &OptimizerConfig::constant_offset)
         .def_readwrite("solver_options", &OptimizerConfig::solver_options)
         .def_readwrite("min_depth_constraint", &OptimizerConfig::min_depth_constraint)
-        .def_readwrite("use_shift", &OptimizerConfig::use_shift);
+        .def_readwrite("use_shift", &OptimizerConfig::use_shift)
+        .def_readwrite("use_analytic_jacobians", &OptimizerConfig::use_analytic_jacobians)
+        .def_readwrite("batch_residuals", &OptimizerConfig::batch_residuals)
+        .def_readwrite("use_lm_refiner", &OptimizerConfig::use_lm_refiner);
 
     py::class_<EstimatorConfig>(m, "EstimatorConfig")
         .def(py::init<>())
         .def(py::init<int, int, int>(), "solver"_a = 0, "score"_a = 0, "LO"_a = 0)
         .def_readwrite("min_depth_constraint", &EstimatorConfig::min_depth_constraint)
-        .def_readwrite("use_shift", &EstimatorConfig::use_shift);
+        .def_readwrite("use_shift", &EstimatorConfig::use_shift)
+        .def_readwrite("use_lm_refiner", &EstimatorConfig::use_lm_refiner);
 
     py::class_<PoseAndScale>(m, "PoseAndScale")
         .def(py::init<>())
@@ -154,25 +191,31 @@ void bind_estimator(py::module &m) {
         .def("R", &PoseScaleOffsetTwoFocal::R)
         .def("t", &PoseScaleOffsetTwoFocal::t);
 
-    m.def("estimate_scale_and_pose", &estimate_scale_and_pose, "X"_a, "Y"_a, "W"_a);
-    m.def("solve_scale_and_shift", &solve_scale_and_shift, "x_homo"_a, "y_homo"_a, "depth_x"_a, "depth_y"_a);
-    m.def("solve_scale_and_shift_shared_focal", &solve_scale_and_shift_shared_focal, "x_homo"_a, "y_homo"_a,
+    m.def("estimate_scale_and_pose",
+          static_cast<PoseAndScale (*)(const Eigen::MatrixXd &, const Eigen::MatrixXd &, const Eigen::VectorXd &)>(
+              &estimate_scale_and_pose),
+          "X"_a, "Y"_a, "W"_a);
+    m.def("solve_scale_and_shift", &solve_scale_and_shift_wrapper, "x_homo"_a, "y_homo"_a, "depth_x"_a, "depth_y"_a);
+    m.def("solve_scale_and_shift_shared_focal", &solve_scale_and_shift_shared_focal_wrapper, "x_homo"_a, "y_homo"_a,
+          "depth_x"_a, "depth_y"_a);
+    m.def("solve_scale_and_shift_two_focal", &solve_scale_and_shift_two_focal_wrapper, "x_homo"_a, "y_homo"_a,
           "depth_x"_a, "depth_y"_a);
-    m.def("solve_scale_and_shift_two_focal", &solve_scale_and_shift_two_focal, "x_homo"_a, "y_homo"_a, "depth_x"_a,
-          "depth_y"_a);
     m.def("solve_scale_shift_pose", &solve_scale_shift_pose_wrapper, "x_homo"_a, "y_homo"_a, "depth_x"_a, "depth_y"_a);
     m.def("solve_scale_shift_pose_shared_focal", &solve_scale_shift_pose_shared_focal_wrapper, "x_homo"_a, "y_homo"_a,
           "depth_x"_a, "depth_y"_a);
     m.def("solve_scale_shift_pose_two_focal", &solve_scale_shift_pose_two_focal_wrapper, "x_homo"_a, "y_homo"_a,
           "depth_x"_a, "depth_y"_a);
     m.def("HybridEstimatePoseAndScale", &HybridEstimatePoseAndScale, "x0"_a, "x1"_a, "depth0"_a, "depth1"_a, "K0"_a,
-          "K1"_a, "options"_a, "est_config"_a = EstimatorConfig());
+          "K1"_a, "options"_a, "est_config"_a = EstimatorConfig(), "scores"_a = std::vector<double>());
     m.def("HybridEstimatePoseScaleOffset", &HybridEstimatePoseScaleOffset, "x0"_a, "x1"_a, "depth0"_a, "depth1"_a,
-          "min_depth"_a, "K0"_a, "K1"_a, "options"_a, "est_config"_a = EstimatorConfig());
+          "min_depth"_a, "K0"_a, "K1"_a, "options"_a, "est_config"_a = EstimatorConfig(),
+          "scores"_a = std::vector<double>());
     m.def("HybridEstimatePoseScaleOffsetSharedFocal", &HybridEstimatePoseScaleOffsetSharedFocal, "x0"_a, "x1"_a,
-          "depth0"_a, "depth1"_a, "min_depth"_a, "pp0"_a, "pp1"_a, "options"_a, "est_config"_a = EstimatorConfig());
+          "depth0"_a, "depth1"_a, "min_depth"_a, "pp0"_a, "pp1"_a, "options"_a, "est_config"_a = EstimatorConfig(),
+          "scores"_a = std::vector<double>());
     m.def("HybridEstimatePoseScaleOffsetTwoFocal", &HybridEstimatePoseScaleOffsetTwoFocal, "x0"_a, "x1"_a, "depth0"_a,
-          "depth1"_a, "min_depth"_a, "pp0"_a, "pp1"_a, "options"_a, "est_config"_a = EstimatorConfig());
+          "depth1"_a, "min_depth"_a, "pp0"_a, "pp1"_a, "options"_a, "est_config"_a = EstimatorConfig(),
+          "scores"_a = std::vector<double>());
 }
 
 } // namespace madpose
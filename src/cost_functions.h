@@ -123,6 +123,304 @@ struct SampsonErrorFunctor {
     const double weight_;
 };
 
+// Jacobian of R(q) v, or of R(q)^T v if transpose is set, with respect to the
+// quaternion q = (w, x, y, z) before its normalization in
+// QuaternionToRotationMatrix.
+inline Eigen::Matrix<double, 3, 4> RotatedPointJacobian(const Eigen::Vector4d &qvec, const Eigen::Vector3d &v,
+                                                        const bool transpose) {
+    const double kNorm = qvec.norm();
+    const Eigen::Vector4d q = qvec / kNorm;
+    const double w = transpose ? -q(0) : q(0);
+    const Eigen::Vector3d u = q.tail<3>();
+
+    // R v = v + 2 w (u x v) + 2 u x (u x v) for a unit quaternion, and R^T v
+    // the same with w negated.
+    Eigen::Matrix3d v_cross;
+    v_cross << 0.0, -v(2), v(1), v(2), 0.0, -v(0), -v(1), v(0), 0.0;
+    Eigen::Matrix<double, 3, 4> J;
+    J.col(0) = (transpose ? -2.0 : 2.0) * u.cross(v);
+    J.rightCols<3>() = -2.0 * w * v_cross + 2.0 * (u.dot(v) * Eigen::Matrix3d::Identity() + u * v.transpose()) -
+                       4.0 * v * u.transpose();
+    // Chain rule through the normalization.
+    return (J - (J * q) * q.transpose()) / kNorm;
+}
+
+// Jacobian of the inhomogeneous coordinates of the projection of X with
+// respect to X.
+inline Eigen::Matrix<double, 2, 3> ProjectionJacobian(const Eigen::Vector3d &X) {
+    const double kInvZ = 1.0 / X(2);
+    Eigen::Matrix<double, 2, 3> J;
+    J << kInvZ, 0.0, -X(0) * kInvZ * kInvZ, 0.0, kInvZ, -X(1) * kInvZ * kInvZ;
+    return J;
+}
+
+// The rotation, the essential matrix E = [t]_x R and the matrix
+// F = diag(1 / f1, 1 / f1, 1) * E * diag(1 / f0, 1 / f0, 1) of the current
+// parameters, which are the same for all residuals of an evaluation, and the
+// derivatives of R and E with respect to the quaternion before its
+// normalization. The focal lengths are 1 in the calibrated case.
+struct PoseEvaluationState {
+    void Update(const double *q, const double *t, const double f0, const double f1, const bool jacobians) {
+        qvec = Eigen::Map<const Eigen::Vector4d>(q);
+        tvec = Eigen::Map<const Eigen::Vector3d>(t);
+        R = QuaternionToRotationMatrix<double>(qvec);
+        Rt = R.transpose();
+        Rt_t = Rt * tvec;
+        E = to_essential_matrix(R, tvec);
+        focal0 = f0;
+        focal1 = f1;
+        inv_K0 = Eigen::Vector3d(1.0 / f0, 1.0 / f0, 1.0);
+        inv_K1 = Eigen::Vector3d(1.0 / f1, 1.0 / f1, 1.0);
+        F = inv_K1.asDiagonal() * E * inv_K0.asDiagonal();
+        has_jacobians = jacobians;
+        if (!jacobians)
+            return;
+
+        for (int j = 0; j < 3; ++j) {
+            const Eigen::Matrix<double, 3, 4> J = RotatedPointJacobian(qvec, Eigen::Vector3d::Unit(j), false);
+            for (int k = 0; k < 4; ++k)
+                dR[k].col(j) = J.col(k);
+        }
+        Eigen::Matrix3d t_cross;
+        t_cross << 0.0, -tvec(2), tvec(1), tvec(2), 0.0, -tvec(0), -tvec(1), tvec(0), 0.0;
+        for (int k = 0; k < 4; ++k)
+            dE[k] = t_cross * dR[k];
+    }
+
+    // Jacobian of R v, or of R^T v if transpose is set, with respect to the
+    // quaternion. Requires the derivatives.
+    Eigen::Matrix<double, 3, 4> RotationJacobian(const Eigen::Vector3d &v, const bool transpose) const {
+        Eigen::Matrix<double, 3, 4> J;
+        for (int k = 0; k < 4; ++k) {
+            if (transpose)
+                J.col(k) = dR[k].transpose() * v;
+            else
+                J.col(k) = dR[k] * v;
+        }
+        return J;
+    }
+
+    Eigen::Vector4d qvec;
+    Eigen::Vector3d tvec;
+    Eigen::Matrix3d R, Rt;
+    Eigen::Vector3d Rt_t;
+    Eigen::Matrix3d E, F;
+    double focal0, focal1;
+    // Diagonals of the inverse calibration matrices.
+    Eigen::Vector3d inv_K0, inv_K1;
+
+    bool has_jacobians = false;
+    Eigen::Matrix3d dR[4], dE[4];
+};
+
+// Updates a PoseEvaluationState from the pose parameter blocks, and the focal
+// lengths if given, once before each evaluation of a problem, so that the cost
+// functions sharing the state do not recompute it for every residual.
+class PoseEvaluationCallback : public ceres::EvaluationCallback {
+  public:
+    PoseEvaluationCallback(const double *qvec, const double *tvec, const double *focal0 = nullptr,
+                           const double *focal1 = nullptr)
+        : qvec_(qvec), tvec_(tvec), focal0_(focal0), focal1_(focal1) {}
+
+    void PrepareForEvaluation(const bool evaluate_jacobians, const bool new_evaluation_point) override {
+        if (!new_evaluation_point && (state_.has_jacobians || !evaluate_jacobians))
+            return;
+        state_.Update(qvec_, tvec_, focal0_ != nullptr ? *focal0_ : 1.0, focal1_ != nullptr ? *focal1_ : 1.0,
+                      evaluate_jacobians);
+    }
+
+    const PoseEvaluationState *state() const { return &state_; }
+
+  private:
+    const double *qvec_, *tvec_, *focal0_, *focal1_;
+    PoseEvaluationState state_;
+};
+
+// Returns shared if it is set, and otherwise the state of the given parameters
+// computed into *local, e.g. for a cost function evaluated on its own.
+inline const PoseEvaluationState &EvaluationState(const PoseEvaluationState *shared, const double *qvec,
+                                                  const double *tvec, const double f0, const double f1,
+                                                  double **jacobians, PoseEvaluationState *local) {
+    if (shared != nullptr)
+        return *shared;
+    local->Update(qvec, tvec, f0, f1, jacobians != nullptr);
+    return *local;
+}
+
+// LiftProjectionFunctor0 with analytic derivatives.
+class LiftProjectionCostFunction0 : public ceres::SizedCostFunction<2, 1, 4, 3> {
+  public:
+    // If state is set, it must hold the PoseEvaluationState of the parameters
+    // of each evaluation, e.g. as kept by a PoseEvaluationCallback.
+    LiftProjectionCostFunction0(const Eigen::Vector3d &x0_calib, const Eigen::Vector3d &x1, const double &x0_depth,
+                                const Eigen::Matrix3d &K1, const PoseEvaluationState *state = nullptr)
+        : x0_calib_(x0_calib), x1_(x1), K1_(K1), x0_depth_(x0_depth), state_(state) {}
+    static ceres::CostFunction *Create(const Eigen::Vector3d &x0_calib, const Eigen::Vector3d &x1,
+                                       const double &x0_depth, const Eigen::Matrix3d &K1,
+                                       const PoseEvaluationState *state = nullptr) {
+        return new LiftProjectionCostFunction0(x0_calib, x1, x0_depth, K1, state);
+    }
+
+    bool Evaluate(double const *const *parameters, double *residuals, double **jacobians) const override {
+        const double *o0 = parameters[0];
+        PoseEvaluationState local;
+        const PoseEvaluationState &pose =
+            EvaluationState(state_, parameters[1], parameters[2], 1.0, 1.0, jacobians, &local);
+
+        const Eigen::Vector3d x3d = x0_calib_ * (x0_depth_ + o0[0]);
+        const Eigen::Vector3d x1_hat = K1_ * (pose.R * x3d + pose.tvec);
+        residuals[0] = x1_hat[0] / x1_hat[2] - x1_[0];
+        residuals[1] = x1_hat[1] / x1_hat[2] - x1_[1];
+
+        if (jacobians == nullptr)
+            return true;
+        const Eigen::Matrix<double, 2, 3> J_point = ProjectionJacobian(x1_hat) * K1_;
+        if (jacobians[0] != nullptr) {
+            Eigen::Map<Eigen::Vector2d> J(jacobians[0]);
+            J = J_point * (pose.R * x0_calib_);
+        }
+        if (jacobians[1] != nullptr) {
+            Eigen::Map<Eigen::Matrix<double, 2, 4, Eigen::RowMajor>> J(jacobians[1]);
+            J = J_point * pose.RotationJacobian(x3d, false);
+        }
+        if (jacobians[2] != nullptr) {
+            Eigen::Map<Eigen::Matrix<double, 2, 3, Eigen::RowMajor>> J(jacobians[2]);
+            J = J_point;
+        }
+        return true;
+    }
+
+  private:
+    const Eigen::Vector3d x0_calib_, x1_;
+    const Eigen::Matrix3d K1_;
+    const double x0_depth_;
+    const PoseEvaluationState *state_;
+};
+
+// LiftProjectionFunctor1 with analytic derivatives.
+class LiftProjectionCostFunction1 : public ceres::SizedCostFunction<2, 1, 1, 4, 3> {
+  public:
+    LiftProjectionCostFunction1(const Eigen::Vector3d &x1_calib, const Eigen::Vector3d &x0, const double &x1_depth,
+                                const Eigen::Matrix3d &K0, const PoseEvaluationState *state = nullptr)
+        : x1_calib_(x1_calib), x0_(x0), K0_(K0), x1_depth_(x1_depth), state_(state) {}
+    static ceres::CostFunction *Create(const Eigen::Vector3d &x1_calib, const Eigen::Vector3d &x0,
+                                       const double &x1_depth, const Eigen::Matrix3d &K0,
+                                       const PoseEvaluationState *state = nullptr) {
+        return new LiftProjectionCostFunction1(x1_calib, x0, x1_depth, K0, state);
+    }
+
+    bool Evaluate(double const *const *parameters, double *residuals, double **jacobians) const override {
+        const double *scale = parameters[0];
+        const double *o1 = parameters[1];
+        PoseEvaluationState local;
+        const PoseEvaluationState &pose =
+            EvaluationState(state_, parameters[2], parameters[3], 1.0, 1.0, jacobians, &local);
+
+        const Eigen::Vector3d x3d = x1_calib_ * (x1_depth_ + o1[0]) * scale[0];
+        const Eigen::Matrix3d &Rt = pose.Rt;
+        const Eigen::Vector3d x0_hat = K0_ * (Rt * x3d - pose.Rt_t);
+        residuals[0] = x0_hat[0] / x0_hat[2] - x0_[0];
+        residuals[1] = x0_hat[1] / x0_hat[2] - x0_[1];
+
+        if (jacobians == nullptr)
+            return true;
+        const Eigen::Matrix<double, 2, 3> J_point = ProjectionJacobian(x0_hat) * K0_ * Rt;
+        if (jacobians[0] != nullptr) {
+            Eigen::Map<Eigen::Vector2d> J(jacobians[0]);
+            J = J_point * (x1_calib_ * (x1_depth_ + o1[0]));
+        }
+        if (jacobians[1] != nullptr) {
+            Eigen::Map<Eigen::Vector2d> J(jacobians[1]);
+            J = J_point * (x1_calib_ * scale[0]);
+        }
+        if (jacobians[2] != nullptr) {
+            Eigen::Map<Eigen::Matrix<double, 2, 4, Eigen::RowMajor>> J(jacobians[2]);
+            J = ProjectionJacobian(x0_hat) * K0_ * pose.RotationJacobian(x3d - pose.tvec, true);
+        }
+        if (jacobians[3] != nullptr) {
+            Eigen::Map<Eigen::Matrix<double, 2, 3, Eigen::RowMajor>> J(jacobians[3]);
+            J = -J_point;
+        }
+        return true;
+    }
+
+  private:
+    const Eigen::Vector3d x1_calib_, x0_;
+    const Eigen::Matrix3d K0_;
+    const double x1_depth_;
+    const PoseEvaluationState *state_;
+};
+
+// Sampson error of the correspondence (x0, x1), given in homogeneous
+// coordinates with unit last entry, under the matrix E, and its gradient
+// dE with respect to E.
+inline double SampsonErrorAndGradient(const Eigen::Matrix3d &E, const Eigen::Vector3d &x0, const Eigen::Vector3d &x1,
+                                      Eigen::Matrix3d *dE) {
+    const Eigen::Vector3d Ex0 = E * x0;
+    const Eigen::Vector3d Etx1 = E.transpose() * x1;
+    const double C = x1.dot(Ex0);
+    const double kNorm = std::sqrt(Ex0.head<2>().squaredNorm() + Etx1.head<2>().squaredNorm());
+    if (dE != nullptr) {
+        const Eigen::Vector3d a(Ex0(0), Ex0(1), 0.0);
+        const Eigen::Vector3d b(Etx1(0), Etx1(1), 0.0);
+        const double kRatio = C / (kNorm * kNorm);
+        *dE = (x1 * x0.transpose() - kRatio * (a * x0.transpose() + x1 * b.transpose())) / kNorm;
+    }
+    return C / kNorm;
+}
+
+// Writes the gradients of <G, [t]_x R> with respect to the quaternion of R and
+// to t to dq and dt, which may be null, given its gradient G with respect to
+// the essential matrix [t]_x R of pose.
+inline void EssentialMatrixChainRule(const Eigen::Matrix3d &G, const PoseEvaluationState &pose, double *dq,
+                                     double *dt) {
+    if (dq != nullptr) {
+        Eigen::Map<Eigen::RowVector4d> J(dq);
+        for (int k = 0; k < 4; ++k)
+            J(k) = G.cwiseProduct(pose.dE[k]).sum();
+    }
+    if (dt != nullptr) {
+        const Eigen::Matrix3d M = G * pose.Rt;
+        Eigen::Map<Eigen::RowVector3d> J(dt);
+        J << M(2, 1) - M(1, 2), M(0, 2) - M(2, 0), M(1, 0) - M(0, 1);
+    }
+}
+
+// SampsonErrorFunctor with analytic derivatives.
+class SampsonErrorCostFunction : public ceres::SizedCostFunction<1, 4, 3> {
+  public:
+    SampsonErrorCostFunction(const Eigen::Vector3d &x0, const Eigen::Vector3d &x1, const Eigen::Matrix3d &K0,
+                             const Eigen::Matrix3d &K1, const double &sq_weight = 1.0,
+                             const PoseEvaluationState *state = nullptr)
+        : x0_(x0(0), x0(1), 1.0), x1_(x1(0), x1(1), 1.0),
+          factor_(std::sqrt(sq_weight) / (1.0 / (K0(0, 0) + K0(1, 1)) + 1.0 / (K1(0, 0) + K1(1, 1)))),
+          state_(state) {}
+
+    static ceres::CostFunction *Create(const Eigen::Vector3d &x0, const Eigen::Vector3d &x1, const Eigen::Matrix3d &K0,
+                                       const Eigen::Matrix3d &K1, const double &sq_weight = 1.0,
+                                       const PoseEvaluationState *state = nullptr) {
+        return new SampsonErrorCostFunction(x0, x1, K0, K1, sq_weight, state);
+    }
+
+    bool Evaluate(double const *const *parameters, double *residuals, double **jacobians) const override {
+        PoseEvaluationState local;
+        const PoseEvaluationState &pose =
+            EvaluationState(state_, parameters[0], parameters[1], 1.0, 1.0, jacobians, &local);
+
+        const bool kJacobians = jacobians != nullptr && (jacobians[0] != nullptr || jacobians[1] != nullptr);
+        Eigen::Matrix3d G;
+        residuals[0] = factor_ * SampsonErrorAndGradient(pose.E, x0_, x1_, kJacobians ? &G : nullptr);
+        if (kJacobians)
+            EssentialMatrixChainRule(factor_ * G, pose, jacobians[0], jacobians[1]);
+        return true;
+    }
+
+  private:
+    const Eigen::Vector3d x0_, x1_;
+    const double factor_;
+    const PoseEvaluationState *state_;
+};
+
 // *********************************************************************
 //
 // -------------- Cost Functors for shared-focal cases -----------------
@@ -241,6 +539,192 @@ struct SampsonErrorSharedFocalFunctor {
     const double weight_;
 };
 
+// Jacobian of the residual f * pi(Y) - x of a camera with focal length f with
+// respect to the point Y in its frame, where pi is the projection to
+// inhomogeneous coordinates, and the derivative of the residual with respect
+// to f.
+inline Eigen::Matrix<double, 2, 3> FocalProjectionJacobian(const Eigen::Vector3d &Y, const double f,
+                                                           Eigen::Vector2d *d_focal) {
+    *d_focal = Y.head<2>() / Y(2);
+    return f * ProjectionJacobian(Y);
+}
+
+// Derivative with respect to f of the point K^-1 x * depth with
+// K = diag(f, f, 1), given the point X = K^-1 x * depth.
+inline Eigen::Vector3d UnprojectedPointFocalDerivative(const Eigen::Vector3d &X, const double f) {
+    return Eigen::Vector3d(-X(0) / f, -X(1) / f, 0.0);
+}
+
+// Residual of a Sampson error functor on the matrix F of pose, and its
+// Jacobians with respect to q, t, f0 and f1. Any of the Jacobians may be null.
+inline double FocalSampsonError(const PoseEvaluationState &pose, const Eigen::Vector3d &x0, const Eigen::Vector3d &x1,
+                                const double weight, double *dq, double *dt, double *df0, double *df1) {
+    const bool kJacobians = dq != nullptr || dt != nullptr || df0 != nullptr || df1 != nullptr;
+    Eigen::Matrix3d G;
+    const double kResidual = weight * SampsonErrorAndGradient(pose.F, x0, x1, kJacobians ? &G : nullptr);
+    if (!kJacobians)
+        return kResidual;
+
+    G *= weight;
+    EssentialMatrixChainRule(pose.inv_K1.asDiagonal() * G * pose.inv_K0.asDiagonal(), pose, dq, dt);
+    // F depends on 1 / f0 linearly through its first two columns and on 1 / f1
+    // through its first two rows.
+    if (df0 != nullptr)
+        *df0 = -G.cwiseProduct(pose.F).leftCols<2>().sum() / pose.focal0;
+    if (df1 != nullptr)
+        *df1 = -G.cwiseProduct(pose.F).topRows<2>().sum() / pose.focal1;
+    return kResidual;
+}
+
+// LiftProjectionSharedFocalFunctor0 with analytic derivatives.
+class LiftProjectionSharedFocalCostFunction0 : public ceres::SizedCostFunction<2, 1, 4, 3, 1> {
+  public:
+    LiftProjectionSharedFocalCostFunction0(const Eigen::Vector3d &x0, const Eigen::Vector3d &x1,
+                                           const double &x0_depth, const PoseEvaluationState *state = nullptr)
+        : x0_(x0), x1_(x1), x0_depth_(x0_depth), state_(state) {}
+    static ceres::CostFunction *Create(const Eigen::Vector3d &x0, const Eigen::Vector3d &x1, const double &x0_depth,
+                                       const PoseEvaluationState *state = nullptr) {
+        return new LiftProjectionSharedFocalCostFunction0(x0, x1, x0_depth, state);
+    }
+
+    bool Evaluate(double const *const *parameters, double *residuals, double **jacobians) const override {
+        const double *o0 = parameters[0];
+        const double f = parameters[3][0];
+        PoseEvaluationState local;
+        const PoseEvaluationState &pose =
+            EvaluationState(state_, parameters[1], parameters[2], f, f, jacobians, &local);
+        const Eigen::Matrix3d &R = pose.R;
+
+        const Eigen::Vector3d x0_calib(x0_(0) / f, x0_(1) / f, x0_(2));
+        const Eigen::Vector3d x3d = x0_calib * (x0_depth_ + o0[0]);
+        const Eigen::Vector3d x3d_1 = R * x3d + pose.tvec;
+        residuals[0] = f * x3d_1(0) / x3d_1(2) - x1_(0);
+        residuals[1] = f * x3d_1(1) / x3d_1(2) - x1_(1);
+
+        if (jacobians == nullptr)
+            return true;
+        Eigen::Vector2d d_focal;
+        const Eigen::Matrix<double, 2, 3> J_point = FocalProjectionJacobian(x3d_1, f, &d_focal);
+        if (jacobians[0] != nullptr) {
+            Eigen::Map<Eigen::Vector2d> J(jacobians[0]);
+            J = J_point * (R * x0_calib);
+        }
+        if (jacobians[1] != nullptr) {
+            Eigen::Map<Eigen::Matrix<double, 2, 4, Eigen::RowMajor>> J(jacobians[1]);
+            J = J_point * pose.RotationJacobian(x3d, false);
+        }
+        if (jacobians[2] != nullptr) {
+            Eigen::Map<Eigen::Matrix<double, 2, 3, Eigen::RowMajor>> J(jacobians[2]);
+            J = J_point;
+        }
+        if (jacobians[3] != nullptr) {
+            Eigen::Map<Eigen::Vector2d> J(jacobians[3]);
+            J = d_focal + J_point * (R * UnprojectedPointFocalDerivative(x3d, f));
+        }
+        return true;
+    }
+
+  private:
+    const Eigen::Vector3d x0_, x1_;
+    const double x0_depth_;
+    const PoseEvaluationState *state_;
+};
+
+// LiftProjectionSharedFocalFunctor1 with analytic derivatives.
+class LiftProjectionSharedFocalCostFunction1 : public ceres::SizedCostFunction<2, 1, 1, 4, 3, 1> {
+  public:
+    LiftProjectionSharedFocalCostFunction1(const Eigen::Vector3d &x1, const Eigen::Vector3d &x0,
+                                           const double &x1_depth, const PoseEvaluationState *state = nullptr)
+        : x1_(x1), x0_(x0), x1_depth_(x1_depth), state_(state) {}
+    static ceres::CostFunction *Create(const Eigen::Vector3d &x1, const Eigen::Vector3d &x0, const double &x1_depth,
+                                       const PoseEvaluationState *state = nullptr) {
+        return new LiftProjectionSharedFocalCostFunction1(x1, x0, x1_depth, state);
+    }
+
+    bool Evaluate(double const *const *parameters, double *residuals, double **jacobians) const override {
+        const double *scale = parameters[0];
+        const double *o1 = parameters[1];
+        const double f = parameters[4][0];
+        PoseEvaluationState local;
+        const PoseEvaluationState &pose =
+            EvaluationState(state_, parameters[2], parameters[3], f, f, jacobians, &local);
+        const Eigen::Matrix3d &Rt = pose.Rt;
+
+        const Eigen::Vector3d x1_calib(x1_(0) / f, x1_(1) / f, x1_(2));
+        const Eigen::Vector3d x3d = x1_calib * (x1_depth_ + o1[0]) * scale[0];
+        const Eigen::Vector3d x3d_0 = Rt * x3d - pose.Rt_t;
+        residuals[0] = f * x3d_0(0) / x3d_0(2) - x0_(0);
+        residuals[1] = f * x3d_0(1) / x3d_0(2) - x0_(1);
+
+        if (jacobians == nullptr)
+            return true;
+        Eigen::Vector2d d_focal;
+        const Eigen::Matrix<double, 2, 3> J_proj = FocalProjectionJacobian(x3d_0, f, &d_focal);
+        const Eigen::Matrix<double, 2, 3> J_point = J_proj * Rt;
+        if (jacobians[0] != nullptr) {
+            Eigen::Map<Eigen::Vector2d> J(jacobians[0]);
+            J = J_point * (x1_calib * (x1_depth_ + o1[0]));
+        }
+        if (jacobians[1] != nullptr) {
+            Eigen::Map<Eigen::Vector2d> J(jacobians[1]);
+            J = J_point * (x1_calib * scale[0]);
+        }
+        if (jacobians[2] != nullptr) {
+            Eigen::Map<Eigen::Matrix<double, 2, 4, Eigen::RowMajor>> J(jacobians[2]);
+            J = J_proj * pose.RotationJacobian(x3d - pose.tvec, true);
+        }
+        if (jacobians[3] != nullptr) {
+            Eigen::Map<Eigen::Matrix<double, 2, 3, Eigen::RowMajor>> J(jacobians[3]);
+            J = -J_point;
+        }
+        if (jacobians[4] != nullptr) {
+            Eigen::Map<Eigen::Vector2d> J(jacobians[4]);
+            J = d_focal + J_point * UnprojectedPointFocalDerivative(x3d, f);
+        }
+        return true;
+    }
+
+  private:
+    const Eigen::Vector3d x1_, x0_;
+    const double x1_depth_;
+    const PoseEvaluationState *state_;
+};
+
+// SampsonErrorSharedFocalFunctor with analytic derivatives.
+class SampsonErrorSharedFocalCostFunction : public ceres::SizedCostFunction<1, 4, 3, 1> {
+  public:
+    SampsonErrorSharedFocalCostFunction(const Eigen::Vector3d &x0, const Eigen::Vector3d &x1,
+                                        const double &sq_weight = 1.0, const PoseEvaluationState *state = nullptr)
+        : x0_(x0(0), x0(1), 1.0), x1_(x1(0), x1(1), 1.0), weight_(std::sqrt(sq_weight)), state_(state) {}
+
+    static ceres::CostFunction *Create(const Eigen::Vector3d &x0, const Eigen::Vector3d &x1,
+                                       const double &sq_weight = 1.0, const PoseEvaluationState *state = nullptr) {
+        return new SampsonErrorSharedFocalCostFunction(x0, x1, sq_weight, state);
+    }
+
+    bool Evaluate(double const *const *parameters, double *residuals, double **jacobians) const override {
+        const double f = parameters[2][0];
+        PoseEvaluationState local;
+        const PoseEvaluationState &pose =
+            EvaluationState(state_, parameters[0], parameters[1], f, f, jacobians, &local);
+        double *const kNoJacobians[3] = {nullptr, nullptr, nullptr};
+        double *const *J = jacobians != nullptr ? jacobians : kNoJacobians;
+
+        // The focal length enters both sides of F.
+        double df0, df1;
+        residuals[0] = FocalSampsonError(pose, x0_, x1_, weight_, J[0], J[1], J[2] ? &df0 : nullptr,
+                                         J[2] ? &df1 : nullptr);
+        if (J[2] != nullptr)
+            J[2][0] = df0 + df1;
+        return true;
+    }
+
+  private:
+    const Eigen::Vector3d x0_, x1_;
+    const double weight_;
+    const PoseEvaluationState *state_;
+};
+
 // ******************************************************************
 //
 // -------------- Cost Functors for two-focal cases -----------------
@@ -363,4 +847,248 @@ struct SampsonErrorTwoFocalFunctor {
     const double weight_;
 };
 
+// LiftProjectionTwoFocalFunctor0 with analytic derivatives.
+class LiftProjectionTwoFocalCostFunction0 : public ceres::SizedCostFunction<2, 1, 4, 3, 1, 1> {
+  public:
+    LiftProjectionTwoFocalCostFunction0(const Eigen::Vector3d &x0, const Eigen::Vector3d &x1, const double &x0_depth,
+                                        const PoseEvaluationState *state = nullptr)
+        : x0_(x0), x1_(x1), x0_depth_(x0_depth), state_(state) {}
+    static ceres::CostFunction *Create(const Eigen::Vector3d &x0, const Eigen::Vector3d &x1, const double &x0_depth,
+                                       const PoseEvaluationState *state = nullptr) {
+        return new LiftProjectionTwoFocalCostFunction0(x0, x1, x0_depth, state);
+    }
+
+    bool Evaluate(double const *const *parameters, double *residuals, double **jacobians) const override {
+        const double *o0 = parameters[0];
+        const double f0 = parameters[3][0];
+        const double f1 = parameters[4][0];
+        PoseEvaluationState local;
+        const PoseEvaluationState &pose =
+            EvaluationState(state_, parameters[1], parameters[2], f0, f1, jacobians, &local);
+        const Eigen::Matrix3d &R = pose.R;
+
+        const Eigen::Vector3d x0_calib(x0_(0) / f0, x0_(1) / f0, x0_(2));
+        const Eigen::Vector3d x3d = x0_calib * (x0_depth_ + o0[0]);
+        const Eigen::Vector3d x3d_1 = R * x3d + pose.tvec;
+        residuals[0] = f1 * x3d_1(0) / x3d_1(2) - x1_(0);
+        residuals[1] = f1 * x3d_1(1) / x3d_1(2) - x1_(1);
+
+        if (jacobians == nullptr)
+            return true;
+        Eigen::Vector2d d_focal1;
+        const Eigen::Matrix<double, 2, 3> J_point = FocalProjectionJacobian(x3d_1, f1, &d_focal1);
+        if (jacobians[0] != nullptr) {
+            Eigen::Map<Eigen::Vector2d> J(jacobians[0]);
+            J = J_point * (R * x0_calib);
+        }
+        if (jacobians[1] != nullptr) {
+            Eigen::Map<Eigen::Matrix<double, 2, 4, Eigen::RowMajor>> J(jacobians[1]);
+            J = J_point * pose.RotationJacobian(x3d, false);
+        }
+        if (jacobians[2] != nullptr) {
+            Eigen::Map<Eigen::Matrix<double, 2, 3, Eigen::RowMajor>> J(jacobians[2]);
+            J = J_point;
+        }
+        if (jacobians[3] != nullptr) {
+            Eigen::Map<Eigen::Vector2d> J(jacobians[3]);
+            J = J_point * (R * UnprojectedPointFocalDerivative(x3d, f0));
+        }
+        if (jacobians[4] != nullptr) {
+            Eigen::Map<Eigen::Vector2d> J(jacobians[4]);
+            J = d_focal1;
+        }
+        return true;
+    }
+
+  private:
+    const Eigen::Vector3d x0_, x1_;
+    const double x0_depth_;
+    const PoseEvaluationState *state_;
+};
+
+// LiftProjectionTwoFocalFunctor1 with analytic derivatives.
+class LiftProjectionTwoFocalCostFunction1 : public ceres::SizedCostFunction<2, 1, 1, 4, 3, 1, 1> {
+  public:
+    LiftProjectionTwoFocalCostFunction1(const Eigen::Vector3d &x1, const Eigen::Vector3d &x0, const double &x1_depth,
+                                        const PoseEvaluationState *state = nullptr)
+        : x1_(x1), x0_(x0), x1_depth_(x1_depth), state_(state) {}
+    static ceres::CostFunction *Create(const Eigen::Vector3d &x1, const Eigen::Vector3d &x0, const double &x1_depth,
+                                       const PoseEvaluationState *state = nullptr) {
+        return new LiftProjectionTwoFocalCostFunction1(x1, x0, x1_depth, state);
+    }
+
+    bool Evaluate(double const *const *parameters, double *residuals, double **jacobians) const override {
+        const double *scale = parameters[0];
+        const double *o1 = parameters[1];
+        const double f0 = parameters[4][0];
+        const double f1 = parameters[5][0];
+        PoseEvaluationState local;
+        const PoseEvaluationState &pose =
+            EvaluationState(state_, parameters[2], parameters[3], f0, f1, jacobians, &local);
+        const Eigen::Matrix3d &Rt = pose.Rt;
+
+        const Eigen::Vector3d x1_calib(x1_(0) / f1, x1_(1) / f1, x1_(2));
+        const Eigen::Vector3d x3d = x1_calib * (x1_depth_ + o1[0]) * scale[0];
+        const Eigen::Vector3d x3d_0 = Rt * x3d - pose.Rt_t;
+        residuals[0] = f0 * x3d_0(0) / x3d_0(2) - x0_(0);
+        residuals[1] = f0 * x3d_0(1) / x3d_0(2) - x0_(1);
+
+        if (jacobians == nullptr)
+            return true;
+        Eigen::Vector2d d_focal0;
+        const Eigen::Matrix<double, 2, 3> J_proj = FocalProjectionJacobian(x3d_0, f0, &d_focal0);
+        const Eigen::Matrix<double, 2, 3> J_point = J_proj * Rt;
+        if (jacobians[0] != nullptr) {
+            Eigen::Map<Eigen::Vector2d> J(jacobians[0]);
+            J = J_point * (x1_calib * (x1_depth_ + o1[0]));
+        }
+        if (jacobians[1] != nullptr) {
+            Eigen::Map<Eigen::Vector2d> J(jacobians[1]);
+            J = J_point * (x1_calib * scale[0]);
+        }
+        if (jacobians[2] != nullptr) {
+            Eigen::Map<Eigen::Matrix<double, 2, 4, Eigen::RowMajor>> J(jacobians[2]);
+            J = J_proj * pose.RotationJacobian(x3d - pose.tvec, true);
+        }
+        if (jacobians[3] != nullptr) {
+            Eigen::Map<Eigen::Matrix<double, 2, 3, Eigen::RowMajor>> J(jacobians[3]);
+            J = -J_point;
+        }
+        if (jacobians[4] != nullptr) {
+            Eigen::Map<Eigen::Vector2d> J(jacobians[4]);
+            J = d_focal0;
+        }
+        if (jacobians[5] != nullptr) {
+            Eigen::Map<Eigen::Vector2d> J(jacobians[5]);
+            J = J_point * UnprojectedPointFocalDerivative(x3d, f1);
+        }
+        return true;
+    }
+
+  private:
+    const Eigen::Vector3d x1_, x0_;
+    const double x1_depth_;
+    const PoseEvaluationState *state_;
+};
+
+// SampsonErrorTwoFocalFunctor with analytic derivatives.
+class SampsonErrorTwoFocalCostFunction : public ceres::SizedCostFunction<1, 4, 3, 1, 1> {
+  public:
+    SampsonErrorTwoFocalCostFunction(const Eigen::Vector3d &x0, const Eigen::Vector3d &x1,
+                                     const double &sq_weight = 1.0, const PoseEvaluationState *state = nullptr)
+        : x0_(x0(0), x0(1), 1.0), x1_(x1(0), x1(1), 1.0), weight_(std::sqrt(sq_weight)), state_(state) {}
+
+    static ceres::CostFunction *Create(const Eigen::Vector3d &x0, const Eigen::Vector3d &x1,
+                                       const double &sq_weight = 1.0, const PoseEvaluationState *state = nullptr) {
+        return new SampsonErrorTwoFocalCostFunction(x0, x1, sq_weight, state);
+    }
+
+    bool Evaluate(double const *const *parameters, double *residuals, double **jacobians) const override {
+        PoseEvaluationState local;
+        const PoseEvaluationState &pose = EvaluationState(state_, parameters[0], parameters[1], parameters[2][0],
+                                                          parameters[3][0], jacobians, &local);
+        double *const kNoJacobians[4] = {nullptr, nullptr, nullptr, nullptr};
+        double *const *J = jacobians != nullptr ? jacobians : kNoJacobians;
+        residuals[0] = FocalSampsonError(pose, x0_, x1_, weight_, J[0], J[1], J[2], J[3]);
+        return true;
+    }
+
+  private:
+    const Eigen::Vector3d x0_, x1_;
+    const double weight_;
+    const PoseEvaluationState *state_;
+};
+
+// *******************************************************************
+//
+// ---------------------- Batched cost functions ---------------------
+//
+// *******************************************************************
+
+// Applies loss to the residuals r of one data point and to their Jacobians J
+// with respect to parameter blocks of the given sizes, where J and any of its
+// entries may be null. The residuals are rescaled to sqrt(rho(s) / s) r with
+// s = |r|^2, so that their squared norm is the robust cost rho(s), and the
+// Jacobians become those of the rescaled residuals.
+inline void ApplyLossToResiduals(const ceres::LossFunction &loss, const int num_residuals,
+                                 const std::vector<int32_t> &block_sizes, double *r, double *const *J) {
+    double sq_norm = 0.0;
+    for (int i = 0; i < num_residuals; i++)
+        sq_norm += r[i] * r[i];
+    double rho[3];
+    loss.Evaluate(sq_norm, rho);
+
+    // At s = 0 the scale is sqrt(rho'(0)) and its derivative does not
+    // contribute.
+    double scale = std::sqrt(rho[1]);
+    // Twice the derivative of the scale with respect to s.
+    double scale_derivative = 0.0;
+    if (rho[0] > 0.0) {
+        scale = std::sqrt(rho[0] / sq_norm);
+        scale_derivative = (rho[1] * sq_norm - rho[0]) / (sq_norm * sq_norm * scale);
+    }
+
+    for (int k = 0; J != nullptr && k < block_sizes.size(); k++) {
+        if (J[k] == nullptr)
+            continue;
+        const int kSize = block_sizes[k];
+        for (int c = 0; c < kSize; c++) {
+            double r_dot_J = 0.0;
+            for (int i = 0; i < num_residuals; i++)
+                r_dot_J += r[i] * J[k][i * kSize + c];
+            for (int i = 0; i < num_residuals; i++)
+                J[k][i * kSize + c] = scale * J[k][i * kSize + c] + scale_derivative * r[i] * r_dot_J;
+        }
+    }
+    for (int i = 0; i < num_residuals; i++)
+        r[i] *= scale;
+}
+
+// Stacks the residuals of cost functions with the same parameter blocks, e.g.
+// those of all data points of one type, into a single residual block, so that
+// the solver handles one large block instead of many small ones. The loss
+// function is applied to the residuals of each cost function separately, so
+// the block itself is added to the problem without a loss function.
+class BatchedCostFunction : public ceres::CostFunction {
+  public:
+    explicit BatchedCostFunction(const ceres::LossFunction *loss_function) : loss_function_(loss_function) {}
+
+    void Clear() {
+        cost_functions_.clear();
+        set_num_residuals(0);
+    }
+
+    // Appends the residuals of cost_function, which is not owned.
+    void Add(const ceres::CostFunction *cost_function) {
+        if (cost_functions_.empty())
+            *mutable_parameter_block_sizes() = cost_function->parameter_block_sizes();
+        cost_functions_.push_back(cost_function);
+        set_num_residuals(num_residuals() + cost_function->num_residuals());
+    }
+
+    bool Evaluate(double const *const *parameters, double *residuals, double **jacobians) const override {
+        const std::vector<int32_t> &block_sizes = parameter_block_sizes();
+        double *cost_jacobians[kMaxNumParameterBlocks];
+        double **J = jacobians != nullptr ? cost_jacobians : nullptr;
+        int row = 0;
+        for (const ceres::CostFunction *cost_function : cost_functions_) {
+            for (int k = 0; J != nullptr && k < block_sizes.size(); k++)
+                J[k] = jacobians[k] != nullptr ? jacobians[k] + row * block_sizes[k] : nullptr;
+            if (!cost_function->Evaluate(parameters, residuals + row, J))
+                return false;
+            if (loss_function_ != nullptr)
+                ApplyLossToResiduals(*loss_function_, cost_function->num_residuals(), block_sizes, residuals + row, J);
+            row += cost_function->num_residuals();
+        }
+        return true;
+    }
+
+  private:
+    // The largest number of parameter blocks of the cost functions above.
+    static constexpr int kMaxNumParameterBlocks = 6;
+
+    const ceres::LossFunction *loss_function_;
+    std::vector<const ceres::CostFunction *> cost_functions_;
+};
+
 } // namespace madpose
@@ -23,6 +23,10 @@ class EstimatorConfig {
 
     bool min_depth_constraint = true;
     bool use_shift = true;
+
+    // Whether local optimization uses the built-in Levenberg-Marquardt refiner
+    // instead of Ceres. The final refinement always uses Ceres.
+    bool use_lm_refiner = false;
 };
 
 } // namespace madpose
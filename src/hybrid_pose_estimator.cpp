@@ -1,15 +1,18 @@
 #include "hybrid_pose_estimator.h"
 
+#include "alignment.h"
+
 #include <PoseLib/poselib.h>
 #include <PoseLib/solvers/relpose_5pt.h>
 
 namespace madpose {
 
-std::pair<PoseScaleOffset, ransac_lib::HybridRansacStatistics>
+std::pair<PoseScaleOffset, ExtendedHybridRansacStatistics>
 HybridEstimatePoseScaleOffset(const std::vector<Eigen::Vector2d> &x0, const std::vector<Eigen::Vector2d> &x1,
                               const std::vector<double> &depth0, const std::vector<double> &depth1,
                               const Eigen::Vector2d &min_depth, const Eigen::Matrix3d &K0, const Eigen::Matrix3d &K1,
-                              const ExtendedHybridLORansacOptions &options, const EstimatorConfig &est_config) {
+                              const ExtendedHybridLORansacOptions &options, const EstimatorConfig &est_config,
+                              const std::vector<double> &scores) {
     ExtendedHybridLORansacOptions ransac_options(options);
 
     // Change to "three data types"
@@ -22,23 +25,29 @@ HybridEstimatePoseScaleOffset(const std::vector<Eigen::Vector2d> &x0, const std:
     ransac_options.data_type_weights_[1] = ransac_options.data_type_weights_[0];
     ransac_options.squared_inlier_thresholds_[1] = ransac_options.squared_inlier_thresholds_[0];
 
-    HybridPoseEstimator solver(x0, x1, depth0, depth1, min_depth, K0, K1, sampson_squared_weight,
-                               ransac_options.squared_inlier_thresholds_, est_config);
+    // PROSAC samples the correspondences in the order of decreasing score.
+    const ScoreOrder order(scores, x0.size());
+    std::vector<Eigen::Vector2d> sorted_x0, sorted_x1;
+    std::vector<double> sorted_depth0, sorted_depth1;
+    HybridPoseEstimator solver(order.Apply(x0, &sorted_x0), order.Apply(x1, &sorted_x1),
+                               order.Apply(depth0, &sorted_depth0), order.Apply(depth1, &sorted_depth1), min_depth,
+                               K0, K1, sampson_squared_weight, ransac_options.squared_inlier_thresholds_, est_config);
 
     PoseScaleOffset best_solution;
-    ransac_lib::HybridRansacStatistics ransac_stats;
+    ExtendedHybridRansacStatistics ransac_stats;
 
-    HybridLOMSAC<PoseScaleOffset, std::vector<PoseScaleOffset>, HybridPoseEstimator> lomsac;
-    lomsac.EstimateModel(ransac_options, solver, &best_solution, &ransac_stats);
+    EstimateHybridModel(ransac_options, solver, !scores.empty(), &best_solution, &ransac_stats);
+    order.RestoreIndices(&ransac_stats.inlier_indices);
 
     return std::make_pair(best_solution, ransac_stats);
 }
 
-std::pair<PoseAndScale, ransac_lib::HybridRansacStatistics>
+std::pair<PoseAndScale, ExtendedHybridRansacStatistics>
 HybridEstimatePoseAndScale(const std::vector<Eigen::Vector2d> &x0, const std::vector<Eigen::Vector2d> &x1,
                            const std::vector<double> &depth0, const std::vector<double> &depth1,
                            const Eigen::Matrix3d &K0, const Eigen::Matrix3d &K1,
-                           const ExtendedHybridLORansacOptions &options, const EstimatorConfig &est_config) {
+                           const ExtendedHybridLORansacOptions &options, const EstimatorConfig &est_config,
+                           const std::vector<double> &scores) {
     ExtendedHybridLORansacOptions ransac_options(options);
 
     // Change to "three data types"
@@ -50,237 +59,203 @@ HybridEstimatePoseAndScale(const std::vector<Eigen::Vector2d> &x0, const std::ve
     ransac_options.data_type_weights_[1] = ransac_options.data_type_weights_[0];
     ransac_options.squared_inlier_thresholds_[1] = ransac_options.squared_inlier_thresholds_[0];
 
-    HybridPoseEstimatorScaleOnly solver(x0, x1, depth0, depth1, K0, K1, sampson_squared_weight,
-                                        ransac_options.squared_inlier_thresholds_, est_config);
+    // PROSAC samples the correspondences in the order of decreasing score.
+    const ScoreOrder order(scores, x0.size());
+    std::vector<Eigen::Vector2d> sorted_x0, sorted_x1;
+    std::vector<double> sorted_depth0, sorted_depth1;
+    HybridPoseEstimatorScaleOnly solver(order.Apply(x0, &sorted_x0), order.Apply(x1, &sorted_x1),
+                                        order.Apply(depth0, &sorted_depth0), order.Apply(depth1, &sorted_depth1), K0,
+                                        K1, sampson_squared_weight, ransac_options.squared_inlier_thresholds_,
+                                        est_config);
 
     PoseAndScale best_solution;
-    ransac_lib::HybridRansacStatistics ransac_stats;
+    ExtendedHybridRansacStatistics ransac_stats;
 
-    HybridLOMSAC<PoseAndScale, std::vector<PoseAndScale>, HybridPoseEstimatorScaleOnly> lomsac;
-    lomsac.EstimateModel(ransac_options, solver, &best_solution, &ransac_stats);
+    EstimateHybridModel(ransac_options, solver, !scores.empty(), &best_solution, &ransac_stats);
+    order.RestoreIndices(&ransac_stats.inlier_indices);
 
     return std::make_pair(best_solution, ransac_stats);
 }
 
 int HybridPoseEstimator::MinimalSolver(const std::vector<std::vector<int>> &sample, const int solver_idx,
-                                       std::vector<PoseScaleOffset> *models) const {
+                                       ModelVector *models) const {
     models->clear();
     if (solver_idx == 0) {
-        Eigen::Matrix3d x0 = K0_inv_ * x0_(Eigen::all, sample[0]);
-        Eigen::Matrix3d x1 = K1_inv_ * x1_(Eigen::all, sample[0]);
+        Eigen::Matrix3d x0, x1;
+        Eigen::Vector3d depth0, depth1;
+        for (int i = 0; i < 3; i++) {
+            x0.col(i) = view0_.calibrated(sample[0][i]);
+            x1.col(i) = view1_.calibrated(sample[0][i]);
+            depth0(i) = d0_(sample[0][i]);
+            depth1(i) = d1_(sample[0][i]);
+        }
 
-        std::vector<PoseScaleOffset> sols;
+        ScaleShiftPoses sols;
         if (est_config_.use_shift) {
-            int num_sols = solve_scale_shift_pose(x0, x1, d0_(sample[0]), d1_(sample[0]), &sols, false);
-            for (int i = 0; i < num_sols; i++) {
-                if (!est_config_.min_depth_constraint ||
-                    (sols[i].offset0 > -min_depth_(0) && sols[i].offset1 > -min_depth_(1) * sols[i].scale)) {
-                    PoseScaleOffset sol = sols[i];
-                    sol.offset1 /= sol.scale;
-                    models->push_back(sol);
-                }
-            }
+            solve_scale_shift_pose(x0, x1, depth0, depth1, &sols, false);
+            AddScaleShiftModels(sols, models);
         } else {
-            Eigen::Matrix3d p0 = x0.array().rowwise() * d0_(sample[0]).transpose().array();
-            Eigen::Matrix3d p1 = x1.array().rowwise() * d1_(sample[0]).transpose().array();
+            Eigen::Matrix3d p0 = x0.array().rowwise() * depth0.transpose().array();
+            Eigen::Matrix3d p1 = x1.array().rowwise() * depth1.transpose().array();
             Eigen::Vector3d v0, v1;
             v0 << (p0.col(0) - p0.col(1)).norm(), (p0.col(0) - p0.col(2)).norm(), (p0.col(1) - p0.col(2)).norm();
             v1 << (p1.col(0) - p1.col(1)).norm(), (p1.col(0) - p1.col(2)).norm(), (p1.col(1) - p1.col(2)).norm();
             // Find the least square scale s so that s * v1 = v0
             double scale = v1.dot(v0) / v1.squaredNorm();
 
-            Eigen::Vector3d d0 = d0_(sample[0]);
-            Eigen::Vector3d d1 = d1_(sample[0]) * scale;
+            Eigen::Vector3d d0 = depth0;
+            Eigen::Vector3d d1 = depth1 * scale;
             Eigen::Matrix3d X = x0.array().rowwise() * d0.transpose().array();
             Eigen::Matrix3d Y = x1.array().rowwise() * d1.transpose().array();
 
-            Eigen::Vector3d centroid_X = X.rowwise().mean();
-            Eigen::Vector3d centroid_Y = Y.rowwise().mean();
-
-            Eigen::MatrixXd X_centered = X.colwise() - centroid_X;
-            Eigen::MatrixXd Y_centered = Y.colwise() - centroid_Y;
-
-            Eigen::Matrix3d S = Y_centered * X_centered.transpose();
-
-            Eigen::JacobiSVD<Eigen::MatrixXd> svd(S, Eigen::ComputeFullU | Eigen::ComputeFullV);
-            Eigen::Matrix3d U = svd.matrixU();
-            Eigen::Matrix3d V = svd.matrixV();
-
-            if (U.determinant() * V.determinant() < 0) {
-                U.col(2) *= -1;
-            }
-            Eigen::Matrix3d R = U * V.transpose();
-            Eigen::Vector3d t = centroid_Y - R * centroid_X;
+            Eigen::Matrix3d R;
+            Eigen::Vector3d t;
+            AlignPoints(X, Y, &R, &t);
 
             models->push_back(PoseScaleOffset(R, t, scale, 0.0, 0.0));
         }
     } else if (solver_idx == 1) {
-        Eigen::MatrixXd x0 = K0_inv_ * x0_(Eigen::all, sample[2]);
-        Eigen::MatrixXd x1 = K1_inv_ * x1_(Eigen::all, sample[2]);
-
-        std::vector<Eigen::Vector3d> x0_vec(sample[2].size()), x1_vec(sample[2].size());
-        std::vector<Eigen::Vector2d> x0_2dvec(sample[2].size()), x1_2dvec(sample[2].size());
-        for (int i = 0; i < sample[2].size(); i++) {
-            x0_vec[i] = x0.col(i).normalized();
-            x1_vec[i] = x1.col(i).normalized();
-            x0_2dvec[i] = x0.col(i).head<2>();
-            x1_2dvec[i] = x1.col(i).head<2>();
+        // poselib takes its input and output as std::vector, which are kept
+        // per thread so that they only allocate on the first call.
+        thread_local std::vector<Eigen::Vector3d> x0_vec(5), x1_vec(5);
+        thread_local std::vector<poselib::CameraPose> poses;
+        Eigen::Matrix<double, 3, 5> x0_calib, x1_calib;
+        Eigen::Matrix<double, 5, 1> depth0, depth1;
+        for (int i = 0; i < 5; i++) {
+            x0_vec[i] = view0_.bearing(sample[2][i]);
+            x1_vec[i] = view1_.bearing(sample[2][i]);
+            x0_calib.col(i) = view0_.calibrated(sample[2][i]);
+            x1_calib.col(i) = view1_.calibrated(sample[2][i]);
+            depth0(i) = d0_(sample[2][i]);
+            depth1(i) = d1_(sample[2][i]);
         }
-        std::vector<poselib::CameraPose> poses;
         poselib::relpose_5pt(x0_vec, x1_vec, &poses);
 
-        for (auto &pose : poses) {
-            Eigen::Matrix3x4d proj_matrix0 = Eigen::Matrix3x4d::Identity();
-            Eigen::Matrix3x4d proj_matrix1 = pose.Rt();
-
-            std::vector<Eigen::Vector3d> p3d_vec = TriangulatePoints(proj_matrix0, proj_matrix1, x0_2dvec, x1_2dvec);
-            Eigen::MatrixXd p3d(3, p3d_vec.size());
-            for (int i = 0; i < p3d_vec.size(); i++) {
-                p3d.col(i) = p3d_vec[i];
-            }
-
-            if (!est_config_.use_shift) {
-                // Estimate scale by least-squares
-                double s0 = d0_(sample[2]).dot(p3d.row(2)) / d0_(sample[2]).squaredNorm();
-
-                p3d = p3d / s0;
-                pose.t = pose.t / s0;
-                p3d = (pose.R() * p3d).colwise() + pose.t;
-
-                double scale = d1_(sample[2]).dot(p3d.row(2)) / d1_(sample[2]).squaredNorm();
-
-                PoseScaleOffset sol(pose.R(), pose.t, scale, 0.0, 0.0);
-                models->push_back(sol);
-            } else {
-                // Estimate scale and shift by least-squares
-                Eigen::MatrixXd A(sample[2].size(), 2);
-                A.col(0) = d0_(sample[2]);
-                A.col(1) = Eigen::VectorXd::Ones(sample[2].size());
-                Eigen::VectorXd x = (A.transpose() * A).ldlt().solve(A.transpose() * p3d.row(2).transpose());
-                double s0 = x(0);
-                double offset0 = x(1) / s0;
-                if (est_config_.min_depth_constraint && offset0 < -min_depth_(0))
-                    continue;
-
-                p3d = p3d / s0;
-                pose.t = pose.t / s0;
-                p3d = (pose.R() * p3d).colwise() + pose.t;
-                A.col(0) = d1_(sample[2]);
-                A.col(1) = Eigen::VectorXd::Ones(sample[2].size());
-                x = (A.transpose() * A).ldlt().solve(A.transpose() * p3d.row(2).transpose());
-                double scale = x(0);
-                double offset1 = x(1) / scale;
-                if (est_config_.min_depth_constraint && offset1 < -min_depth_(1))
-                    continue;
-
-                PoseScaleOffset sol(pose.R(), pose.t, scale, offset0, offset1);
-
-                models->push_back(sol);
+        for (const auto &pose : poses) {
+            double offset0, scale, offset1;
+            const double s0 = FitDepthsToTriangulation(pose.R(), pose.t, x0_calib, x1_calib, depth0, depth1,
+                                                       est_config_.use_shift, &offset0, &scale, &offset1);
+            if (est_config_.min_depth_constraint && (offset0 < -min_depth_(0) || offset1 < -min_depth_(1))) {
+                RecordMinDepthRejection();
+                continue;
             }
+            models->push_back(PoseScaleOffset(pose.R(), pose.t / s0, scale, offset0, offset1));
         }
     }
     return models->size();
 }
 
+void HybridPoseEstimator::AddScaleShiftModels(const ScaleShiftPoses &sols, ModelVector *models) const {
+    for (PoseScaleOffset sol : sols) {
+        if (!est_config_.min_depth_constraint ||
+            (sol.offset0 > -min_depth_(0) && sol.offset1 > -min_depth_(1) * sol.scale)) {
+            sol.offset1 /= sol.scale;
+            models->push_back(sol);
+        } else {
+            RecordMinDepthRejection();
+        }
+    }
+}
+
+HybridPoseOptimizer *HybridPoseEstimator::Optimizer(const int max_num_iterations, const bool use_lm_refiner) const {
+    if (optimizer_ == nullptr) {
+        OptimizerConfig config;
+        config.use_sampson = true;
+        config.use_reprojection = true;
+        if (est_config_.LO_type == EstimatorOption::MD_ONLY)
+            config.use_sampson = false;
+        if (est_config_.LO_type == EstimatorOption::EPI_ONLY)
+            config.use_reprojection = false;
+        config.weight_sampson = sampson_squared_weight_;
+        config.min_depth_constraint = est_config_.min_depth_constraint;
+        config.use_shift = est_config_.use_shift;
+        optimizer_.reset(new HybridPoseOptimizer(x0_, x1_, d0_, d1_, CalibratedCamera(K0_, K1_),
+                                                 ScaleShiftDepth(min_depth_), config));
+    }
+    optimizer_->mutable_solver_options()->max_num_iterations = max_num_iterations;
+    optimizer_->set_use_lm_refiner(use_lm_refiner);
+    return optimizer_.get();
+}
+
 int HybridPoseEstimator::NonMinimalSolver(const std::vector<std::vector<int>> &sample, const int solver_idx,
                                           PoseScaleOffset *solution) const {
     if ((sample[0].size() < 3 && sample[1].size() < 3) || sample[2].size() < 5) {
         return 0;
     }
 
-    OptimizerConfig config;
-    config.solver_options.max_num_iterations = 25;
-
-    config.use_sampson = true;
-    config.use_reprojection = true;
-    if (est_config_.LO_type == EstimatorOption::MD_ONLY)
-        config.use_sampson = false;
-    if (est_config_.LO_type == EstimatorOption::EPI_ONLY)
-        config.use_reprojection = false;
-    config.weight_sampson = sampson_squared_weight_;
-    config.min_depth_constraint = est_config_.min_depth_constraint;
-    config.use_shift = est_config_.use_shift;
-    HybridPoseOptimizer optim(x0_, x1_, d0_, d1_, sample[0], sample[1], sample[2], min_depth_, *solution, K0_, K1_,
-                              config);
-    optim.SetUp();
-    if (!optim.Solve())
+    HybridPoseOptimizer *optim = Optimizer(25, est_config_.use_lm_refiner);
+    optim->Reset(sample[0], sample[1], sample[2], *solution);
+    optim->SetUp();
+    if (!optim->Solve())
         return 0;
-    *solution = optim.GetSolution();
+    *solution = optim->GetSolution();
     return 1;
 }
 
-double HybridPoseEstimator::EvaluateModelOnPoint(const PoseScaleOffset &model, int t, int i, bool is_for_inlier) const {
-    if (!is_for_inlier && est_config_.score_type == EstimatorOption::EPI_ONLY && t != 2) {
-        return std::numeric_limits<double>::max();
-    }
-    if (!is_for_inlier && est_config_.score_type == EstimatorOption::MD_ONLY && t == 2) {
-        return std::numeric_limits<double>::max();
-    }
-    if (t == 0) {
-        Eigen::Vector3d p3d0 = (K0_inv_ * x0_.col(i)) * (d0_(i) + model.offset0);
-        Eigen::Vector3d q = model.R() * p3d0 + model.t();
-        Eigen::Vector3d p2d_project = K1_ * q;
-        Eigen::Vector2d p2d = p2d_project.head<2>() / p2d_project(2);
-        double z = p2d_project(2);
-        if (z < 1e-2)
-            return std::numeric_limits<double>::max();
-        Eigen::Vector2d x1 = x1_.col(i).head<2>();
-        double reproj_error = (p2d - x1).squaredNorm();
-
-        return reproj_error;
-    } else if (t == 1) {
-        Eigen::Vector3d p3d1 = (K1_inv_ * x1_.col(i)) * (d1_(i) + model.offset1) * model.scale;
-        Eigen::Vector3d q = model.R().transpose() * p3d1 - model.R().transpose() * model.t();
-        Eigen::Vector3d p2d_project = K0_ * q;
-        Eigen::Vector2d p2d = p2d_project.head<2>() / p2d_project(2);
-        double z = p2d_project(2);
-        if (z < 1e-2)
-            return std::numeric_limits<double>::max();
-        Eigen::Vector2d x0 = x0_.col(i).head<2>();
-        double reproj_error = (p2d - x0).squaredNorm();
-
-        return reproj_error;
-    } else if (t == 2) {
-        poselib::CameraPose pose(model.R(), model.t());
-        Eigen::Vector3d x0_calib = K0_inv_ * x0_.col(i);
-        Eigen::Vector3d x1_calib = K1_inv_ * x1_.col(i);
-        bool cheirality = poselib::check_cheirality(pose, x0_calib.normalized(), x1_calib.normalized(), 1e-2);
-        if (!cheirality) {
-            return std::numeric_limits<double>::max();
-        }
+HybridPoseEstimator::PreparedModel HybridPoseEstimator::PrepareModel(const PoseScaleOffset &model) const {
+    PreparedModel prepared;
+    const Eigen::Matrix3d R = model.R();
+    const Eigen::Vector3d t = model.t();
+    const Eigen::Matrix3d Rt = R.transpose();
+    prepared.proj01.M = K1_ * R;
+    prepared.proj01.c = K1_ * t;
+    prepared.proj10.M = K0_ * Rt;
+    prepared.proj10.c = -K0_ * (Rt * t);
+    prepared.proj01.offset = model.offset0;
+    prepared.proj10.offset = model.offset1;
+    prepared.proj10.depth_scale = model.scale;
+    prepared.epipolar.E = to_essential_matrix(R, t);
+    prepared.epipolar.normalization = sampson_squared_loss_scale_;
+    prepared.epipolar.check_cheirality = true;
+    prepared.epipolar.R = R;
+    prepared.epipolar.t = t;
+    return prepared;
+}
 
-        Eigen::Matrix3d E = to_essential_matrix(model.R(), model.t());
+void HybridPoseEstimator::EvaluateModelOnPoints(const PreparedModel &model, int t, int begin, int end, double *errors,
+                                                bool is_for_inlier) const {
+    if ((!is_for_inlier && est_config_.score_type == EstimatorOption::EPI_ONLY && t != 2) ||
+        (!is_for_inlier && est_config_.score_type == EstimatorOption::MD_ONLY && t == 2)) {
+        std::fill(errors, errors + (end - begin), std::numeric_limits<double>::max());
+        return;
+    }
+    TwoViewErrors(view0_, d0_.data(), view1_, d1_.data(), model, t, begin, end, errors);
+}
 
-        double sampson_error = compute_sampson_error(x0_calib.head<2>(), x1_calib.head<2>(), E);
-        double loss_scale = 1.0 / (K0_(0, 0) + K0_(1, 1)) + 1.0 / (K1_(0, 0) + K1_(1, 1));
-        return sampson_error / std::pow(loss_scale, 2);
+void HybridPoseEstimator::EvaluateModelOnPoints(const PreparedModel &model, int begin, int end, double *const *errors,
+                                                bool is_for_inlier) const {
+    if (!is_for_inlier && est_config_.score_type != EstimatorOption::HYBRID) {
+        for (int t = 0; t < 3; t++) {
+            EvaluateModelOnPoints(model, t, begin, end, errors[t], is_for_inlier);
+        }
+        return;
     }
+    TwoViewErrors(view0_, d0_.data(), view1_, d1_.data(), model, begin, end, errors[0], errors[1], errors[2]);
 }
 
 // Linear least squares solver.
 void HybridPoseEstimator::LeastSquares(const std::vector<std::vector<int>> &sample, const int solver_idx,
                                        PoseScaleOffset *model) const {
+    Refine(sample, est_config_.use_lm_refiner, model);
+}
+
+void HybridPoseEstimator::FinalLeastSquares(const std::vector<std::vector<int>> &sample, const int solver_idx,
+                                            PoseScaleOffset *model) const {
+    Refine(sample, false, model);
+}
+
+void HybridPoseEstimator::Refine(const std::vector<std::vector<int>> &sample, const bool use_lm_refiner,
+                                 PoseScaleOffset *model) const {
     if ((sample[0].size() < 3 && sample[1].size() < 3) || sample[2].size() < 5) {
         return;
     }
 
-    OptimizerConfig config;
-    config.use_sampson = true;
-    config.use_reprojection = true;
-    if (est_config_.LO_type == EstimatorOption::MD_ONLY)
-        config.use_sampson = false;
-    if (est_config_.LO_type == EstimatorOption::EPI_ONLY)
-        config.use_reprojection = false;
-    config.weight_sampson = sampson_squared_weight_;
-    config.min_depth_constraint = est_config_.min_depth_constraint;
-    config.use_shift = est_config_.use_shift;
-
-    HybridPoseOptimizer optim(x0_, x1_, d0_, d1_, sample[0], sample[1], sample[2], min_depth_, *model, K0_, K1_,
-                              config);
-    optim.SetUp();
-    if (!optim.Solve())
+    HybridPoseOptimizer *optim = Optimizer(100, use_lm_refiner);
+    optim->Reset(sample[0], sample[1], sample[2], *model);
+    optim->SetUp();
+    if (!optim->Solve())
         return;
-    *model = optim.GetSolution();
+    *model = optim->GetSolution();
 }
 
 // **************************************************************
@@ -289,151 +264,144 @@ void HybridPoseEstimator::LeastSquares(const std::vector<std::vector<int>> &samp
 //
 // **************************************************************
 
+HybridPoseOptimizerScaleOnly *HybridPoseEstimatorScaleOnly::Optimizer(const int max_num_iterations,
+                                                                      const bool use_lm_refiner) const {
+    if (optimizer_ == nullptr) {
+        OptimizerConfig config;
+        config.use_sampson = true;
+        config.use_reprojection = true;
+        if (est_config_.LO_type == EstimatorOption::MD_ONLY)
+            config.use_sampson = false;
+        if (est_config_.LO_type == EstimatorOption::EPI_ONLY)
+            config.use_reprojection = false;
+        config.weight_sampson = sampson_squared_weight_;
+        optimizer_.reset(new HybridPoseOptimizerScaleOnly(x0_, x1_, d0_, d1_, CalibratedCamera(K0_, K1_),
+                                                          ScaleOnlyDepth(), config));
+    }
+    optimizer_->mutable_solver_options()->max_num_iterations = max_num_iterations;
+    optimizer_->set_use_lm_refiner(use_lm_refiner);
+    return optimizer_.get();
+}
+
 int HybridPoseEstimatorScaleOnly::NonMinimalSolver(const std::vector<std::vector<int>> &sample, const int solver_idx,
                                                    PoseAndScale *solution) const {
     if ((sample[0].size() < 3 && sample[1].size() < 3) || sample[2].size() < 5) {
         return 0;
     }
 
-    OptimizerConfig config;
-    config.solver_options.max_num_iterations = 25;
-
-    config.use_sampson = true;
-    config.use_reprojection = true;
-    if (est_config_.LO_type == EstimatorOption::MD_ONLY)
-        config.use_sampson = false;
-    if (est_config_.LO_type == EstimatorOption::EPI_ONLY)
-        config.use_reprojection = false;
-    config.weight_sampson = sampson_squared_weight_;
-    HybridPoseOptimizerScaleOnly optim(x0_, x1_, d0_, d1_, sample[0], sample[1], sample[2], *solution, K0_, K1_,
-                                       config);
-    optim.SetUp();
-    if (!optim.Solve())
+    HybridPoseOptimizerScaleOnly *optim = Optimizer(25, est_config_.use_lm_refiner);
+    optim->Reset(sample[0], sample[1], sample[2], *solution);
+    optim->SetUp();
+    if (!optim->Solve())
         return 0;
-    *solution = optim.GetSolution();
+    *solution = optim->GetSolution();
     return 1;
 }
 
 int HybridPoseEstimatorScaleOnly::MinimalSolver(const std::vector<std::vector<int>> &sample, const int solver_idx,
-                                                std::vector<PoseAndScale> *models) const {
+                                                ModelVector *models) const {
     models->clear();
     if (solver_idx == 0) {
-        Eigen::Matrix3d x0 = K0_inv_ * x0_(Eigen::all, sample[0]);
-        Eigen::Matrix3d x1 = K1_inv_ * x1_(Eigen::all, sample[0]);
+        Eigen::Matrix3d x0, x1;
+        for (int i = 0; i < 3; i++) {
+            x0.col(i) = view0_.calibrated(sample[0][i]);
+            x1.col(i) = view1_.calibrated(sample[0][i]);
+        }
 
-        PoseAndScale sol = estimate_scale_and_pose(x0, x1, Eigen::VectorXd::Ones(3));
+        PoseAndScale sol = estimate_scale_and_pose(x0, x1);
         sol.scale = 1.0 / sol.scale; // scale now applies on the second camera
         models->push_back(sol);
     } else if (solver_idx == 1) {
-        Eigen::MatrixXd x0 = K0_inv_ * x0_(Eigen::all, sample[2]);
-        Eigen::MatrixXd x1 = K1_inv_ * x1_(Eigen::all, sample[2]);
-
-        std::vector<Eigen::Vector3d> x0_vec(sample[2].size()), x1_vec(sample[2].size());
-        std::vector<Eigen::Vector2d> x0_2dvec(sample[2].size()), x1_2dvec(sample[2].size());
-        for (int i = 0; i < sample[2].size(); i++) {
-            x0_vec[i] = x0.col(i).normalized();
-            x1_vec[i] = x1.col(i).normalized();
-            x0_2dvec[i] = x0.col(i).head<2>();
-            x1_2dvec[i] = x1.col(i).head<2>();
+        // poselib takes its input and output as std::vector, which are kept
+        // per thread so that they only allocate on the first call.
+        thread_local std::vector<Eigen::Vector3d> x0_vec(5), x1_vec(5);
+        thread_local std::vector<poselib::CameraPose> poses;
+        Eigen::Matrix<double, 3, 5> x0_calib, x1_calib;
+        Eigen::Matrix<double, 5, 1> depth0, depth1;
+        for (int i = 0; i < 5; i++) {
+            x0_vec[i] = view0_.bearing(sample[2][i]);
+            x1_vec[i] = view1_.bearing(sample[2][i]);
+            x0_calib.col(i) = view0_.calibrated(sample[2][i]);
+            x1_calib.col(i) = view1_.calibrated(sample[2][i]);
+            depth0(i) = d0_(sample[2][i]);
+            depth1(i) = d1_(sample[2][i]);
         }
-        std::vector<poselib::CameraPose> poses;
         poselib::relpose_5pt(x0_vec, x1_vec, &poses);
 
-        for (auto &pose : poses) {
-            Eigen::Matrix3x4d proj_matrix0 = Eigen::Matrix3x4d::Identity();
-            Eigen::Matrix3x4d proj_matrix1 = pose.Rt();
-
-            std::vector<Eigen::Vector3d> p3d_vec = TriangulatePoints(proj_matrix0, proj_matrix1, x0_2dvec, x1_2dvec);
-            Eigen::MatrixXd p3d(3, p3d_vec.size());
-            for (int i = 0; i < p3d_vec.size(); i++) {
-                p3d.col(i) = p3d_vec[i];
-            }
-
-            // Estimate scale by least-squares
-            double s0 = d0_(sample[2]).dot(p3d.row(2)) / d0_(sample[2]).squaredNorm();
-
-            p3d = p3d / s0;
-            pose.t = pose.t / s0;
-            p3d = (pose.R() * p3d).colwise() + pose.t;
-            double scale = d1_(sample[2]).dot(p3d.row(2)) / d1_(sample[2]).squaredNorm();
-
-            PoseAndScale sol(pose.R(), pose.t, scale);
-            models->push_back(sol);
+        for (const auto &pose : poses) {
+            double offset0, scale, offset1;
+            const double s0 = FitDepthsToTriangulation(pose.R(), pose.t, x0_calib, x1_calib, depth0, depth1, false,
+                                                       &offset0, &scale, &offset1);
+            models->push_back(PoseAndScale(pose.R(), pose.t / s0, scale));
         }
     }
     return models->size();
 }
 
-double HybridPoseEstimatorScaleOnly::EvaluateModelOnPoint(const PoseAndScale &model, int t, int i,
-                                                          bool is_for_inlier) const {
-    if (!is_for_inlier && est_config_.score_type == EstimatorOption::EPI_ONLY && t != 2) {
-        return std::numeric_limits<double>::max();
-    }
-    if (!is_for_inlier && est_config_.score_type == EstimatorOption::MD_ONLY && t == 2) {
-        return std::numeric_limits<double>::max();
-    }
-    if (t == 0) {
-        Eigen::Vector3d p3d0 = (K0_inv_ * x0_.col(i)) * d0_(i);
-        Eigen::Vector3d q = model.R() * p3d0 + model.t();
-        Eigen::Vector3d p2d_project = K1_ * q;
-        Eigen::Vector2d p2d = p2d_project.head<2>() / p2d_project(2);
-        double z = p2d_project(2);
-        if (z < 1e-2 || d0_(i) < 1e-2)
-            return std::numeric_limits<double>::max();
-        Eigen::Vector2d x1 = x1_.col(i).head<2>();
-        double reproj_error = (p2d - x1).squaredNorm();
-
-        return reproj_error;
-    } else if (t == 1) {
-        Eigen::Vector3d p3d1 = (K1_inv_ * x1_.col(i)) * d1_(i) * model.scale;
-        Eigen::Vector3d q = model.R().transpose() * p3d1 - model.R().transpose() * model.t();
-        Eigen::Vector3d p2d_project = K0_ * q;
-        Eigen::Vector2d p2d = p2d_project.head<2>() / p2d_project(2);
-        double z = p2d_project(2);
-        if (z < 1e-2 || d1_(i) < 1e-2)
-            return std::numeric_limits<double>::max();
-        Eigen::Vector2d x0 = x0_.col(i).head<2>();
-        double reproj_error = (p2d - x0).squaredNorm();
-
-        return reproj_error;
-    } else if (t == 2) {
-        poselib::CameraPose pose(model.R(), model.t());
-        Eigen::Vector3d x0_calib = K0_inv_ * x0_.col(i);
-        Eigen::Vector3d x1_calib = K1_inv_ * x1_.col(i);
-        bool cheirality = poselib::check_cheirality(pose, x0_calib.normalized(), x1_calib.normalized(), 1e-2);
-        if (!cheirality) {
-            return std::numeric_limits<double>::max();
-        }
+HybridPoseEstimatorScaleOnly::PreparedModel
+HybridPoseEstimatorScaleOnly::PrepareModel(const PoseAndScale &model) const {
+    PreparedModel prepared;
+    const Eigen::Matrix3d R = model.R();
+    const Eigen::Vector3d t = model.t();
+    const Eigen::Matrix3d Rt = R.transpose();
+    prepared.proj01.M = K1_ * R;
+    prepared.proj01.c = K1_ * t;
+    prepared.proj10.M = K0_ * Rt;
+    prepared.proj10.c = -K0_ * (Rt * t);
+    prepared.proj10.depth_scale = model.scale;
+    prepared.proj01.check_depth = true;
+    prepared.proj10.check_depth = true;
+    prepared.epipolar.E = to_essential_matrix(R, t);
+    prepared.epipolar.normalization = sampson_squared_loss_scale_;
+    prepared.epipolar.check_cheirality = true;
+    prepared.epipolar.R = R;
+    prepared.epipolar.t = t;
+    return prepared;
+}
 
-        Eigen::Matrix3d E = to_essential_matrix(model.R(), model.t());
+void HybridPoseEstimatorScaleOnly::EvaluateModelOnPoints(const PreparedModel &model, int t, int begin, int end,
+                                                         double *errors, bool is_for_inlier) const {
+    if ((!is_for_inlier && est_config_.score_type == EstimatorOption::EPI_ONLY && t != 2) ||
+        (!is_for_inlier && est_config_.score_type == EstimatorOption::MD_ONLY && t == 2)) {
+        std::fill(errors, errors + (end - begin), std::numeric_limits<double>::max());
+        return;
+    }
+    TwoViewErrors(view0_, d0_.data(), view1_, d1_.data(), model, t, begin, end, errors);
+}
 
-        double sampson_error = compute_sampson_error(x0_calib.head<2>(), x1_calib.head<2>(), E);
-        double loss_scale = 1.0 / (K0_(0, 0) + K0_(1, 1)) + 1.0 / (K1_(0, 0) + K1_(1, 1));
-        return sampson_error / std::pow(loss_scale, 2);
+void HybridPoseEstimatorScaleOnly::EvaluateModelOnPoints(const PreparedModel &model, int begin, int end,
+                                                         double *const *errors, bool is_for_inlier) const {
+    if (!is_for_inlier && est_config_.score_type != EstimatorOption::HYBRID) {
+        for (int t = 0; t < 3; t++) {
+            EvaluateModelOnPoints(model, t, begin, end, errors[t], is_for_inlier);
+        }
+        return;
     }
+    TwoViewErrors(view0_, d0_.data(), view1_, d1_.data(), model, begin, end, errors[0], errors[1], errors[2]);
 }
 
 // Linear least squares solver.
 void HybridPoseEstimatorScaleOnly::LeastSquares(const std::vector<std::vector<int>> &sample, const int solver_idx,
                                                 PoseAndScale *model) const {
+    Refine(sample, est_config_.use_lm_refiner, model);
+}
+
+void HybridPoseEstimatorScaleOnly::FinalLeastSquares(const std::vector<std::vector<int>> &sample, const int solver_idx,
+                                                     PoseAndScale *model) const {
+    Refine(sample, false, model);
+}
+
+void HybridPoseEstimatorScaleOnly::Refine(const std::vector<std::vector<int>> &sample, const bool use_lm_refiner,
+                                          PoseAndScale *model) const {
     if ((sample[0].size() < 3 && sample[1].size() < 3) || sample[2].size() < 5) {
         return;
     }
 
-    OptimizerConfig config;
-    config.use_sampson = true;
-    config.use_reprojection = true;
-    config.solver_options.max_num_iterations = 25;
-
-    if (est_config_.LO_type == EstimatorOption::MD_ONLY)
-        config.use_sampson = false;
-    if (est_config_.LO_type == EstimatorOption::EPI_ONLY)
-        config.use_reprojection = false;
-    config.weight_sampson = sampson_squared_weight_;
-    HybridPoseOptimizerScaleOnly optim(x0_, x1_, d0_, d1_, sample[0], sample[1], sample[2], *model, K0_, K1_, config);
-    optim.SetUp();
-    if (!optim.Solve())
+    HybridPoseOptimizerScaleOnly *optim = Optimizer(25, use_lm_refiner);
+    optim->Reset(sample[0], sample[1], sample[2], *model);
+    optim->SetUp();
+    if (!optim->Solve())
         return;
-    *model = optim.GetSolution();
+    *model = optim->GetSolution();
 }
 } // namespace madpose
\ No newline at end of file
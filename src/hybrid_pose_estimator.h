@@ -3,7 +3,9 @@
 #include "estimator_config.h"
 #include "hybrid_ransac.h"
 #include "optimizer.h"
+#include "score_kernels.h"
 #include "solver.h"
+#include "view_data.h"
 
 #include <RansacLib/ransac.h>
 
@@ -11,6 +13,11 @@ namespace madpose {
 
 class HybridPoseEstimator {
   public:
+    typedef PreparedTwoViewModel PreparedModel;
+    // The 5-point solver returns up to 10 poses, the scale and shift solver up
+    // to 4.
+    typedef InlineVector<PoseScaleOffset, 10> ModelVector;
+
     HybridPoseEstimator(const std::vector<Eigen::Vector2d> &x0, const std::vector<Eigen::Vector2d> &x1,
                         const std::vector<double> &depth0, const std::vector<double> &depth1,
                         const Eigen::Vector2d &min_depth, const Eigen::Matrix3d &K0, const Eigen::Matrix3d &K1,
@@ -21,6 +28,7 @@ class HybridPoseEstimator {
           K1_inv_(K1.inverse()), min_depth_(min_depth), squared_inlier_thresholds_(squared_inlier_thresholds),
           est_config_(est_config) {
         assert(x0.size() == x1.size() && x0.size() == depth0.size() && x0.size() == depth1.size());
+        sampson_squared_loss_scale_ = std::pow(1.0 / (K0(0, 0) + K0(1, 1)) + 1.0 / (K1(0, 0) + K1(1, 1)), 2);
 
         d0_ = Eigen::Map<const Eigen::VectorXd>(depth0.data(), depth0.size());
         d1_ = Eigen::Map<const Eigen::VectorXd>(depth1.data(), depth1.size());
@@ -31,6 +39,8 @@ class HybridPoseEstimator {
             x0_.col(i) = x0[i].homogeneous();
             x1_.col(i) = x1[i].homogeneous();
         }
+        view0_ = ViewData(x0, K0_inv_);
+        view1_ = ViewData(x1, K1_inv_);
     }
 
     ~HybridPoseEstimator() {}
@@ -67,34 +77,81 @@ class HybridPoseEstimator {
 
     inline int non_minimal_sample_size() const { return 35; }
 
-    int MinimalSolver(const std::vector<std::vector<int>> &sample, const int solver_idx,
-                      std::vector<PoseScaleOffset> *models) const;
+    int MinimalSolver(const std::vector<std::vector<int>> &sample, const int solver_idx, ModelVector *models) const;
 
     // Returns 0 if no model could be estimated and 1 otherwise.
     // Implemented by a simple linear least squares solver.
     int NonMinimalSolver(const std::vector<std::vector<int>> &sample, const int solver_idx,
                          PoseScaleOffset *model) const;
 
+    PreparedModel PrepareModel(const PoseScaleOffset &model) const;
+
+    // Evaluates the model on the data points [begin, end) of type t and writes
+    // the squared errors to errors[0, end - begin).
+    void EvaluateModelOnPoints(const PreparedModel &model, int t, int begin, int end, double *errors,
+                               bool is_for_inlier = false) const;
+
+    // Evaluates the model on the data points [begin, end) of all three data
+    // types in a single pass, writing the errors of type t to errors[t].
+    void EvaluateModelOnPoints(const PreparedModel &model, int begin, int end, double *const *errors,
+                               bool is_for_inlier = false) const;
+
     // Evaluates the line on the i-th data point.
-    double EvaluateModelOnPoint(const PoseScaleOffset &model, int t, int i, bool is_for_inlier = false) const;
+    double EvaluateModelOnPoint(const PreparedModel &model, int t, int i, bool is_for_inlier = false) const {
+        double error;
+        EvaluateModelOnPoints(model, t, i, i + 1, &error, is_for_inlier);
+        return error;
+    }
+    double EvaluateModelOnPoint(const PoseScaleOffset &model, int t, int i, bool is_for_inlier = false) const {
+        return EvaluateModelOnPoint(PrepareModel(model), t, i, is_for_inlier);
+    }
 
     // Linear least squares solver.
     void LeastSquares(const std::vector<std::vector<int>> &sample, const int solver_idx, PoseScaleOffset *model) const;
 
+    // Least squares refinement of the final model on all inliers, which uses
+    // Ceres even if EstimatorConfig::use_lm_refiner is set.
+    void FinalLeastSquares(const std::vector<std::vector<int>> &sample, const int solver_idx,
+                           PoseScaleOffset *model) const;
+
   protected:
+    // Appends the solutions of the scale and shift solver that satisfy the
+    // minimum depth constraint to models.
+    void AddScaleShiftModels(const ScaleShiftPoses &sols, ModelVector *models) const;
+
+    // Returns the optimizer shared by NonMinimalSolver and LeastSquares, which
+    // keeps its problem and cost functions across the local optimization rounds.
+    HybridPoseOptimizer *Optimizer(const int max_num_iterations, const bool use_lm_refiner) const;
+
+    // Refines model on sample with the optimizer.
+    void Refine(const std::vector<std::vector<int>> &sample, const bool use_lm_refiner, PoseScaleOffset *model) const;
+
     Eigen::Matrix3d K0_, K1_;
     Eigen::Matrix3d K0_inv_, K1_inv_;
+    // Homogeneous pixel coordinates, as consumed by the optimizers.
     Eigen::MatrixXd x0_, x1_;
+    // The same keypoints in structure-of-arrays form, used for scoring and by
+    // the minimal solvers.
+    ViewData view0_, view1_;
     Eigen::VectorXd d0_, d1_;
     Eigen::Vector2d min_depth_;
     double sampson_squared_weight_;
+    // Normalizes the Sampson error to pixel units.
+    double sampson_squared_loss_scale_;
 
     EstimatorConfig est_config_;
     std::vector<double> squared_inlier_thresholds_;
+
+    // Created on the first call to Optimizer().
+    mutable std::unique_ptr<HybridPoseOptimizer> optimizer_;
 };
 
 class HybridPoseEstimatorScaleOnly {
   public:
+    typedef PreparedTwoViewModel PreparedModel;
+    // The 5-point solver returns up to 10 poses.
+    typedef InlineVector<PoseAndScale, 10> ModelVector;
+
     HybridPoseEstimatorScaleOnly(const std::vector<Eigen::Vector2d> &x0, const std::vector<Eigen::Vector2d> &x1,
                                  const std::vector<double> &depth0, const std::vector<double> &depth1,
                                  const Eigen::Matrix3d &K0, const Eigen::Matrix3d &K1,
@@ -104,6 +161,7 @@ class HybridPoseEstimatorScaleOnly {
         : K0_(K0), K1_(K1), sampson_squared_weight_(sampson_squared_weight), K0_inv_(K0.inverse()),
           K1_inv_(K1.inverse()), squared_inlier_thresholds_(squared_inlier_thresholds), est_config_(est_config) {
         assert(x0.size() == x1.size() && x0.size() == depth0.size() && x0.size() == depth1.size());
+        sampson_squared_loss_scale_ = std::pow(1.0 / (K0(0, 0) + K0(1, 1)) + 1.0 / (K1(0, 0) + K1(1, 1)), 2);
 
         d0_ = Eigen::Map<const Eigen::VectorXd>(depth0.data(), depth0.size());
         d1_ = Eigen::Map<const Eigen::VectorXd>(depth1.data(), depth1.size());
@@ -114,6 +172,8 @@ class HybridPoseEstimatorScaleOnly {
             x0_.col(i) = x0[i].homogeneous();
             x1_.col(i) = x1[i].homogeneous();
         }
+        view0_ = ViewData(x0, K0_inv_);
+        view1_ = ViewData(x1, K1_inv_);
     }
 
     ~HybridPoseEstimatorScaleOnly() {}
@@ -150,40 +210,81 @@ class HybridPoseEstimatorScaleOnly {
 
     inline int non_minimal_sample_size() const { return 35; }
 
-    int MinimalSolver(const std::vector<std::vector<int>> &sample, const int solver_idx,
-                      std::vector<PoseAndScale> *models) const;
+    int MinimalSolver(const std::vector<std::vector<int>> &sample, const int solver_idx, ModelVector *models) const;
 
     // Returns 0 if no model could be estimated and 1 otherwise.
     // Implemented by a simple linear least squares solver.
     int NonMinimalSolver(const std::vector<std::vector<int>> &sample, const int solver_idx, PoseAndScale *model) const;
 
+    PreparedModel PrepareModel(const PoseAndScale &model) const;
+
+    // Evaluates the model on the data points [begin, end) of type t and writes
+    // the squared errors to errors[0, end - begin).
+    void EvaluateModelOnPoints(const PreparedModel &model, int t, int begin, int end, double *errors,
+                               bool is_for_inlier = false) const;
+
+    // Evaluates the model on the data points [begin, end) of all three data
+    // types in a single pass, writing the errors of type t to errors[t].
+    void EvaluateModelOnPoints(const PreparedModel &model, int begin, int end, double *const *errors,
+                               bool is_for_inlier = false) const;
+
     // Evaluates the line on the i-th data point.
-    double EvaluateModelOnPoint(const PoseAndScale &model, int t, int i, bool is_for_inlier = false) const;
+    double EvaluateModelOnPoint(const PreparedModel &model, int t, int i, bool is_for_inlier = false) const {
+        double error;
+        EvaluateModelOnPoints(model, t, i, i + 1, &error, is_for_inlier);
+        return error;
+    }
+    double EvaluateModelOnPoint(const PoseAndScale &model, int t, int i, bool is_for_inlier = false) const {
+        return EvaluateModelOnPoint(PrepareModel(model), t, i, is_for_inlier);
+    }
 
     // Linear least squares solver.
     void LeastSquares(const std::vector<std::vector<int>> &sample, const int solver_idx, PoseAndScale *model) const;
 
+    // Least squares refinement of the final model on all inliers, which uses
+    // Ceres even if EstimatorConfig::use_lm_refiner is set.
+    void FinalLeastSquares(const std::vector<std::vector<int>> &sample, const int solver_idx,
+                           PoseAndScale *model) const;
+
   protected:
+    // Returns the optimizer shared by NonMinimalSolver and LeastSquares, which
+    // keeps its problem and cost functions across the local optimization rounds.
+    HybridPoseOptimizerScaleOnly *Optimizer(const int max_num_iterations, const bool use_lm_refiner) const;
+
+    // Refines model on sample with the optimizer.
+    void Refine(const std::vector<std::vector<int>> &sample, const bool use_lm_refiner, PoseAndScale *model) const;
+
     Eigen::Matrix3d K0_, K1_;
     Eigen::Matrix3d K0_inv_, K1_inv_;
+    // Homogeneous pixel coordinates, as consumed by the optimizers.
     Eigen::MatrixXd x0_, x1_;
+    // The same keypoints in structure-of-arrays form, used for scoring and by
+    // the minimal solvers.
+    ViewData view0_, view1_;
     Eigen::VectorXd d0_, d1_;
     double sampson_squared_weight_;
+    // Normalizes the Sampson error to pixel units.
+    double sampson_squared_loss_scale_;
 
     EstimatorConfig est_config_;
     std::vector<double> squared_inlier_thresholds_;
+
+    // Created on the first call to Optimizer().
+    mutable std::unique_ptr<HybridPoseOptimizerScaleOnly> optimizer_;
 };
 
-std::pair<PoseScaleOffset, ransac_lib::HybridRansacStatistics>
+std::pair<PoseScaleOffset, ExtendedHybridRansacStatistics>
 HybridEstimatePoseScaleOffset(const std::vector<Eigen::Vector2d> &x0, const std::vector<Eigen::Vector2d> &x1,
                               const std::vector<double> &depth0, const std::vector<double> &depth1,
                               const Eigen::Vector2d &min_depth, const Eigen::Matrix3d &K0, const Eigen::Matrix3d &K1,
                               const ExtendedHybridLORansacOptions &options,
-                              const EstimatorConfig &est_config = EstimatorConfig());
+                              const EstimatorConfig &est_config = EstimatorConfig(),
+                              const std::vector<double> &scores = {});
 
-std::pair<PoseAndScale, ransac_lib::HybridRansacStatistics> HybridEstimatePoseAndScale(
+std::pair<PoseAndScale, ExtendedHybridRansacStatistics> HybridEstimatePoseAndScale(
     const std::vector<Eigen::Vector2d> &x0, const std::vector<Eigen::Vector2d> &x1, const std::vector<double> &depth0,
     const std::vector<double> &depth1, const Eigen::Matrix3d &K0, const Eigen::Matrix3d &K1,
-    const ExtendedHybridLORansacOptions &options, const EstimatorConfig &est_config = EstimatorConfig());
+    const ExtendedHybridLORansacOptions &options, const EstimatorConfig &est_config = EstimatorConfig(),
+    const std::vector<double> &scores = {});
 
 } // namespace madpose
@@ -3,7 +3,9 @@
 #include "estimator_config.h"
 #include "hybrid_ransac.h"
 #include "optimizer.h"
+#include "score_kernels.h"
 #include "solver.h"
+#include "view_data.h"
 
 #include <RansacLib/ransac.h>
 
@@ -11,6 +13,11 @@ namespace madpose {
 
 class HybridSharedFocalPoseEstimator {
   public:
+    typedef PreparedTwoViewModel PreparedModel;
+    // The 6-point solver returns up to 15 poses, the scale and shift solver up
+    // to 8.
+    typedef InlineVector<PoseScaleOffsetSharedFocal, 15> ModelVector;
+
     HybridSharedFocalPoseEstimator(const std::vector<Eigen::Vector2d> &x0_norm,
                                    const std::vector<Eigen::Vector2d> &x1_norm, const std::vector<double> &depth0,
                                    const std::vector<double> &depth1, const Eigen::Vector2d &min_depth,
@@ -30,6 +37,10 @@ class HybridSharedFocalPoseEstimator {
             x0_norm_.col(i) = x0_norm[i].homogeneous();
             x1_norm_.col(i) = x1_norm[i].homogeneous();
         }
+        // The focal lengths are unknown, so the "calibrated" coordinates are
+        // the normalized image coordinates.
+        view0_ = ViewData(x0_norm);
+        view1_ = ViewData(x1_norm);
     }
 
     ~HybridSharedFocalPoseEstimator() {}
@@ -66,24 +77,62 @@ class HybridSharedFocalPoseEstimator {
 
     inline int non_minimal_sample_size() const { return 36; }
 
-    int MinimalSolver(const std::vector<std::vector<int>> &sample, const int solver_idx,
-                      std::vector<PoseScaleOffsetSharedFocal> *models) const;
+    int MinimalSolver(const std::vector<std::vector<int>> &sample, const int solver_idx, ModelVector *models) const;
 
     // Returns 0 if no model could be estimated and 1 otherwise.
     // Implemented by a simple linear least squares solver.
     int NonMinimalSolver(const std::vector<std::vector<int>> &sample, const int solver_idx,
                          PoseScaleOffsetSharedFocal *model) const;
 
+    PreparedModel PrepareModel(const PoseScaleOffsetSharedFocal &model) const;
+
+    // Evaluates the model on the data points [begin, end) of type t and writes
+    // the squared errors to errors[0, end - begin).
+    void EvaluateModelOnPoints(const PreparedModel &model, int t, int begin, int end, double *errors,
+                               bool is_for_inlier = false) const;
+
+    // Evaluates the model on the data points [begin, end) of all three data
+    // types in a single pass, writing the errors of type t to errors[t].
+    void EvaluateModelOnPoints(const PreparedModel &model, int begin, int end, double *const *errors,
+                               bool is_for_inlier = false) const;
+
     // Evaluates the line on the i-th data point.
-    double EvaluateModelOnPoint(const PoseScaleOffsetSharedFocal &model, int t, int i,
-                                bool is_for_inlier = false) const;
+    double EvaluateModelOnPoint(const PreparedModel &model, int t, int i, bool is_for_inlier = false) const {
+        double error;
+        EvaluateModelOnPoints(model, t, i, i + 1, &error, is_for_inlier);
+        return error;
+    }
+    double EvaluateModelOnPoint(const PoseScaleOffsetSharedFocal &model, int t, int i, bool is_for_inlier = false) const {
+        return EvaluateModelOnPoint(PrepareModel(model), t, i, is_for_inlier);
+    }
 
     // Linear least squares solver.
     void LeastSquares(const std::vector<std::vector<int>> &sample, const int solver_idx,
                       PoseScaleOffsetSharedFocal *model) const;
 
+    // Least squares refinement of the final model on all inliers, which uses
+    // Ceres even if EstimatorConfig::use_lm_refiner is set.
+    void FinalLeastSquares(const std::vector<std::vector<int>> &sample, const int solver_idx,
+                           PoseScaleOffsetSharedFocal *model) const;
+
   protected:
+    // Appends the solutions of the scale and shift solver that satisfy the
+    // minimum depth constraint to models.
+    void AddScaleShiftModels(const ScaleShiftSharedFocalPoses &sols, ModelVector *models) const;
+
+    // Returns the optimizer shared by NonMinimalSolver and LeastSquares, which
+    // keeps its problem and cost functions across the local optimization rounds.
+    HybridSharedFocalPoseOptimizer *Optimizer(const int max_num_iterations, const bool use_lm_refiner) const;
+
+    // Refines model on sample with the optimizer.
+    void Refine(const std::vector<std::vector<int>> &sample, const bool use_lm_refiner,
+                PoseScaleOffsetSharedFocal *model) const;
+
+    // Homogeneous normalized coordinates, as consumed by the optimizers.
     Eigen::MatrixXd x0_norm_, x1_norm_;
+    // The same keypoints in structure-of-arrays form, used for scoring and by
+    // the minimal solvers.
+    ViewData view0_, view1_;
     Eigen::VectorXd d0_, d1_;
     Eigen::Vector2d min_depth_;
     double sampson_squared_weight_;
@@ -92,12 +141,15 @@ class HybridSharedFocalPoseEstimator {
 
     std::vector<double> squared_inlier_thresholds_;
     double norm_scale_;
+
+    // Created on the first call to Optimizer().
+    mutable std::unique_ptr<HybridSharedFocalPoseOptimizer> optimizer_;
 };
 
-std::pair<PoseScaleOffsetSharedFocal, ransac_lib::HybridRansacStatistics> HybridEstimatePoseScaleOffsetSharedFocal(
+std::pair<PoseScaleOffsetSharedFocal, ExtendedHybridRansacStatistics> HybridEstimatePoseScaleOffsetSharedFocal(
     const std::vector<Eigen::Vector2d> &x0_norm, const std::vector<Eigen::Vector2d> &x1_norm,
     const std::vector<double> &depth0, const std::vector<double> &depth1, const Eigen::Vector2d &min_depth,
     const Eigen::Vector2d &pp0, const Eigen::Vector2d &pp1, const ExtendedHybridLORansacOptions &options,
-    const EstimatorConfig &est_config = EstimatorConfig());
+    const EstimatorConfig &est_config = EstimatorConfig(), const std::vector<double> &scores = {});
 
 } // namespace madpose
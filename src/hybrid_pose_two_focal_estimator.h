@@ -3,7 +3,9 @@
 #include "estimator_config.h"
 #include "hybrid_ransac.h"
 #include "optimizer.h"
+#include "score_kernels.h"
 #include "solver.h"
+#include "view_data.h"
 
 #include <RansacLib/ransac.h>
 
@@ -11,6 +13,11 @@ namespace madpose {
 
 class HybridTwoFocalPoseEstimator {
   public:
+    typedef PreparedTwoViewModel PreparedModel;
+    // The 7-point solver returns up to 3 fundamental matrices, the scale and
+    // shift solver up to 4 poses.
+    typedef InlineVector<PoseScaleOffsetTwoFocal, 4> ModelVector;
+
     HybridTwoFocalPoseEstimator(const std::vector<Eigen::Vector2d> &x0_norm,
                                 const std::vector<Eigen::Vector2d> &x1_norm, const std::vector<double> &depth0,
                                 const std::vector<double> &depth1, const Eigen::Vector2d &min_depth,
@@ -30,6 +37,10 @@ class HybridTwoFocalPoseEstimator {
             x0_norm_.col(i) = x0_norm[i].homogeneous();
             x1_norm_.col(i) = x1_norm[i].homogeneous();
         }
+        // The focal lengths are unknown, so the "calibrated" coordinates are
+        // the normalized image coordinates.
+        view0_ = ViewData(x0_norm);
+        view1_ = ViewData(x1_norm);
     }
 
     ~HybridTwoFocalPoseEstimator() {}
@@ -66,23 +77,62 @@ class HybridTwoFocalPoseEstimator {
 
     inline int non_minimal_sample_size() const { return 36; }
 
-    int MinimalSolver(const std::vector<std::vector<int>> &sample, const int solver_idx,
-                      std::vector<PoseScaleOffsetTwoFocal> *models) const;
+    int MinimalSolver(const std::vector<std::vector<int>> &sample, const int solver_idx, ModelVector *models) const;
 
     // Returns 0 if no model could be estimated and 1 otherwise.
     // Implemented by a simple linear least squares solver.
     int NonMinimalSolver(const std::vector<std::vector<int>> &sample, const int solver_idx,
                          PoseScaleOffsetTwoFocal *model) const;
 
+    PreparedModel PrepareModel(const PoseScaleOffsetTwoFocal &model) const;
+
+    // Evaluates the model on the data points [begin, end) of type t and writes
+    // the squared errors to errors[0, end - begin).
+    void EvaluateModelOnPoints(const PreparedModel &model, int t, int begin, int end, double *errors,
+                               bool is_for_inlier = false) const;
+
+    // Evaluates the model on the data points [begin, end) of all three data
+    // types in a single pass, writing the errors of type t to errors[t].
+    void EvaluateModelOnPoints(const PreparedModel &model, int begin, int end, double *const *errors,
+                               bool is_for_inlier = false) const;
+
     // Evaluates the line on the i-th data point.
-    double EvaluateModelOnPoint(const PoseScaleOffsetTwoFocal &model, int t, int i, bool is_for_inlier = false) const;
+    double EvaluateModelOnPoint(const PreparedModel &model, int t, int i, bool is_for_inlier = false) const {
+        double error;
+        EvaluateModelOnPoints(model, t, i, i + 1, &error, is_for_inlier);
+        return error;
+    }
+    double EvaluateModelOnPoint(const PoseScaleOffsetTwoFocal &model, int t, int i, bool is_for_inlier = false) const {
+        return EvaluateModelOnPoint(PrepareModel(model), t, i, is_for_inlier);
+    }
 
     // Linear least squares solver.
     void LeastSquares(const std::vector<std::vector<int>> &sample, const int solver_idx,
                       PoseScaleOffsetTwoFocal *model) const;
 
+    // Least squares refinement of the final model on all inliers, which uses
+    // Ceres even if EstimatorConfig::use_lm_refiner is set.
+    void FinalLeastSquares(const std::vector<std::vector<int>> &sample, const int solver_idx,
+                           PoseScaleOffsetTwoFocal *model) const;
+
   protected:
+    // Appends the solutions of the scale and shift solver that satisfy the
+    // minimum depth constraint to models.
+    void AddScaleShiftModels(const ScaleShiftTwoFocalPoses &sols, ModelVector *models) const;
+
+    // Returns the optimizer shared by NonMinimalSolver and LeastSquares, which
+    // keeps its problem and cost functions across the local optimization rounds.
+    HybridTwoFocalPoseOptimizer *Optimizer(const int max_num_iterations, const bool use_lm_refiner) const;
+
+    // Refines model on sample with the optimizer.
+    void Refine(const std::vector<std::vector<int>> &sample, const bool use_lm_refiner,
+                PoseScaleOffsetTwoFocal *model) const;
+
+    // Homogeneous normalized coordinates, as consumed by the optimizers.
     Eigen::MatrixXd x0_norm_, x1_norm_;
+    // The same keypoints in structure-of-arrays form, used for scoring and by
+    // the minimal solvers.
+    ViewData view0_, view1_;
     Eigen::VectorXd d0_, d1_;
     Eigen::Vector2d min_depth_;
     double sampson_squared_weight_;
@@ -90,6 +140,9 @@ class HybridTwoFocalPoseEstimator {
     EstimatorConfig est_config_;
     std::vector<double> squared_inlier_thresholds_;
     double norm_scale_;
+
+    // Created on the first call to Optimizer().
+    mutable std::unique_ptr<HybridTwoFocalPoseOptimizer> optimizer_;
 };
 
 class HybridTwoFocalPoseEstimator3 : public HybridTwoFocalPoseEstimator {
@@ -103,8 +156,7 @@ class HybridTwoFocalPoseEstimator3 : public HybridTwoFocalPoseEstimator {
         : HybridTwoFocalPoseEstimator(x0_norm, x1_norm, depth0, depth1, min_depth, norm_scale, sampson_squared_weight,
                                       squared_inlier_thresholds, est_config) {}
 
-    int MinimalSolver(const std::vector<std::vector<int>> &sample, const int solver_idx,
-                      std::vector<PoseScaleOffsetTwoFocal> *models) const {
+    int MinimalSolver(const std::vector<std::vector<int>> &sample, const int solver_idx, ModelVector *models) const {
         std::vector<std::vector<int>> sample_2 = {sample[0], sample[2]};
         return HybridTwoFocalPoseEstimator::MinimalSolver(sample_2, solver_idx, models);
     }
@@ -122,10 +174,10 @@ class HybridTwoFocalPoseEstimator3 : public HybridTwoFocalPoseEstimator {
                       PoseScaleOffsetTwoFocal *model) const;
 };
 
-std::pair<PoseScaleOffsetTwoFocal, ransac_lib::HybridRansacStatistics> HybridEstimatePoseScaleOffsetTwoFocal(
+std::pair<PoseScaleOffsetTwoFocal, ExtendedHybridRansacStatistics> HybridEstimatePoseScaleOffsetTwoFocal(
     const std::vector<Eigen::Vector2d> &x0_norm, const std::vector<Eigen::Vector2d> &x1_norm,
     const std::vector<double> &depth0, const std::vector<double> &depth1, const Eigen::Vector2d &min_depth,
     const Eigen::Vector2d &pp0, const Eigen::Vector2d &pp1, const ExtendedHybridLORansacOptions &options,
-    const EstimatorConfig &estimator_config = EstimatorConfig());
+    const EstimatorConfig &estimator_config = EstimatorConfig(), const std::vector<double> &scores = {});
 
 } // namespace madpose
@@ -0,0 +1,179 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <numeric>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace madpose {
+
+// PROSAC sampling [Chum, Matas, Matching with PROSAC - Progressive Sample
+// Consensus, CVPR 2005] for hybrid RANSAC. Assumes that the data points of
+// every data type are sorted by decreasing quality (see ScoreOrder). Samples
+// are drawn from the n best points, where n grows with the number of drawn
+// samples such that PROSAC converges to uniform sampling after
+// kMaxGrowthSamples samples. Since different minimal solvers draw samples of
+// different sizes, every sample configuration is grown separately.
+template <class HybridSolver> class HybridProsacSampling {
+  public:
+    HybridProsacSampling(const unsigned int random_seed, const HybridSolver &solver) : rng_(random_seed) {
+        solver.num_data(&num_data_);
+    }
+
+    void Sample(const std::vector<int> &num_samples_per_data_type, std::vector<std::vector<int>> *random_sample) {
+        const int kNumDataTypes = static_cast<int>(num_samples_per_data_type.size());
+        random_sample->resize(kNumDataTypes);
+
+        Stage &stage = GetStage(num_samples_per_data_type);
+        ++stage.num_samples;
+
+        // Once all growth samples are drawn, PROSAC is equivalent to
+        // uniform sampling.
+        const bool kUniform = stage.num_samples > kMaxGrowthSamples;
+        if (!kUniform && stage.subset_size < stage.max_subset_size &&
+            stage.num_samples == stage.growth[stage.subset_size - 1]) {
+            ++stage.subset_size;
+        }
+        const bool kIncludeLast = !kUniform && stage.growth[stage.subset_size - 1] >= stage.num_samples;
+
+        for (int i = 0; i < kNumDataTypes; ++i) {
+            const int kNumSamples = num_samples_per_data_type[i];
+            std::vector<int> &sample = (*random_sample)[i];
+            sample.resize(kNumSamples);
+            if (kNumSamples == 0)
+                continue;
+
+            const int kSubsetSize = kUniform ? num_data_[i] : std::min(stage.subset_size, num_data_[i]);
+            if (kIncludeLast) {
+                // The newest point of the subset is part of every sample
+                // drawn before the subset grows again.
+                sample[0] = kSubsetSize - 1;
+                DrawUniqueIndices(kSubsetSize - 1, 1, &sample);
+            } else {
+                DrawUniqueIndices(kSubsetSize, 0, &sample);
+            }
+        }
+    }
+
+    // Number of samples after which PROSAC draws from all data points.
+    static constexpr int kMaxGrowthSamples = 200000;
+
+  private:
+    // Progress of the sampling for one configuration of sample sizes.
+    struct Stage {
+        std::vector<int> sample_sizes;
+        int num_samples = 0;
+        int subset_size = 0;
+        int max_subset_size = 0;
+        // growth[n - 1] is the number of samples after which the subset grows
+        // from n to n + 1 points (T'_n in the paper).
+        std::vector<int> growth;
+    };
+
+    Stage &GetStage(const std::vector<int> &sample_sizes) {
+        for (Stage &stage : stages_) {
+            if (stage.sample_sizes == sample_sizes)
+                return stage;
+        }
+
+        Stage stage;
+        stage.sample_sizes = sample_sizes;
+        const int m = *std::max_element(sample_sizes.begin(), sample_sizes.end());
+        int N = std::numeric_limits<int>::max();
+        for (int i = 0; i < static_cast<int>(sample_sizes.size()); ++i) {
+            if (sample_sizes[i] > 0)
+                N = std::min(N, num_data_[i]);
+        }
+        stage.subset_size = m;
+        stage.max_subset_size = N;
+        stage.growth.assign(std::max(N, 1), kMaxGrowthSamples);
+
+        // T_n = T_N * prod_{i=0}^{m-1} (n - i) / (N - i), computed
+        // incrementally by T_{n+1} = T_n * (n + 1) / (n + 1 - m).
+        double T_n = kMaxGrowthSamples;
+        for (int i = 0; i < m; ++i)
+            T_n *= static_cast<double>(m - i) / static_cast<double>(N - i);
+        int T_prime = 1;
+        for (int n = m; n < N; ++n) {
+            stage.growth[n - 1] = T_prime;
+            const double T_next = T_n * static_cast<double>(n + 1) / static_cast<double>(n + 1 - m);
+            T_prime += static_cast<int>(std::ceil(T_next - T_n));
+            T_n = T_next;
+        }
+        stages_.push_back(stage);
+        return stages_.back();
+    }
+
+    // Fills sample[offset, sample.size()) with unique random indices from
+    // [0, range) that are not yet part of the sample.
+    void DrawUniqueIndices(const int range, const int offset, std::vector<int> *sample) {
+        std::uniform_int_distribution<int> dist(0, range - 1);
+        for (int k = offset; k < static_cast<int>(sample->size()); ++k) {
+            bool is_unique = false;
+            while (!is_unique) {
+                (*sample)[k] = dist(rng_);
+                is_unique = std::find(sample->begin(), sample->begin() + k, (*sample)[k]) == sample->begin() + k;
+            }
+        }
+    }
+
+    std::mt19937 rng_;
+    std::vector<int> num_data_;
+    std::vector<Stage> stages_;
+};
+
+// Orders correspondences by decreasing score, as expected by
+// HybridProsacSampling. NaN scores are ordered last. Without scores, the
+// order is the identity.
+class ScoreOrder {
+  public:
+    // Throws std::invalid_argument unless scores is empty or has num_data
+    // entries.
+    ScoreOrder(const std::vector<double> &scores, const int num_data) : is_identity_(scores.empty()) {
+        if (!scores.empty() && static_cast<int>(scores.size()) != num_data)
+            throw std::invalid_argument("Expected one score per correspondence, got " +
+                                        std::to_string(scores.size()) + " scores for " + std::to_string(num_data) +
+                                        " correspondences.");
+        if (is_identity_)
+            return;
+        order_.resize(num_data);
+        std::iota(order_.begin(), order_.end(), 0);
+        const auto key = [&scores](const int idx) {
+            return std::isnan(scores[idx]) ? -std::numeric_limits<double>::infinity() : scores[idx];
+        };
+        std::stable_sort(order_.begin(), order_.end(), [&key](const int a, const int b) { return key(a) > key(b); });
+    }
+
+    // Returns the values in sorted order. They are written to *sorted unless
+    // the order is the identity, in which case values is returned as is.
+    template <typename T> const std::vector<T> &Apply(const std::vector<T> &values, std::vector<T> *sorted) const {
+        if (is_identity_)
+            return values;
+        sorted->clear();
+        sorted->reserve(order_.size());
+        for (const int idx : order_)
+            sorted->push_back(values[idx]);
+        return *sorted;
+    }
+
+    // Maps indices into the sorted data back to indices into the input data.
+    void RestoreIndices(std::vector<std::vector<int>> *indices) const {
+        if (is_identity_)
+            return;
+        for (std::vector<int> &type_indices : *indices) {
+            for (int &idx : type_indices)
+                idx = order_[idx];
+            std::sort(type_indices.begin(), type_indices.end());
+        }
+    }
+
+  private:
+    bool is_identity_;
+    std::vector<int> order_;
+};
+
+} // namespace madpose
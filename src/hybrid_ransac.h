@@ -1,14 +1,26 @@
 #pragma once
 
+#include "hybrid_prosac_sampling.h"
+#include "hybrid_ransac_profile.h"
+
 #include <RansacLib/hybrid_ransac.h>
 #include <RansacLib/sampling.h>
 #include <RansacLib/utils.h>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cmath>
+#include <condition_variable>
 #include <cstddef>
 #include <cstdint>
 #include <limits>
+#include <memory>
+#include <mutex>
+#include <numeric>
 #include <random>
+#include <thread>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 using namespace ransac_lib;
@@ -16,12 +28,430 @@ namespace madpose {
 
 class ExtendedHybridLORansacOptions : public ransac_lib::HybridLORansacOptions {
   public:
-    ExtendedHybridLORansacOptions() : non_min_sample_multiplier_(3) {}
+    ExtendedHybridLORansacOptions()
+        : non_min_sample_multiplier_(3), num_threads_(1), batch_size_(kDefaultBatchSize), use_sprt_(false),
+          sprt_initial_epsilon_(0.1), sprt_initial_delta_(0.01), sprt_time_model_(200.0), sprt_models_per_sample_(2.0),
+          prosac_beta_(0.05), time_budget_ms_(0.0), lo_time_fraction_(0.5), final_least_squares_time_fraction_(0.1),
+          collect_profile_(false) {}
     // We add this to do non minimal sampling in LO step in align with
     // the original definition of the LO step
     int non_min_sample_multiplier_;
+    // Number of threads used to solve and score the hypotheses of a batch.
+    // Values < 1 use all available hardware threads. Only used if
+    // batch_size_ > 0, and never changes the result.
+    int num_threads_;
+    // Number of hypotheses that are sampled, solved and scored together
+    // before they are merged (in order) into the best model. The samples of
+    // a batch are drawn in order on the calling thread, so the result only
+    // depends on batch_size_, not on num_threads_. Defaults to
+    // kDefaultBatchSize, so that num_threads_ takes effect. Values <= 0 run
+    // the legacy sequential loop on the calling thread.
+    int batch_size_;
+
+    // Verifies hypotheses with Wald's sequential probability ratio test
+    // instead of scoring them on all data (see HybridSPRT). The result is no
+    // longer exact, as good hypotheses are rejected with a small probability.
+    bool use_sprt_;
+    // Initial probabilities that a data point is an inlier to a good and to a
+    // bad model, respectively. Both are updated during the run.
+    double sprt_initial_epsilon_;
+    double sprt_initial_delta_;
+    // Time needed to estimate the models of one minimal sample, in units of
+    // the time to evaluate a model on one data point.
+    double sprt_time_model_;
+    // Average number of models estimated per minimal sample.
+    double sprt_models_per_sample_;
+
+    // Probability that a data point supports a wrong model by chance, used by
+    // the non-randomness criterion of PROSAC (see HybridProsacSampling).
+    double prosac_beta_;
+
+    // Wall-clock time budget of the estimation in milliseconds. Values <= 0
+    // disable the budget. When the budget runs out, the best model found so
+    // far is returned (see HybridTimeBudget).
+    double time_budget_ms_;
+    // Fraction of the budget that local optimization may use in total.
+    double lo_time_fraction_;
+    // Fraction of the budget reserved for the final least squares refinement.
+    double final_least_squares_time_fraction_;
+
+    // Collects the counters and timings of HybridRansacProfile. In parallel
+    // runs, the times are summed over all threads.
+    bool collect_profile_;
+
+    static constexpr int kDefaultBatchSize = 64;
+};
+
+class ExtendedHybridRansacStatistics : public ransac_lib::HybridRansacStatistics {
+  public:
+    // Whether the time budget stopped the sampling or caused local
+    // optimization or the final least squares refinement to be skipped.
+    bool time_budget_exhausted = false;
+    // Only filled if ExtendedHybridLORansacOptions::collect_profile_ is set.
+    HybridRansacProfile profile;
+};
+
+// Wall-clock time budget of one run of HybridLOMSAC, measured from its
+// construction. Sampling and local optimization (LO) have to end before the
+// part of the budget reserved for the final least squares refinement. LO
+// rounds are only started if a round as long as the slowest one so far still
+// fits, and running rounds stop early once the LO share is used up. The
+// optimizer solves of LO and of the final refinement are limited to the
+// deadlines below through a SolveTimeLimit, so that they cannot overrun it.
+class HybridTimeBudget {
+  public:
+    typedef std::chrono::steady_clock Clock;
+
+    explicit HybridTimeBudget(const ExtendedHybridLORansacOptions &options)
+        : start_(Clock::now()), budget_ms_(options.time_budget_ms_),
+          sampling_end_ms_(options.time_budget_ms_ * (1.0 - options.final_least_squares_time_fraction_)),
+          lo_budget_ms_(options.time_budget_ms_ * options.lo_time_fraction_) {}
+
+    inline bool enabled() const { return budget_ms_ > 0.0; }
+
+    inline double ElapsedMs() const { return std::chrono::duration<double, std::milli>(Clock::now() - start_).count(); }
+
+    // Whether the sampling loop has to stop.
+    inline bool SamplingExpired() const { return ElapsedMs() >= sampling_end_ms_; }
+
+    // Starts an LO round. Returns false if the round is not expected to
+    // finish within the budget, in which case it should be skipped.
+    bool StartLO() {
+        lo_start_ms_ = ElapsedMs();
+        return lo_start_ms_ + max_lo_ms_ <= sampling_end_ms_ && lo_used_ms_ + max_lo_ms_ <= lo_budget_ms_;
+    }
+
+    // Whether the running LO round has to stop.
+    bool LOExpired() const {
+        const double kElapsed = ElapsedMs();
+        return kElapsed >= sampling_end_ms_ || lo_used_ms_ + kElapsed - lo_start_ms_ >= lo_budget_ms_;
+    }
+
+    // Time at which the running LO round has to stop.
+    Clock::time_point LODeadline() const {
+        return TimePoint(std::min(sampling_end_ms_, lo_start_ms_ + lo_budget_ms_ - lo_used_ms_));
+    }
+
+    // End of the budget, at which the final least squares refinement stops.
+    Clock::time_point Deadline() const { return TimePoint(budget_ms_); }
+
+    void StopLO() {
+        const double kDuration = ElapsedMs() - lo_start_ms_;
+        lo_used_ms_ += kDuration;
+        max_lo_ms_ = std::max(max_lo_ms_, kDuration);
+    }
+
+    // Records the duration of a least squares fit on all inliers that ran
+    // Ceres, as the final least squares refinement does. It is used to
+    // predict the duration of the latter.
+    void AddLeastSquaresTime(const double duration_ms) {
+        max_least_squares_ms_ = std::max(max_least_squares_ms_, duration_ms);
+    }
+
+    // Whether the final least squares refinement should be started. It stops
+    // at Deadline() in any case, so this only skips a refinement that is
+    // predicted to be cut short. Without a prediction, it is started if any
+    // time is left.
+    bool FitsFinalLeastSquares() const {
+        const double kElapsed = ElapsedMs();
+        return kElapsed < budget_ms_ && kElapsed + max_least_squares_ms_ <= budget_ms_;
+    }
+
+  private:
+    Clock::time_point TimePoint(const double ms) const {
+        return start_ + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double, std::milli>(ms));
+    }
+
+    Clock::time_point start_;
+    double budget_ms_, sampling_end_ms_, lo_budget_ms_;
+    double lo_start_ms_ = 0.0, lo_used_ms_ = 0.0, max_lo_ms_ = 0.0;
+    double max_least_squares_ms_ = 0.0;
+};
+
+// A fixed set of worker threads that run the iterations of ParallelFor()
+// calls. The workers are started once, e.g. per run of HybridLOMSAC, and
+// wait for the next call in between, so that a call only has to wake them up.
+class HybridThreadPool {
+  public:
+    // Values of num_threads < 1 use all available hardware threads. The
+    // calling thread counts as one of them.
+    explicit HybridThreadPool(int num_threads) {
+        if (num_threads < 1)
+            num_threads = std::max(1u, std::thread::hardware_concurrency());
+        workers_.reserve(num_threads - 1);
+        for (int i = 1; i < num_threads; ++i)
+            workers_.emplace_back([this]() { WorkerLoop(); });
+    }
+
+    ~HybridThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        start_condition_.notify_all();
+        for (auto &worker : workers_)
+            worker.join();
+    }
+
+    HybridThreadPool(const HybridThreadPool &) = delete;
+    HybridThreadPool &operator=(const HybridThreadPool &) = delete;
+
+    // Runs fn(i) for all i in [0, n) and returns once all calls finished. The
+    // calling thread takes part in the work.
+    template <typename Function> void ParallelFor(const int n, Function &&fn) {
+        if (workers_.empty() || n <= 1) {
+            for (int i = 0; i < n; ++i)
+                fn(i);
+            return;
+        }
+        typedef std::remove_reference_t<Function> FunctionType;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            function_ = const_cast<void *>(static_cast<const void *>(&fn));
+            run_ = [](void *function, const int i) { (*static_cast<FunctionType *>(function))(i); };
+            num_iterations_ = n;
+            next_iteration_ = 0;
+            num_busy_workers_ = static_cast<int>(workers_.size());
+            ++generation_;
+        }
+        start_condition_.notify_all();
+        RunIterations();
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_condition_.wait(lock, [this]() { return num_busy_workers_ == 0; });
+    }
+
+  private:
+    void RunIterations() {
+        for (int i = next_iteration_++; i < num_iterations_; i = next_iteration_++)
+            run_(function_, i);
+    }
+
+    void WorkerLoop() {
+        uint64_t generation = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                start_condition_.wait(lock, [&]() { return stop_ || generation_ != generation; });
+                if (stop_)
+                    return;
+                generation = generation_;
+            }
+            RunIterations();
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (--num_busy_workers_ == 0)
+                done_condition_.notify_one();
+        }
+    }
+
+    std::vector<std::thread> workers_;
+    std::mutex mutex_;
+    std::condition_variable start_condition_, done_condition_;
+    bool stop_ = false;
+    uint64_t generation_ = 0;
+    int num_busy_workers_ = 0;
+
+    // The current call of ParallelFor(), run_(function_, i) calls fn(i).
+    void *function_ = nullptr;
+    void (*run_)(void *, int) = nullptr;
+    int num_iterations_ = 0;
+    std::atomic<int> next_iteration_{0};
 };
 
+// Detects whether a solver provides the batched evaluation
+//   EvaluateModelOnPoints(prepared_model, t, begin, end, errors, is_for_inlier)
+// next to the per-point EvaluateModelOnPoint(prepared_model, t, i, is_for_inlier).
+template <class Solver, class = void> struct HasBatchedEvaluation : std::false_type {};
+template <class Solver>
+struct HasBatchedEvaluation<Solver, std::void_t<decltype(std::declval<const Solver &>().EvaluateModelOnPoints(
+                                        std::declval<const typename Solver::PreparedModel &>(), 0, 0, 0,
+                                        std::declval<double *>(), false))>> : std::true_type {};
+
+// Detects whether a solver with three data types provides the fused evaluation
+//   EvaluateModelOnPoints(prepared_model, begin, end, errors, is_for_inlier)
+// that writes the errors of all data types t to errors[t] in a single pass.
+template <class Solver, class = void> struct HasFusedEvaluation : std::false_type {};
+template <class Solver>
+struct HasFusedEvaluation<Solver, std::void_t<decltype(std::declval<const Solver &>().EvaluateModelOnPoints(
+                                      std::declval<const typename Solver::PreparedModel &>(), 0, 0,
+                                      std::declval<double *const *>(), false))>> : std::true_type {};
+
+// Detects whether a solver provides a dedicated least squares refinement
+//   FinalLeastSquares(inlier_indices, solver_type, model)
+// of the final model, which is used instead of LeastSquares.
+template <class Solver, class Model, class = void> struct HasFinalLeastSquares : std::false_type {};
+template <class Solver, class Model>
+struct HasFinalLeastSquares<Solver, Model,
+                            std::void_t<decltype(std::declval<const Solver &>().FinalLeastSquares(
+                                std::declval<const std::vector<std::vector<int>> &>(), 0, std::declval<Model *>()))>>
+    : std::true_type {};
+
+// The container of the models of a minimal solver: Solver::ModelVector if the
+// solver defines it, e.g. as an InlineVector that does not allocate, and
+// std::vector<Model> otherwise.
+template <class Solver, class Model, class = void> struct SolverModelVector {
+    typedef std::vector<Model> type;
+};
+template <class Solver, class Model>
+struct SolverModelVector<Solver, Model, std::void_t<typename Solver::ModelVector>> {
+    typedef typename Solver::ModelVector type;
+};
+
+// Wald's sequential probability ratio test (SPRT) for the verification of
+// hypotheses with several data types [Chum, Matas, Optimal Randomized RANSAC,
+// PAMI 2008]. The data points are evaluated in a fixed random order and a
+// hypothesis is rejected as soon as the likelihood ratio of it being bad
+// rather than good exceeds the decision threshold A. The probabilities that a
+// point is an inlier to a good model (epsilon) or to a bad model (delta) are
+// kept per data type: delta is estimated from the rejected hypotheses and
+// epsilon from the best hypothesis found so far.
+class HybridSPRT {
+  public:
+    // Inlier and tested point counts per data type, collected while
+    // verifying the hypotheses of one minimal sample.
+    struct Record {
+        // Summed over all hypotheses rejected by the test.
+        std::vector<int> rejected_num_inliers, rejected_num_tested;
+        // Of the best hypothesis that passed the test.
+        std::vector<int> best_num_inliers;
+        // Of the hypothesis being scored. Kept here so that their storage is
+        // reused across hypotheses.
+        std::vector<int> num_inliers, num_tested;
+
+        void Reset(const int num_data_types) {
+            rejected_num_inliers.assign(num_data_types, 0);
+            rejected_num_tested.assign(num_data_types, 0);
+            best_num_inliers.assign(num_data_types, 0);
+        }
+    };
+
+    HybridSPRT(const ExtendedHybridLORansacOptions &options, const std::vector<int> &num_data)
+        : num_data_(num_data), time_model_(options.sprt_time_model_),
+          models_per_sample_(options.sprt_models_per_sample_),
+          epsilon_(num_data.size(), options.sprt_initial_epsilon_),
+          delta_(num_data.size(), options.sprt_initial_delta_), rejected_num_inliers_(num_data.size(), 0),
+          rejected_num_tested_(num_data.size(), 0) {
+        for (int t = 0; t < static_cast<int>(num_data.size()); ++t) {
+            for (int i = 0; i < num_data[t]; ++i)
+                order_.emplace_back(t, i);
+        }
+        std::mt19937 rng(options.random_seed_);
+        std::shuffle(order_.begin(), order_.end(), rng);
+        DesignTest();
+    }
+
+    // The data points as (data type, index) pairs, in evaluation order.
+    inline const std::vector<std::pair<int, int>> &order() const { return order_; }
+
+    // Increments of the log-likelihood ratio for an inlier and an outlier of
+    // data type t.
+    inline double log_ratio_inlier(const int t) const { return log_ratio_inlier_[t]; }
+    inline double log_ratio_outlier(const int t) const { return log_ratio_outlier_[t]; }
+
+    inline double log_decision_threshold() const { return log_decision_threshold_; }
+
+    // Probability that a good hypothesis is rejected, bounded by 1 / A.
+    inline double false_rejection_rate() const { return std::exp(-log_decision_threshold_); }
+
+    // Updates the delta estimates with the hypotheses rejected in record and
+    // designs a new test if any of them changed significantly.
+    void AddRejected(const Record &record) {
+        bool redesign = false;
+        for (int t = 0; t < static_cast<int>(num_data_.size()); ++t) {
+            rejected_num_inliers_[t] += record.rejected_num_inliers[t];
+            rejected_num_tested_[t] += record.rejected_num_tested[t];
+            if (rejected_num_tested_[t] < kMinNumTested)
+                continue;
+            delta_[t] = static_cast<double>(rejected_num_inliers_[t]) / static_cast<double>(rejected_num_tested_[t]);
+            redesign = redesign || std::abs(delta_[t] - design_delta_[t]) > kRelativeChange * design_delta_[t];
+        }
+        if (redesign)
+            DesignTest();
+    }
+
+    // Updates epsilon with the inlier counts of a new best hypothesis.
+    void UpdateEpsilon(const std::vector<int> &num_inliers) {
+        for (int t = 0; t < static_cast<int>(num_data_.size()); ++t) {
+            if (num_data_[t] > 0)
+                epsilon_[t] = static_cast<double>(num_inliers[t]) / static_cast<double>(num_data_[t]);
+        }
+        DesignTest();
+    }
+
+  private:
+    // Computes the likelihood ratio increments and the decision threshold A,
+    // the solution of A = t_M * C / m_S + 1 + log(A), where C is the expected
+    // increment of the log-likelihood ratio per point of a bad hypothesis.
+    void DesignTest() {
+        const int kNumDataTypes = static_cast<int>(num_data_.size());
+        design_delta_ = delta_;
+        log_ratio_inlier_.assign(kNumDataTypes, 0.0);
+        log_ratio_outlier_.assign(kNumDataTypes, 0.0);
+
+        const double kNumDataTotal = static_cast<double>(order_.size());
+        double C = 0.0;
+        for (int t = 0; t < kNumDataTypes; ++t) {
+            const double kEpsilon = std::min(epsilon_[t], kMaxProbability);
+            const double kDelta = std::min(std::max(delta_[t], kMinProbability), kMaxProbability);
+            // Data types on which good and bad hypotheses cannot be told
+            // apart do not contribute to the test.
+            if (kEpsilon <= kDelta)
+                continue;
+            log_ratio_inlier_[t] = std::log(kDelta / kEpsilon);
+            log_ratio_outlier_[t] = std::log((1.0 - kDelta) / (1.0 - kEpsilon));
+            C += num_data_[t] / kNumDataTotal *
+                 (kDelta * log_ratio_inlier_[t] + (1.0 - kDelta) * log_ratio_outlier_[t]);
+        }
+
+        if (C <= 0.0) {
+            log_decision_threshold_ = std::numeric_limits<double>::infinity();
+            return;
+        }
+        const double kA0 = time_model_ * C / models_per_sample_ + 1.0;
+        double A = kA0;
+        for (int i = 0; i < 10; ++i)
+            A = kA0 + std::log(A);
+        log_decision_threshold_ = std::log(A);
+    }
+
+    // Number of points of a data type that have to be tested on rejected
+    // hypotheses before delta is estimated from them.
+    static constexpr int kMinNumTested = 100;
+    // Relative change of delta that triggers the design of a new test.
+    static constexpr double kRelativeChange = 0.05;
+    static constexpr double kMinProbability = 1e-3;
+    static constexpr double kMaxProbability = 0.99;
+
+    std::vector<int> num_data_;
+    std::vector<std::pair<int, int>> order_;
+    double time_model_, models_per_sample_;
+
+    std::vector<double> epsilon_, delta_, design_delta_;
+    std::vector<long long> rejected_num_inliers_, rejected_num_tested_;
+
+    std::vector<double> log_ratio_inlier_, log_ratio_outlier_;
+    double log_decision_threshold_;
+};
+
+// Number of iterations needed to draw and accept an all-inlier sample with
+// probability 1 - prob_missing_best_model if good hypotheses are rejected with
+// probability false_rejection_rate (Eq. 4 in Chum and Matas).
+inline uint32_t NumRequiredIterationsSPRT(const std::vector<double> &inlier_ratios,
+                                          const double prob_missing_best_model, const std::vector<int> &sample_sizes,
+                                          const double false_rejection_rate, const uint32_t min_iterations,
+                                          const uint32_t max_iterations) {
+    double prob_good_sample = 1.0 - false_rejection_rate;
+    for (size_t i = 0; i < sample_sizes.size(); ++i)
+        prob_good_sample *= std::pow(inlier_ratios[i], static_cast<double>(sample_sizes[i]));
+    if (prob_good_sample <= 0.0)
+        return max_iterations;
+    if (prob_good_sample >= 1.0)
+        return min_iterations;
+    const double kNumIterations = std::ceil(std::log(prob_missing_best_model) / std::log(1.0 - prob_good_sample));
+    if (kNumIterations >= static_cast<double>(max_iterations))
+        return max_iterations;
+    return std::max(min_iterations, static_cast<uint32_t>(kNumIterations));
+}
+
 // Our customized hybrid-RANSAC based on HybridLocallyOptimizedMSAC from
 // RansacLib [LINK]
 // https://github.com/tsattler/RansacLib/blob/master/RansacLib/hybrid_ransac.h
@@ -34,12 +464,20 @@ class HybridLOMSAC : public HybridRansacBase {
     // implementation returning false is sufficient.
     // Returns the number of inliers.
     int EstimateModel(const ExtendedHybridLORansacOptions &options, const HybridSolver &solver, Model *best_model,
-                      HybridRansacStatistics *statistics) const {
+                      ExtendedHybridRansacStatistics *statistics) const {
         // Initializes all relevant variables.
+        HybridTimeBudget time_budget(options);
+        HybridTimeBudget *budget = time_budget.enabled() ? &time_budget : nullptr;
         ResetStatistics(statistics);
-        HybridRansacStatistics &stats = *statistics;
+        statistics->time_budget_exhausted = false;
+        statistics->profile = HybridRansacProfile();
+        ExtendedHybridRansacStatistics &stats = *statistics;
 
         const int kNumSolvers = solver.num_minimal_solvers();
+        HybridRansacProfile *profile = options.collect_profile_ ? &stats.profile : nullptr;
+        if (profile)
+            profile->num_minimal_solver_calls.assign(kNumSolvers, 0);
+        ActiveProfileScope profile_scope(profile);
         stats.num_iterations_per_solver.resize(kNumSolvers, 0);
 
         const int kNumDataTypes = solver.num_data_types();
@@ -77,46 +515,185 @@ class HybridLOMSAC : public HybridRansacBase {
         std::mt19937 rng;
         rng.seed(options.random_seed_);
 
+        std::unique_ptr<HybridSPRT> sprt;
+        HybridSPRT::Record sprt_record;
+        if (options.use_sprt_)
+            sprt.reset(new HybridSPRT(options, num_data));
+
+        // Hypotheses are generated in batches if requested. Every slot of a
+        // batch owns the buffers it writes to, so that the slots can be
+        // solved and scored in parallel. Solver types and samples are drawn
+        // on this thread, in slot order, from rng and the single sampler, and
+        // the slots are merged in order below, which makes the result
+        // independent of the number of threads. A single sampler also keeps
+        // the progress of PROSAC tied to the number of iterations.
+        // The batch size alone selects the loop, so that num_threads_ never
+        // changes the result.
+        const int batch_size = options.batch_size_;
+        const bool kUseBatches = batch_size > 0;
+
+        std::vector<std::vector<std::vector<int>>> batch_samples;
+        std::vector<ModelVector> batch_models;
+        std::vector<int> batch_solver_types, batch_num_models, batch_best_model_ids;
+        std::vector<double> batch_best_scores;
+        std::vector<HybridSPRT::Record> batch_sprt_records;
+        std::vector<HybridRansacProfile> batch_profiles;
+        std::unique_ptr<HybridThreadPool> thread_pool;
+        if (kUseBatches) {
+            thread_pool.reset(new HybridThreadPool(options.num_threads_));
+            batch_samples.resize(batch_size, minimal_sample);
+            batch_models.resize(batch_size);
+            batch_solver_types.resize(batch_size);
+            batch_num_models.resize(batch_size);
+            batch_best_model_ids.resize(batch_size);
+            batch_best_scores.resize(batch_size);
+            if (sprt)
+                batch_sprt_records.resize(batch_size);
+            if (profile)
+                batch_profiles.resize(batch_size);
+        }
+        int num_batch_slots = 0;
+        int next_batch_slot = 0;
+        bool solver_selection_failed = false;
+
         // Runs random sampling.
         for (stats.num_iterations_total = 0u; stats.num_iterations_total < max_num_iterations;
              ++stats.num_iterations_total) {
+            if (budget && budget->SamplingExpired()) {
+                stats.time_budget_exhausted = true;
+                break;
+            }
+
             // As proposed by Lebeda et al., Local Optimization is not executed
             // in the first lo_starting_iterations_ iterations. We thus run LO
             // on the best model found so far once we reach this iteration.
             if (stats.num_iterations_total == options.lo_starting_iterations_ &&
                 best_min_model_score < std::numeric_limits<double>::max()) {
-                ++stats.number_lo_iterations;
-                LocalOptimization(options, solver, stats.best_solver_type, &rng, best_model, &(stats.best_model_score),
-                                  &(stats.best_solver_type));
+                BudgetedLocalOptimization(options, solver, &rng, budget, best_model, &(stats.best_model_score),
+                                          statistics);
 
                 UpdateRANSACTerminationCriteria(options, solver, *best_model, statistics,
-                                                &max_num_iterations_per_solver);
+                                                &max_num_iterations_per_solver, sprt.get());
             }
 
-            const int kSolverType =
-                SelectMinimalSolver(solver, prior_probabilities, stats, options.min_num_iterations_, &rng);
+            int kSolverType = -1;
+            int kNumEstimatedModels = 0;
+            double best_local_score = std::numeric_limits<double>::max();
+            int best_local_model_id = 0;
+            const ModelVector *models = &estimated_models;
+            const HybridSPRT::Record *record = &sprt_record;
 
-            if (kSolverType < -1) {
-                // Since no solver could be selected, we stop Hybrid RANSAC
-                // here.
-                break;
-            }
+            if (!kUseBatches) {
+                kSolverType =
+                    SelectMinimalSolver(solver, prior_probabilities, stats, options.min_num_iterations_, &rng);
 
-            stats.num_iterations_per_solver[kSolverType] += 1;
+                if (kSolverType < -1) {
+                    // Since no solver could be selected, we stop Hybrid RANSAC
+                    // here.
+                    break;
+                }
 
-            sampler.Sample(min_sample_sizes[kSolverType], &minimal_sample);
+                sampler.Sample(min_sample_sizes[kSolverType], &minimal_sample);
 
-            // MinimalSolver returns the number of estimated models.
-            const int kNumEstimatedModels = solver.MinimalSolver(minimal_sample, kSolverType, &estimated_models);
+                // MinimalSolver returns the number of estimated models.
+                {
+                    ScopedPhaseTimer timer(profile ? &profile->minimal_solver_ns : nullptr);
+                    kNumEstimatedModels = solver.MinimalSolver(minimal_sample, kSolverType, &estimated_models);
+                }
+                if (profile) {
+                    ++profile->num_minimal_solver_calls[kSolverType];
+                    profile->num_models += kNumEstimatedModels;
+                }
 
-            if (kNumEstimatedModels > 0) {
                 // Finds the best model among all estimated models.
-                double best_local_score = std::numeric_limits<double>::max();
-                int best_local_model_id = 0;
-                GetBestEstimatedModelId(options, solver, estimated_models, kNumEstimatedModels, kSqrInlierThresh,
-                                        kNumDataTypes, num_data, &best_local_score,
-                                        &best_local_model_id); // kSolverType);
+                if (kNumEstimatedModels > 0) {
+                    ScopedPhaseTimer timer(profile ? &profile->scoring_ns : nullptr);
+                    GetBestEstimatedModelId(options, solver, estimated_models, kNumEstimatedModels, kSqrInlierThresh,
+                                            kNumDataTypes, num_data, best_min_model_score, &best_local_score,
+                                            &best_local_model_id, sprt.get(), &sprt_record); // kSolverType);
+                }
+            } else {
+                if (next_batch_slot == num_batch_slots) {
+                    if (solver_selection_failed)
+                        break;
+                    num_batch_slots = std::min<uint32_t>(batch_size, max_num_iterations - stats.num_iterations_total);
+                    for (int b = 0; b < num_batch_slots; ++b) {
+                        batch_solver_types[b] =
+                            SelectMinimalSolver(solver, prior_probabilities, stats, options.min_num_iterations_, &rng);
+                        if (batch_solver_types[b] < -1) {
+                            // Since no solver could be selected, we stop Hybrid
+                            // RANSAC after this batch.
+                            solver_selection_failed = true;
+                            num_batch_slots = b;
+                            break;
+                        }
+                        sampler.Sample(min_sample_sizes[batch_solver_types[b]], &batch_samples[b]);
+                    }
+                    // Hypotheses are scored against the best score known when
+                    // the batch is generated. This bound can only be looser
+                    // than the one at merge time, so the result is unchanged.
+                    // Slots that start after the sampling time is up are not
+                    // run and marked with -1 models. Sampling stops at the
+                    // first of them.
+                    thread_pool->ParallelFor(num_batch_slots, [&](const int b) {
+                        HybridRansacProfile *slot_profile = profile ? &batch_profiles[b] : nullptr;
+                        ActiveProfileScope slot_profile_scope(slot_profile);
+                        if (budget && budget->SamplingExpired()) {
+                            batch_num_models[b] = -1;
+                            return;
+                        }
+                        {
+                            ScopedPhaseTimer timer(slot_profile ? &slot_profile->minimal_solver_ns : nullptr);
+                            batch_num_models[b] =
+                                solver.MinimalSolver(batch_samples[b], batch_solver_types[b], &batch_models[b]);
+                        }
+                        batch_best_scores[b] = std::numeric_limits<double>::max();
+                        batch_best_model_ids[b] = 0;
+                        if (sprt)
+                            batch_sprt_records[b].Reset(kNumDataTypes);
+                        if (batch_num_models[b] > 0) {
+                            ScopedPhaseTimer timer(slot_profile ? &slot_profile->scoring_ns : nullptr);
+                            GetBestEstimatedModelId(options, solver, batch_models[b], batch_num_models[b],
+                                                    kSqrInlierThresh, kNumDataTypes, num_data, best_min_model_score,
+                                                    &batch_best_scores[b], &batch_best_model_ids[b], sprt.get(),
+                                                    sprt ? &batch_sprt_records[b] : nullptr);
+                        }
+                    });
+                    next_batch_slot = 0;
+                    if (profile) {
+                        for (int b = 0; b < num_batch_slots; ++b) {
+                            if (batch_num_models[b] < 0)
+                                continue;
+                            ++profile->num_minimal_solver_calls[batch_solver_types[b]];
+                            profile->num_models += batch_num_models[b];
+                            profile->Merge(batch_profiles[b]);
+                            batch_profiles[b] = HybridRansacProfile();
+                        }
+                    }
+                    if (num_batch_slots == 0)
+                        break;
+                }
+
+                const int b = next_batch_slot++;
+                if (batch_num_models[b] < 0) {
+                    stats.time_budget_exhausted = true;
+                    break;
+                }
+                kSolverType = batch_solver_types[b];
+                kNumEstimatedModels = batch_num_models[b];
+                best_local_score = batch_best_scores[b];
+                best_local_model_id = batch_best_model_ids[b];
+                models = &batch_models[b];
+                if (sprt)
+                    record = &batch_sprt_records[b];
+            }
+
+            stats.num_iterations_per_solver[kSolverType] += 1;
+
+            if (sprt && kNumEstimatedModels > 0)
+                sprt->AddRejected(*record);
 
+            if (kNumEstimatedModels > 0) {
                 // Updates the best model found so far.
                 if (best_local_score < best_min_model_score ||
                     stats.num_iterations_total == options.lo_starting_iterations_) {
@@ -126,7 +703,9 @@ class HybridLOMSAC : public HybridRansacBase {
                         // New best model (estimated from inliers found. Stores
                         // this model and runs local optimization
                         best_min_model_score = best_local_score;
-                        best_minimal_model = estimated_models[best_local_model_id];
+                        best_minimal_model = (*models)[best_local_model_id];
+                        if (sprt)
+                            sprt->UpdateEpsilon(record->best_num_inliers);
 
                         // Updates the best model.
                         UpdateBestModel(best_min_model_score, best_minimal_model, kSolverType,
@@ -143,10 +722,9 @@ class HybridLOMSAC : public HybridRansacBase {
                     // models found by local optimization and the input model,
                     // i.e., score_refined_model <= best_min_model_score holds.
                     if (kRunLO) {
-                        ++stats.number_lo_iterations;
                         double score = best_min_model_score;
-                        LocalOptimization(options, solver, stats.best_solver_type, &rng, &best_minimal_model, &score,
-                                          &(stats.best_solver_type));
+                        BudgetedLocalOptimization(options, solver, &rng, budget, &best_minimal_model, &score,
+                                                  statistics);
 
                         // Updates the best model.
                         UpdateBestModel(score, best_minimal_model, kSolverType, &(stats.best_model_score), best_model,
@@ -157,7 +735,7 @@ class HybridLOMSAC : public HybridRansacBase {
                     // as well as the number of inliers and inlier ratios for
                     // each data type.
                     UpdateRANSACTerminationCriteria(options, solver, *best_model, statistics,
-                                                    &max_num_iterations_per_solver);
+                                                    &max_num_iterations_per_solver, sprt.get());
                 } else {
                 }
             }
@@ -174,20 +752,33 @@ class HybridLOMSAC : public HybridRansacBase {
         // than lo_starting_iterations_ iterations, we run LO now.
         if (stats.num_iterations_total <= options.lo_starting_iterations_ &&
             stats.best_model_score < std::numeric_limits<double>::max()) {
-            ++stats.number_lo_iterations;
-            LocalOptimization(options, solver, stats.best_solver_type, &rng, best_model, &(stats.best_model_score),
-                              &(stats.best_solver_type));
+            BudgetedLocalOptimization(options, solver, &rng, budget, best_model, &(stats.best_model_score),
+                                      statistics);
 
-            UpdateRANSACTerminationCriteria(options, solver, *best_model, statistics, &max_num_iterations_per_solver);
+            UpdateRANSACTerminationCriteria(options, solver, *best_model, statistics, &max_num_iterations_per_solver,
+                                            sprt.get());
         }
 
-        if (options.final_least_squares_) {
+        bool run_final_least_squares = options.final_least_squares_;
+        if (run_final_least_squares && budget && !budget->FitsFinalLeastSquares()) {
+            stats.time_budget_exhausted = true;
+            run_final_least_squares = false;
+        }
+        if (run_final_least_squares) {
+            ScopedPhaseTimer timer(profile ? &profile->final_least_squares_ns : nullptr);
+            SolveTimeLimit final_time_limit;
+            if (budget)
+                final_time_limit.deadline = budget->Deadline();
+            ActiveSolveTimeLimitScope time_limit_scope(budget ? &final_time_limit : nullptr);
             Model refined_model = *best_model;
-            solver.LeastSquares(stats.inlier_indices, stats.best_solver_type, &refined_model);
+            if constexpr (HasFinalLeastSquares<HybridSolver, Model>::value)
+                solver.FinalLeastSquares(stats.inlier_indices, stats.best_solver_type, &refined_model);
+            else
+                solver.LeastSquares(stats.inlier_indices, stats.best_solver_type, &refined_model);
 
             double score = std::numeric_limits<double>::max();
-            ScoreModel(options, solver, refined_model, kSqrInlierThresh, kNumDataTypes, num_data,
-                       &score); // stats.best_solver_type);
+            ScoreModel(options, solver, refined_model, kSqrInlierThresh, kNumDataTypes, num_data, &score,
+                       stats.best_model_score); // stats.best_solver_type);
             if (score < stats.best_model_score) {
                 stats.best_model_score = score;
                 *best_model = refined_model;
@@ -196,7 +787,7 @@ class HybridLOMSAC : public HybridRansacBase {
                 // the number of RANSAC iterations is not necessary, but done
                 // here to avoid code duplication.
                 UpdateRANSACTerminationCriteria(options, solver, *best_model, statistics,
-                                                &max_num_iterations_per_solver);
+                                                &max_num_iterations_per_solver, sprt.get());
             }
         }
 
@@ -205,25 +796,18 @@ class HybridLOMSAC : public HybridRansacBase {
 
   public:
     // Randomly selects a minimal solver. See Eq. 1 in Camposeco et al.
-    int SelectMinimalSolver(const HybridSolver &solver, const std::vector<double> prior_probabilities,
+    int SelectMinimalSolver(const HybridSolver &solver, const std::vector<double> &prior_probabilities,
                             const HybridRansacStatistics &stats, const uint32_t min_num_iterations,
                             std::mt19937 *rng) const {
         double sum_probabilities = 0.0;
         const int kNumSolvers = static_cast<int>(prior_probabilities.size());
-        std::vector<std::vector<int>> min_sample_sizes;
-        solver.min_sample_sizes(&min_sample_sizes);
-        std::vector<double> probabilities(kNumSolvers, 0);
-
-        const int kNumDataTypes = solver.num_data_types();
 
         // There is a special case where all inlier ratios are 0. In this case,
         // the solvers should be sampled based on the priors.
         const double kSumInlierRatios = std::accumulate(stats.inlier_ratios.begin(), stats.inlier_ratios.end(), 0.0);
 
-        for (int i = 0; i < kNumSolvers; ++i) {
-            probabilities[i] = prior_probabilities[i];
-            sum_probabilities += probabilities[i];
-        }
+        for (int i = 0; i < kNumSolvers; ++i)
+            sum_probabilities += prior_probabilities[i];
 
         std::uniform_real_distribution<double> dist(0.0, sum_probabilities);
 
@@ -233,7 +817,7 @@ class HybridLOMSAC : public HybridRansacBase {
             if (prior_probabilities[i] == 0.0)
                 continue;
 
-            current_prob += probabilities[i];
+            current_prob += prior_probabilities[i];
             if (kProb <= current_prob)
                 return i;
         }
@@ -243,15 +827,36 @@ class HybridLOMSAC : public HybridRansacBase {
     void GetBestEstimatedModelId(const ExtendedHybridLORansacOptions &options, const HybridSolver &solver,
                                  const ModelVector &models, const int num_models,
                                  const std::vector<double> &squared_inlier_thresholds, const int num_data_types,
-                                 const std::vector<int> num_data, double *best_score, int *best_model_id,
-                                 const int kSolverType = -1) const {
+                                 const std::vector<int> &num_data, const double score_bound, double *best_score,
+                                 int *best_model_id, const HybridSPRT *sprt = nullptr,
+                                 HybridSPRT::Record *sprt_record = nullptr, const int kSolverType = -1) const {
         *best_score = std::numeric_limits<double>::max();
         *best_model_id = 0;
+        if (sprt != nullptr)
+            sprt_record->Reset(num_data_types);
 
         for (int m = 0; m < num_models; ++m) {
+            // Only models that beat both score_bound and the best model so far
+            // are of interest, so the scoring can stop as soon as it is clear
+            // that neither is the case.
             double score = std::numeric_limits<double>::max();
-            ScoreModel(options, solver, models[m], squared_inlier_thresholds, num_data_types, num_data,
-                       &score); // kSolverType);
+            if (sprt != nullptr) {
+                ScoreModelSPRT(options, solver, models[m], squared_inlier_thresholds, *sprt,
+                               std::min(score_bound, *best_score), &score, &sprt_record->num_inliers,
+                               &sprt_record->num_tested);
+                // Models rejected by the test or by their score are bad models
+                // and are used to estimate delta.
+                const bool kRejected = score == std::numeric_limits<double>::max();
+                for (int t = 0; t < num_data_types && kRejected; ++t) {
+                    sprt_record->rejected_num_inliers[t] += sprt_record->num_inliers[t];
+                    sprt_record->rejected_num_tested[t] += sprt_record->num_tested[t];
+                }
+                if (score < *best_score)
+                    sprt_record->best_num_inliers = sprt_record->num_inliers;
+            } else {
+                ScoreModel(options, solver, models[m], squared_inlier_thresholds, num_data_types, num_data, &score,
+                           std::min(score_bound, *best_score)); // kSolverType);
+            }
 
             if (score < *best_score) {
                 *best_score = score;
@@ -260,25 +865,148 @@ class HybridLOMSAC : public HybridRansacBase {
         }
     }
 
+    // Computes the weighted MSAC score of the model. As every point adds a
+    // non-negative term, the evaluation stops as soon as the partial score
+    // reaches score_bound, in which case the score is set to
+    // std::numeric_limits<double>::max(). Scores below score_bound are exact.
     void ScoreModel(const ExtendedHybridLORansacOptions &options, const HybridSolver &solver, const Model &model,
                     const std::vector<double> &squared_inlier_thresholds, const int num_data_types,
-                    const std::vector<int> num_data, double *score, const int kSolverType = -1) const {
+                    const std::vector<int> &num_data, double *score,
+                    const double score_bound = std::numeric_limits<double>::max(), const int kSolverType = -1) const {
         *score = 0.0;
 
+        // Only needed to skip the data types that a solver does not sample.
         std::vector<std::vector<int>> min_sample_sizes;
-        solver.min_sample_sizes(&min_sample_sizes);
+        if (kSolverType >= 0)
+            solver.min_sample_sizes(&min_sample_sizes);
+
+        // Per-model quantities are computed once and shared by all points.
+        const typename HybridSolver::PreparedModel kPreparedModel = solver.PrepareModel(model);
+
+        if constexpr (HasFusedEvaluation<HybridSolver>::value) {
+            if (kSolverType < 0 && num_data_types == kNumFusedDataTypes && num_data[0] == num_data[1] &&
+                num_data[0] == num_data[2]) {
+                ScoreModelFused(options, solver, kPreparedModel, squared_inlier_thresholds, num_data[0], score,
+                                score_bound);
+                return;
+            }
+        }
 
         // *score = solver.EvaluateModel(model);
+        HybridRansacProfile *profile = ActiveProfile();
         for (int t = 0; t < num_data_types; ++t) {
             if (kSolverType >= 0 && min_sample_sizes[kSolverType][t] == 0)
                 continue;
-            for (int i = 0; i < num_data[t]; ++i) {
-                double squared_error = solver.EvaluateModelOnPoint(model, t, i);
-                *score += ComputeScore(squared_error, squared_inlier_thresholds[t]) * options.data_type_weights_[t];
+            double squared_errors[kEvaluationBlockSize];
+            for (int begin = 0; begin < num_data[t]; begin += kEvaluationBlockSize) {
+                const int kEnd = std::min(begin + kEvaluationBlockSize, num_data[t]);
+                EvaluateModelOnPoints(solver, kPreparedModel, t, begin, kEnd, squared_errors);
+                if (profile)
+                    profile->num_point_evaluations += kEnd - begin;
+                for (int i = 0; i < kEnd - begin; ++i) {
+                    *score +=
+                        ComputeScore(squared_errors[i], squared_inlier_thresholds[t]) * options.data_type_weights_[t];
+                }
+                if (*score >= score_bound) {
+                    *score = std::numeric_limits<double>::max();
+                    return;
+                }
             }
         }
     }
 
+    // Number of points evaluated per call to EvaluateModelOnPoints.
+    static constexpr int kEvaluationBlockSize = 256;
+    // Number of data types evaluated by the fused EvaluateModelOnPoints.
+    static constexpr int kNumFusedDataTypes = 3;
+
+    // Scores all data types in a single pass over the num_data points, which
+    // are shared by the data types. The MSAC scores are accumulated per type
+    // and weighted after every block of points, which is also when the
+    // evaluation stops if score_bound is reached.
+    void ScoreModelFused(const ExtendedHybridLORansacOptions &options, const HybridSolver &solver,
+                         const typename HybridSolver::PreparedModel &prepared_model,
+                         const std::vector<double> &squared_inlier_thresholds, const int num_data, double *score,
+                         const double score_bound = std::numeric_limits<double>::max()) const {
+        double squared_errors[kNumFusedDataTypes][kEvaluationBlockSize];
+        double *const kErrors[kNumFusedDataTypes] = {squared_errors[0], squared_errors[1], squared_errors[2]};
+        double type_scores[kNumFusedDataTypes] = {0.0, 0.0, 0.0};
+        HybridRansacProfile *profile = ActiveProfile();
+        *score = 0.0;
+        for (int begin = 0; begin < num_data; begin += kEvaluationBlockSize) {
+            const int kEnd = std::min(begin + kEvaluationBlockSize, num_data);
+            solver.EvaluateModelOnPoints(prepared_model, begin, kEnd, kErrors, false);
+            if (profile)
+                profile->num_point_evaluations += kNumFusedDataTypes * (kEnd - begin);
+            for (int t = 0; t < kNumFusedDataTypes; ++t) {
+                const double kThreshold = squared_inlier_thresholds[t];
+                for (int i = 0; i < kEnd - begin; ++i)
+                    type_scores[t] += ComputeScore(squared_errors[t][i], kThreshold);
+            }
+            *score = 0.0;
+            for (int t = 0; t < kNumFusedDataTypes; ++t)
+                *score += type_scores[t] * options.data_type_weights_[t];
+            if (*score >= score_bound) {
+                *score = std::numeric_limits<double>::max();
+                return;
+            }
+        }
+    }
+
+    // Writes the squared errors of the data points [begin, end) of type t to
+    // squared_errors. Uses the batched evaluation of the solver if available.
+    inline void EvaluateModelOnPoints(const HybridSolver &solver,
+                                      const typename HybridSolver::PreparedModel &prepared_model, const int t,
+                                      const int begin, const int end, double *squared_errors,
+                                      const bool is_for_inlier = false) const {
+        if constexpr (HasBatchedEvaluation<HybridSolver>::value) {
+            solver.EvaluateModelOnPoints(prepared_model, t, begin, end, squared_errors, is_for_inlier);
+        } else {
+            for (int i = begin; i < end; ++i)
+                squared_errors[i - begin] = solver.EvaluateModelOnPoint(prepared_model, t, i, is_for_inlier);
+        }
+    }
+
+    // Scores the model on the data points in the order of sprt while running
+    // the sequential probability ratio test. If the model is rejected by the
+    // test or its score reaches score_bound, the evaluation stops and the
+    // score is set to std::numeric_limits<double>::max(). num_inliers and
+    // num_tested receive the counts per data type of the evaluated points.
+    void ScoreModelSPRT(const ExtendedHybridLORansacOptions &options, const HybridSolver &solver, const Model &model,
+                        const std::vector<double> &squared_inlier_thresholds, const HybridSPRT &sprt,
+                        const double score_bound, double *score, std::vector<int> *num_inliers,
+                        std::vector<int> *num_tested) const {
+        const int kNumDataTypes = solver.num_data_types();
+        num_inliers->assign(kNumDataTypes, 0);
+        num_tested->assign(kNumDataTypes, 0);
+        *score = 0.0;
+
+        const typename HybridSolver::PreparedModel kPreparedModel = solver.PrepareModel(model);
+        const double kLogDecisionThreshold = sprt.log_decision_threshold();
+        double log_likelihood_ratio = 0.0;
+        for (const std::pair<int, int> &point : sprt.order()) {
+            const int t = point.first;
+            double squared_error;
+            EvaluateModelOnPoints(solver, kPreparedModel, t, point.second, point.second + 1, &squared_error);
+            ++(*num_tested)[t];
+            if (squared_error < squared_inlier_thresholds[t]) {
+                ++(*num_inliers)[t];
+                log_likelihood_ratio += sprt.log_ratio_inlier(t);
+            } else {
+                log_likelihood_ratio += sprt.log_ratio_outlier(t);
+            }
+            *score += ComputeScore(squared_error, squared_inlier_thresholds[t]) * options.data_type_weights_[t];
+
+            if (log_likelihood_ratio > kLogDecisionThreshold || *score >= score_bound) {
+                *score = std::numeric_limits<double>::max();
+                break;
+            }
+        }
+
+        if (HybridRansacProfile *profile = ActiveProfile())
+            profile->num_point_evaluations += std::accumulate(num_tested->begin(), num_tested->end(), 0);
+    }
+
     // MSAC (top-hat) scoring function.
     inline double ComputeScore(const double squared_error, const double squared_error_threshold) const {
         return std::min(squared_error, squared_error_threshold);
@@ -294,6 +1022,9 @@ class HybridLOMSAC : public HybridRansacBase {
         solver.min_sample_sizes(&min_sample_sizes);
         int num_inliers = 0;
 
+        const typename HybridSolver::PreparedModel kPreparedModel = solver.PrepareModel(model);
+        HybridRansacProfile *profile = ActiveProfile();
+
         if (!common) {
             for (int t = 0; t < kNumDataTypes; ++t) {
                 if (kSolverType >= 0 && min_sample_sizes[kSolverType][t] == 0)
@@ -303,12 +1034,18 @@ class HybridLOMSAC : public HybridRansacBase {
                         inliers->resize(kNumDataTypes);
                     (*inliers)[t].clear();
                 }
-                for (int i = 0; i < num_data[t]; ++i) {
-                    double squared_error = solver.EvaluateModelOnPoint(model, t, i, true);
-                    if (squared_error < squared_inlier_thresholds[t]) {
-                        ++num_inliers;
-                        if (inliers != nullptr)
-                            (*inliers)[t].push_back(i);
+                double squared_errors[kEvaluationBlockSize];
+                for (int begin = 0; begin < num_data[t]; begin += kEvaluationBlockSize) {
+                    const int kEnd = std::min(begin + kEvaluationBlockSize, num_data[t]);
+                    EvaluateModelOnPoints(solver, kPreparedModel, t, begin, kEnd, squared_errors, true);
+                    if (profile)
+                        profile->num_point_evaluations += kEnd - begin;
+                    for (int i = begin; i < kEnd; ++i) {
+                        if (squared_errors[i - begin] < squared_inlier_thresholds[t]) {
+                            ++num_inliers;
+                            if (inliers != nullptr)
+                                (*inliers)[t].push_back(i);
+                        }
                     }
                 }
             }
@@ -323,16 +1060,22 @@ class HybridLOMSAC : public HybridRansacBase {
                     (*inliers)[t].clear();
                 }
             }
-            for (int i = 0; i < num_data[0]; ++i) {
-                bool is_common_inlier = true;
+            double squared_errors[kEvaluationBlockSize];
+            bool is_common_inlier[kEvaluationBlockSize];
+            for (int begin = 0; begin < num_data[0]; begin += kEvaluationBlockSize) {
+                const int kEnd = std::min(begin + kEvaluationBlockSize, num_data[0]);
+                std::fill(is_common_inlier, is_common_inlier + (kEnd - begin), true);
                 for (int t = 0; t < kNumDataTypes; ++t) {
-                    double squared_error = solver.EvaluateModelOnPoint(model, t, i);
-                    if (squared_error >= squared_inlier_thresholds[t]) {
-                        is_common_inlier = false;
-                        break;
+                    EvaluateModelOnPoints(solver, kPreparedModel, t, begin, kEnd, squared_errors);
+                    if (profile)
+                        profile->num_point_evaluations += kEnd - begin;
+                    for (int i = 0; i < kEnd - begin; ++i) {
+                        is_common_inlier[i] = is_common_inlier[i] && squared_errors[i] < squared_inlier_thresholds[t];
                     }
                 }
-                if (is_common_inlier) {
+                for (int i = begin; i < kEnd; ++i) {
+                    if (!is_common_inlier[i - begin])
+                        continue;
                     for (int t = 0; t < kNumDataTypes; ++t) {
                         if (kSolverType >= 0 && min_sample_sizes[kSolverType][t] == 0)
                             continue;
@@ -348,7 +1091,8 @@ class HybridLOMSAC : public HybridRansacBase {
 
     void UpdateRANSACTerminationCriteria(const ExtendedHybridLORansacOptions &options, const HybridSolver &solver,
                                          const Model &model, HybridRansacStatistics *statistics,
-                                         std::vector<uint32_t> *max_iterations) const {
+                                         std::vector<uint32_t> *max_iterations,
+                                         const HybridSPRT *sprt = nullptr) const {
         statistics->best_num_inliers = GetInliers(solver, model, options.squared_inlier_thresholds_,
                                                   &(statistics->inlier_indices)); // statistics->best_solver_type);
 
@@ -365,22 +1109,115 @@ class HybridLOMSAC : public HybridRansacBase {
             }
         }
 
+        if constexpr (std::is_same<Sampler, HybridProsacSampling<HybridSolver>>::value) {
+            UpdateProsacTerminationCriteria(options, solver, *statistics, max_iterations, sprt);
+            return;
+        }
+
         std::vector<std::vector<int>> min_sample_sizes;
         solver.min_sample_sizes(&min_sample_sizes);
         const int kNumSolvers = solver.num_minimal_solvers();
         for (int s = 0; s < kNumSolvers; ++s) {
+            if (sprt != nullptr) {
+                // Good hypotheses might be rejected by the SPRT, which
+                // requires more samples.
+                (*max_iterations)[s] = NumRequiredIterationsSPRT(
+                    statistics->inlier_ratios, 1.0 - options.success_probability_, min_sample_sizes[s],
+                    sprt->false_rejection_rate(), options.min_num_iterations_, options.max_num_iterations_per_solver_);
+                continue;
+            }
             (*max_iterations)[s] = utils::NumRequiredIterations(
                 statistics->inlier_ratios, 1.0 - options.success_probability_, min_sample_sizes[s],
                 options.min_num_iterations_, options.max_num_iterations_per_solver_);
         }
     }
 
+    // Termination criteria of PROSAC (Sec. 2.2 in Chum and Matas). Since the
+    // data is sorted by decreasing quality, the support of the best model is
+    // evaluated on the n best points for every n. Among the n for which the
+    // support is unlikely to be random (non-randomness), each solver runs
+    // the smallest number of iterations that guarantees an all-inlier sample
+    // from the n best points (maximality).
+    void UpdateProsacTerminationCriteria(const ExtendedHybridLORansacOptions &options, const HybridSolver &solver,
+                                         const HybridRansacStatistics &statistics,
+                                         std::vector<uint32_t> *max_iterations, const HybridSPRT *sprt) const {
+        const int kNumDataTypes = solver.num_data_types();
+        std::vector<int> num_data;
+        solver.num_data(&num_data);
+        const int N = *std::min_element(num_data.begin(), num_data.end());
+
+        // support[t][n] is the number of inliers of type t among the n best
+        // points.
+        std::vector<std::vector<int>> support(kNumDataTypes, std::vector<int>(N + 1, 0));
+        for (int t = 0; t < kNumDataTypes; ++t) {
+            for (const int idx : statistics.inlier_indices[t]) {
+                if (idx < N)
+                    ++support[t][idx + 1];
+            }
+            std::partial_sum(support[t].begin(), support[t].end(), support[t].begin());
+        }
+
+        const double kFalseRejectionRate = sprt != nullptr ? sprt->false_rejection_rate() : 0.0;
+        const double kBeta = options.prosac_beta_;
+        std::vector<std::vector<int>> min_sample_sizes;
+        solver.min_sample_sizes(&min_sample_sizes);
+        std::vector<double> inlier_ratios(kNumDataTypes);
+        const int kNumSolvers = solver.num_minimal_solvers();
+        for (int s = 0; s < kNumSolvers; ++s) {
+            const std::vector<int> &kSampleSizes = min_sample_sizes[s];
+            const int m = *std::max_element(kSampleSizes.begin(), kSampleSizes.end());
+            uint32_t num_iterations = options.max_num_iterations_per_solver_;
+            for (int n = std::max(m, 1); n <= N; ++n) {
+                // The support on all points is always considered, which
+                // makes this at most the number of iterations of RANSAC.
+                bool is_non_random = true;
+                for (int t = 0; t < kNumDataTypes; ++t) {
+                    inlier_ratios[t] = static_cast<double>(support[t][n]) / static_cast<double>(n);
+                    if (kSampleSizes[t] == 0 || n == N)
+                        continue;
+                    // Normal approximation of the minimal support of a model
+                    // that is not random with probability 95%.
+                    const double kMean = kSampleSizes[t] + kBeta * (n - kSampleSizes[t]);
+                    const double kSigma = std::sqrt(kBeta * (1.0 - kBeta) * (n - kSampleSizes[t]));
+                    is_non_random = is_non_random && support[t][n] >= kMean + 1.645 * kSigma;
+                }
+                if (!is_non_random)
+                    continue;
+                num_iterations = std::min(
+                    num_iterations, NumRequiredIterationsSPRT(inlier_ratios, 1.0 - options.success_probability_,
+                                                              kSampleSizes, kFalseRejectionRate,
+                                                              options.min_num_iterations_,
+                                                              options.max_num_iterations_per_solver_));
+            }
+            (*max_iterations)[s] = num_iterations;
+        }
+    }
+
+    // Runs LocalOptimization on the model unless it does not fit into the
+    // time budget, and counts it in the statistics.
+    void BudgetedLocalOptimization(const ExtendedHybridLORansacOptions &options, const HybridSolver &solver,
+                                   std::mt19937 *rng, HybridTimeBudget *budget, Model *model, double *score,
+                                   ExtendedHybridRansacStatistics *statistics) const {
+        if (budget && !budget->StartLO()) {
+            statistics->time_budget_exhausted = true;
+            return;
+        }
+        ++statistics->number_lo_iterations;
+        ScopedPhaseTimer timer(ActiveProfile() ? &ActiveProfile()->local_optimization_ns : nullptr);
+        LocalOptimization(options, solver, statistics->best_solver_type, rng, model, score,
+                          &(statistics->best_solver_type), budget);
+        if (budget)
+            budget->StopLO();
+    }
+
     // See algorithms 2 and 3 in Lebeda et al.
     // The input model is overwritten with the refined model if the latter is
-    // better, i.e., has a lower score.
+    // better, i.e., has a lower score. If a time budget is given, the
+    // optimization stops early once it runs out.
     void LocalOptimization(const ExtendedHybridLORansacOptions &options, const HybridSolver &solver,
                            const int solver_type, std::mt19937 *rng, Model *best_minimal_model,
-                           double *score_best_minimal_model, int *best_solver_type) const {
+                           double *score_best_minimal_model, int *best_solver_type,
+                           HybridTimeBudget *budget = nullptr) const {
         std::vector<int> num_data;
         solver.num_data(&num_data);
         const int kNumDataTypes = static_cast<int>(num_data.size());
@@ -397,15 +1234,26 @@ class HybridLOMSAC : public HybridRansacBase {
             squared_inlier_thresholds[i] *= kThreshMult;
         }
 
+        // The optimizer solves of this round stop when the round has to.
+        SolveTimeLimit time_limit;
+        if (budget)
+            time_limit.deadline = budget->LODeadline();
+        ActiveSolveTimeLimitScope time_limit_scope(budget ? &time_limit : nullptr);
+
         // Performs an initial least squares fit of the best model found by the
         // minimal solver so far and then determines the inliers to that model
-        // under a (slightly) relaxed inlier threshold.
+        // under a (slightly) relaxed inlier threshold. Its duration predicts
+        // the one of the final least squares refinement if it ran Ceres, i.e.,
+        // if it was neither skipped nor run by the Levenberg-Marquardt refiner.
         Model m_init = *best_minimal_model;
+        const double kFitStartMs = budget ? budget->ElapsedMs() : 0.0;
         LeastSquaresFit(options, squared_inlier_thresholds, solver_type, solver, rng, &m_init, true);
+        if (budget && time_limit.num_ceres_solves > 0)
+            budget->AddLeastSquaresTime(budget->ElapsedMs() - kFitStartMs);
 
         double score = std::numeric_limits<double>::max();
-        ScoreModel(options, solver, m_init, options.squared_inlier_thresholds_, kNumDataTypes, num_data,
-                   &score); // solver_type);
+        ScoreModel(options, solver, m_init, options.squared_inlier_thresholds_, kNumDataTypes, num_data, &score,
+                   *score_best_minimal_model); // solver_type);
         UpdateBestModel(score, m_init, solver_type, score_best_minimal_model, best_minimal_model, best_solver_type);
 
         std::vector<std::vector<int>> inliers_base;
@@ -434,6 +1282,9 @@ class HybridLOMSAC : public HybridRansacBase {
         // types is not well-defined.
         // ***But we can do this in this case***
         for (int r = 0; r < options.num_lo_steps_; ++r) {
+            if (budget && budget->LOExpired())
+                return;
+
             std::vector<int> sample_all_type = inliers_base_all_type;
             utils::RandomShuffleAndResize(kNonMinSampleSize, rng, &inliers_base_all_type);
 
@@ -451,8 +1302,8 @@ class HybridLOMSAC : public HybridRansacBase {
             if (!solver.NonMinimalSolver(sample, solver_type, &m_non_min))
                 continue;
 
-            ScoreModel(options, solver, m_non_min, options.squared_inlier_thresholds_, kNumDataTypes, num_data,
-                       &score); // solver_type);
+            ScoreModel(options, solver, m_non_min, options.squared_inlier_thresholds_, kNumDataTypes, num_data, &score,
+                       *score_best_minimal_model); // solver_type);
             UpdateBestModel(score, m_non_min, solver_type, score_best_minimal_model, best_minimal_model,
                             best_solver_type);
 
@@ -466,10 +1317,13 @@ class HybridLOMSAC : public HybridRansacBase {
             // The current threshold multiplier and its update.
             std::vector<double> cur_squared_inlier_thresholds = squared_inlier_thresholds;
             for (int i = 0; i < options.num_lsq_iterations_; ++i) {
+                if (budget && budget->LOExpired())
+                    return;
+
                 LeastSquaresFit(options, cur_squared_inlier_thresholds, solver_type, solver, rng, &m_non_min);
 
                 ScoreModel(options, solver, m_non_min, options.squared_inlier_thresholds_, kNumDataTypes, num_data,
-                           &score); // solver_type);
+                           &score, *score_best_minimal_model); // solver_type);
                 UpdateBestModel(score, m_non_min, solver_type, score_best_minimal_model, best_minimal_model,
                                 best_solver_type);
                 for (int j = 0; j < kNumDataTypes; ++j) {
@@ -575,4 +1429,19 @@ class HybridLOMSAC : public HybridRansacBase {
     }
 };
 
+// Runs HybridLOMSAC on the data of the solver. If use_prosac is set, the data
+// has to be sorted by decreasing quality (see ScoreOrder) and is sampled by
+// PROSAC. Otherwise, it is sampled uniformly.
+template <class Model, class HybridSolver>
+int EstimateHybridModel(const ExtendedHybridLORansacOptions &options, const HybridSolver &solver,
+                        const bool use_prosac, Model *best_model, ExtendedHybridRansacStatistics *statistics) {
+    typedef typename SolverModelVector<HybridSolver, Model>::type ModelVector;
+    if (use_prosac) {
+        HybridLOMSAC<Model, ModelVector, HybridSolver, HybridProsacSampling<HybridSolver>> lomsac;
+        return lomsac.EstimateModel(options, solver, best_model, statistics);
+    }
+    HybridLOMSAC<Model, ModelVector, HybridSolver> lomsac;
+    return lomsac.EstimateModel(options, solver, best_model, statistics);
+}
+
 } // namespace madpose
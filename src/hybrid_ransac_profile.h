@@ -0,0 +1,173 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+namespace madpose {
+
+// Counters and timings of one run of HybridLOMSAC, collected if
+// ExtendedHybridLORansacOptions::collect_profile_ is set.
+struct HybridRansacProfile {
+    // Cumulative wall-clock time per phase in nanoseconds. Scoring only
+    // covers the hypotheses of the minimal solvers, scoring within local
+    // optimization is part of local_optimization_ns.
+    int64_t minimal_solver_ns = 0;
+    int64_t scoring_ns = 0;
+    int64_t local_optimization_ns = 0;
+    int64_t final_least_squares_ns = 0;
+
+    // Number of MinimalSolver calls per solver type.
+    std::vector<int64_t> num_minimal_solver_calls;
+    // Number of models returned by the minimal solvers, and of solutions
+    // they discarded because of the minimum depth constraint.
+    int64_t num_models = 0;
+    int64_t num_models_rejected_min_depth = 0;
+    // Number of evaluations of a model on a single data point.
+    int64_t num_point_evaluations = 0;
+    // Number of Ceres solves and their total number of iterations.
+    int64_t num_ceres_solves = 0;
+    int64_t num_ceres_iterations = 0;
+    // Number of solves of the built-in Levenberg-Marquardt refiner and their
+    // total number of iterations.
+    int64_t num_refiner_solves = 0;
+    int64_t num_refiner_iterations = 0;
+
+    void Merge(const HybridRansacProfile &other) {
+        minimal_solver_ns += other.minimal_solver_ns;
+        scoring_ns += other.scoring_ns;
+        local_optimization_ns += other.local_optimization_ns;
+        final_least_squares_ns += other.final_least_squares_ns;
+        if (num_minimal_solver_calls.size() < other.num_minimal_solver_calls.size())
+            num_minimal_solver_calls.resize(other.num_minimal_solver_calls.size(), 0);
+        for (size_t i = 0; i < other.num_minimal_solver_calls.size(); ++i)
+            num_minimal_solver_calls[i] += other.num_minimal_solver_calls[i];
+        num_models += other.num_models;
+        num_models_rejected_min_depth += other.num_models_rejected_min_depth;
+        num_point_evaluations += other.num_point_evaluations;
+        num_ceres_solves += other.num_ceres_solves;
+        num_ceres_iterations += other.num_ceres_iterations;
+        num_refiner_solves += other.num_refiner_solves;
+        num_refiner_iterations += other.num_refiner_iterations;
+    }
+};
+
+// The profile that the current thread records into, or nullptr if profiling
+// is disabled. The solvers and optimizers report their counters through it,
+// which keeps their interfaces unchanged and costs a single check when
+// profiling is off.
+inline HybridRansacProfile *&ActiveProfile() {
+    thread_local HybridRansacProfile *profile = nullptr;
+    return profile;
+}
+
+// Makes profile the active profile of the current thread for its lifetime.
+class ActiveProfileScope {
+  public:
+    explicit ActiveProfileScope(HybridRansacProfile *profile) : previous_(ActiveProfile()) {
+        ActiveProfile() = profile;
+    }
+    ~ActiveProfileScope() { ActiveProfile() = previous_; }
+
+    ActiveProfileScope(const ActiveProfileScope &) = delete;
+    ActiveProfileScope &operator=(const ActiveProfileScope &) = delete;
+
+  private:
+    HybridRansacProfile *previous_;
+};
+
+// Deadline of the optimizer solves on the current thread, set by
+// HybridLOMSAC from its time budget. Solves that would start after the
+// deadline are skipped and running ones stop at it. num_ceres_solves counts
+// the Ceres solves made under the limit.
+struct SolveTimeLimit {
+    std::chrono::steady_clock::time_point deadline;
+    int num_ceres_solves = 0;
+};
+
+// The time limit of the current thread, or nullptr if there is none.
+inline SolveTimeLimit *&ActiveSolveTimeLimit() {
+    thread_local SolveTimeLimit *limit = nullptr;
+    return limit;
+}
+
+// Makes limit the active time limit of the current thread for its lifetime.
+class ActiveSolveTimeLimitScope {
+  public:
+    explicit ActiveSolveTimeLimitScope(SolveTimeLimit *limit) : previous_(ActiveSolveTimeLimit()) {
+        ActiveSolveTimeLimit() = limit;
+    }
+    ~ActiveSolveTimeLimitScope() { ActiveSolveTimeLimit() = previous_; }
+
+    ActiveSolveTimeLimitScope(const ActiveSolveTimeLimitScope &) = delete;
+    ActiveSolveTimeLimitScope &operator=(const ActiveSolveTimeLimitScope &) = delete;
+
+  private:
+    SolveTimeLimit *previous_;
+};
+
+// Lowers *max_solver_time_in_seconds to the time left until the deadline of
+// the active time limit, if any. Returns false if the deadline has passed, in
+// which case the solve should be skipped.
+inline bool ApplySolveTimeLimit(double *max_solver_time_in_seconds) {
+    const SolveTimeLimit *limit = ActiveSolveTimeLimit();
+    if (limit == nullptr)
+        return true;
+    const double kSecondsLeft =
+        std::chrono::duration<double>(limit->deadline - std::chrono::steady_clock::now()).count();
+    if (kSecondsLeft <= 0.0)
+        return false;
+    *max_solver_time_in_seconds = std::min(*max_solver_time_in_seconds, kSecondsLeft);
+    return true;
+}
+
+// Adds the wall-clock time of its lifetime to *ns. Does nothing if ns is
+// nullptr.
+class ScopedPhaseTimer {
+  public:
+    typedef std::chrono::steady_clock Clock;
+
+    explicit ScopedPhaseTimer(int64_t *ns) : ns_(ns) {
+        if (ns_)
+            start_ = Clock::now();
+    }
+    ~ScopedPhaseTimer() {
+        if (ns_)
+            *ns_ += std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start_).count();
+    }
+
+    ScopedPhaseTimer(const ScopedPhaseTimer &) = delete;
+    ScopedPhaseTimer &operator=(const ScopedPhaseTimer &) = delete;
+
+  private:
+    int64_t *ns_;
+    Clock::time_point start_;
+};
+
+// Counts a solution discarded by the minimum depth constraint.
+inline void RecordMinDepthRejection() {
+    if (HybridRansacProfile *profile = ActiveProfile())
+        ++profile->num_models_rejected_min_depth;
+}
+
+// Counts a Ceres solve that took num_iterations iterations.
+inline void RecordCeresSolve(const int num_iterations) {
+    if (SolveTimeLimit *limit = ActiveSolveTimeLimit())
+        ++limit->num_ceres_solves;
+    if (HybridRansacProfile *profile = ActiveProfile()) {
+        ++profile->num_ceres_solves;
+        profile->num_ceres_iterations += num_iterations;
+    }
+}
+
+// Counts a solve of the Levenberg-Marquardt refiner that took num_iterations
+// iterations.
+inline void RecordRefinerSolve(const int num_iterations) {
+    if (HybridRansacProfile *profile = ActiveProfile()) {
+        ++profile->num_refiner_solves;
+        profile->num_refiner_iterations += num_iterations;
+    }
+}
+
+} // namespace madpose
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cassert>
+
+namespace madpose {
+
+// A vector of at most Capacity elements that are stored inline, so that it
+// never allocates. Holds the solutions of the minimal solvers, whose number is
+// bounded by the degree of the solver. Provides the subset of the std::vector
+// interface that is used for model containers.
+template <class T, int Capacity> class InlineVector {
+  public:
+    typedef T value_type;
+    typedef T *iterator;
+    typedef const T *const_iterator;
+
+    InlineVector() : size_(0) {}
+
+    static constexpr int capacity() { return Capacity; }
+    int size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    bool full() const { return size_ == Capacity; }
+
+    void clear() { size_ = 0; }
+    void push_back(const T &value) {
+        assert(size_ < Capacity);
+        data_[size_++] = value;
+    }
+
+    T &operator[](const int i) { return data_[i]; }
+    const T &operator[](const int i) const { return data_[i]; }
+    T &back() { return data_[size_ - 1]; }
+    const T &back() const { return data_[size_ - 1]; }
+
+    iterator begin() { return data_; }
+    iterator end() { return data_ + size_; }
+    const_iterator begin() const { return data_; }
+    const_iterator end() const { return data_ + size_; }
+
+  private:
+    T data_[Capacity];
+    int size_;
+};
+
+} // namespace madpose
@@ -0,0 +1,282 @@
+#pragma once
+
+#include "inline_vector.h"
+
+#include <Eigen/Dense>
+#include <ceres/ceres.h>
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+namespace madpose {
+
+// Levenberg-Marquardt refinement of small problems with at most
+// kMaxNumParameters local parameters, such as those of the optimizers in
+// optimizer.h. Parameter blocks and residuals are specified as for a
+// ceres::Problem and evaluated by the same cost functions, but the normal
+// equations are accumulated in fixed-size matrices, so that a solve neither
+// allocates nor goes through the preprocessing of Ceres.
+//
+// Quaternion blocks are updated on SO(3) as with ceres::QuaternionManifold,
+// lower bounds are enforced by clamping the updated values, and the residuals
+// of a cost function are weighted by rho'(|r|^2) of its loss function, i.e.
+// robust losses are handled by iteratively reweighted least squares.
+template <int kMaxNumParameters> class LevenbergMarquardtRefiner {
+  public:
+    typedef Eigen::Matrix<double, kMaxNumParameters, kMaxNumParameters> Hessian;
+    typedef Eigen::Matrix<double, kMaxNumParameters, 1> Gradient;
+
+    void AddParameterBlock(double *values, const int size, const bool is_quaternion = false) {
+        assert(size <= kMaxBlockSize && (!is_quaternion || size == 4));
+        ParameterBlock block;
+        block.values = values;
+        block.size = size;
+        block.is_quaternion = is_quaternion;
+        std::fill(block.lower_bounds, block.lower_bounds + kMaxBlockSize, -std::numeric_limits<double>::infinity());
+        parameter_blocks_.push_back(block);
+    }
+
+    void SetParameterBlockConstant(const double *values) { parameter_blocks_[BlockIndex(values)].is_constant = true; }
+
+    void SetParameterLowerBound(const double *values, const int index, const double lower_bound) {
+        parameter_blocks_[BlockIndex(values)].lower_bounds[index] = lower_bound;
+    }
+
+    void ClearResidualBlocks() { residual_sets_.clear(); }
+
+    // Sets the callback that is run before each evaluation of the cost
+    // functions, as with ceres::Problem::Options::evaluation_callback.
+    void SetEvaluationCallback(ceres::EvaluationCallback *callback) { evaluation_callback_ = callback; }
+
+    int NumResidualBlocks() const {
+        int num_blocks = 0;
+        for (const ResidualSet &set : residual_sets_)
+            num_blocks += set.cost_functions->size();
+        return num_blocks;
+    }
+
+    // Adds a residual block for each of cost_functions, which all take the
+    // given parameter blocks. The cost functions must outlive Solve().
+    // loss_function may be null.
+    void AddResidualBlocks(const std::vector<const ceres::CostFunction *> &cost_functions,
+                           const std::vector<double *> &parameter_blocks, const ceres::LossFunction *loss_function) {
+        assert(parameter_blocks.size() <= kMaxNumBlocks);
+        ResidualSet set;
+        set.cost_functions = &cost_functions;
+        set.loss_function = loss_function;
+        set.num_blocks = parameter_blocks.size();
+        for (int k = 0; k < set.num_blocks; k++)
+            set.blocks[k] = BlockIndex(parameter_blocks[k]);
+        residual_sets_.push_back(set);
+    }
+
+    // Minimizes the cost from the current values of the parameter blocks and
+    // returns the number of iterations. The iteration and time limits, the
+    // tolerances and the trust region radii of options are used as by Ceres.
+    int Solve(const ceres::Solver::Options &options) {
+        const std::chrono::steady_clock::time_point kStart = std::chrono::steady_clock::now();
+        int num_parameters = 0;
+        for (ParameterBlock &block : parameter_blocks_) {
+            block.offset = num_parameters;
+            if (!block.is_constant)
+                num_parameters += block.is_quaternion ? 3 : block.size;
+        }
+        assert(num_parameters <= kMaxNumParameters);
+
+        Hessian JtJ;
+        Gradient Jtr;
+        double cost = Evaluate(&JtJ, &Jtr);
+        double lambda = 1.0 / options.initial_trust_region_radius;
+        int num_iterations = 0;
+        while (num_iterations < options.max_num_iterations) {
+            if (std::chrono::duration<double>(std::chrono::steady_clock::now() - kStart).count() >=
+                options.max_solver_time_in_seconds)
+                break;
+            num_iterations++;
+            if (Jtr.template lpNorm<Eigen::Infinity>() <= options.gradient_tolerance)
+                break;
+
+            // The damping is scaled by the diagonal of J^T J as in Ceres.
+            Hessian A = JtJ;
+            A.diagonal() += lambda * JtJ.diagonal().cwiseMax(kMinDiagonal);
+            A.diagonal().tail(kMaxNumParameters - num_parameters).setOnes();
+            const Gradient delta = -A.ldlt().solve(Jtr);
+            if (delta.norm() <= options.parameter_tolerance * (ParameterNorm() + options.parameter_tolerance))
+                break;
+
+            for (ParameterBlock &block : parameter_blocks_)
+                std::copy(block.values, block.values + block.size, block.backup);
+            Plus(delta);
+            const double new_cost = Evaluate(nullptr, nullptr);
+            if (new_cost < cost) {
+                lambda = std::max(0.1 * lambda, kMinLambda);
+                if (cost - new_cost <= options.function_tolerance * cost)
+                    break;
+                cost = Evaluate(&JtJ, &Jtr);
+            } else {
+                for (ParameterBlock &block : parameter_blocks_)
+                    std::copy(block.backup, block.backup + block.size, block.values);
+                lambda *= 10.0;
+                if (lambda > 1.0 / options.min_trust_region_radius)
+                    break;
+            }
+        }
+        return num_iterations;
+    }
+
+  private:
+    // The sizes of the parameter blocks and the residuals of the cost
+    // functions in cost_functions.h.
+    static constexpr int kMaxNumBlocks = 8;
+    static constexpr int kMaxBlockSize = 4;
+    static constexpr int kMaxNumResiduals = 2;
+
+    static constexpr double kMinDiagonal = 1e-6;
+    static constexpr double kMinLambda = 1e-12;
+
+    struct ParameterBlock {
+        double *values;
+        int size;
+        bool is_quaternion;
+        bool is_constant = false;
+        double lower_bounds[kMaxBlockSize];
+        double backup[kMaxBlockSize];
+        // Offset of the block in the local parameters.
+        int offset;
+    };
+
+    struct ResidualSet {
+        const std::vector<const ceres::CostFunction *> *cost_functions;
+        const ceres::LossFunction *loss_function;
+        int num_blocks;
+        int blocks[kMaxNumBlocks];
+    };
+
+    int BlockIndex(const double *values) const {
+        for (int k = 0; k < parameter_blocks_.size(); k++) {
+            if (parameter_blocks_[k].values == values)
+                return k;
+        }
+        assert(false);
+        return -1;
+    }
+
+    // Jacobian of the update q' = [cos |d|, sin |d| / |d| d] * q with respect to
+    // d at d = 0, as in ceres::QuaternionManifold.
+    static Eigen::Matrix<double, 4, 3> QuaternionPlusJacobian(const double *q) {
+        Eigen::Matrix<double, 4, 3> J;
+        J << -q[1], -q[2], -q[3], q[0], q[3], -q[2], -q[3], q[0], q[1], q[2], -q[1], q[0];
+        return J;
+    }
+
+    static void QuaternionPlus(double *q, const Eigen::Vector3d &d) {
+        const double kNorm = d.norm();
+        if (kNorm == 0.0)
+            return;
+        const double a[4] = {std::cos(kNorm), std::sin(kNorm) / kNorm * d(0), std::sin(kNorm) / kNorm * d(1),
+                             std::sin(kNorm) / kNorm * d(2)};
+        Eigen::Vector4d product(a[0] * q[0] - a[1] * q[1] - a[2] * q[2] - a[3] * q[3],
+                                a[0] * q[1] + a[1] * q[0] + a[2] * q[3] - a[3] * q[2],
+                                a[0] * q[2] - a[1] * q[3] + a[2] * q[0] + a[3] * q[1],
+                                a[0] * q[3] + a[1] * q[2] - a[2] * q[1] + a[3] * q[0]);
+        Eigen::Map<Eigen::Vector4d> q_map(q);
+        q_map = product.normalized();
+    }
+
+    // Applies the local update delta to the variable parameter blocks and
+    // clamps the updated values to their lower bounds.
+    void Plus(const Gradient &delta) {
+        for (ParameterBlock &block : parameter_blocks_) {
+            if (block.is_constant)
+                continue;
+            if (block.is_quaternion) {
+                QuaternionPlus(block.values, delta.template segment<3>(block.offset));
+                continue;
+            }
+            for (int c = 0; c < block.size; c++)
+                block.values[c] = std::max(block.values[c] + delta(block.offset + c), block.lower_bounds[c]);
+        }
+    }
+
+    double ParameterNorm() const {
+        double sq_norm = 0.0;
+        for (const ParameterBlock &block : parameter_blocks_) {
+            for (int c = 0; !block.is_constant && c < block.size; c++)
+                sq_norm += block.values[c] * block.values[c];
+        }
+        return std::sqrt(sq_norm);
+    }
+
+    // Returns the cost 1/2 sum rho(|r|^2) at the current values. If JtJ is not
+    // null, also computes the lower triangle of J^T W J and J^T W r in the
+    // local parameters, where W holds the weights rho'(|r|^2).
+    double Evaluate(Hessian *JtJ, Gradient *Jtr) const {
+        if (JtJ != nullptr) {
+            JtJ->setZero();
+            Jtr->setZero();
+        }
+        if (evaluation_callback_ != nullptr)
+            evaluation_callback_->PrepareForEvaluation(JtJ != nullptr, true);
+        double cost = 0.0;
+        for (const ResidualSet &set : residual_sets_) {
+            const double *parameters[kMaxNumBlocks];
+            double jacobian_storage[kMaxNumBlocks][kMaxNumResiduals * kMaxBlockSize];
+            double *jacobians[kMaxNumBlocks];
+            Eigen::Matrix<double, 4, 3> plus_jacobians[kMaxNumBlocks];
+            for (int k = 0; k < set.num_blocks; k++) {
+                const ParameterBlock &block = parameter_blocks_[set.blocks[k]];
+                parameters[k] = block.values;
+                jacobians[k] = block.is_constant ? nullptr : jacobian_storage[k];
+                if (block.is_quaternion)
+                    plus_jacobians[k] = QuaternionPlusJacobian(block.values);
+            }
+
+            for (const ceres::CostFunction *cost_function : *set.cost_functions) {
+                const int kNumResiduals = cost_function->num_residuals();
+                assert(kNumResiduals <= kMaxNumResiduals);
+                double r[kMaxNumResiduals];
+                if (!cost_function->Evaluate(parameters, r, JtJ != nullptr ? jacobians : nullptr))
+                    return std::numeric_limits<double>::infinity();
+                double sq_norm = 0.0;
+                for (int i = 0; i < kNumResiduals; i++)
+                    sq_norm += r[i] * r[i];
+                double rho[3] = {sq_norm, 1.0, 0.0};
+                if (set.loss_function != nullptr)
+                    set.loss_function->Evaluate(sq_norm, rho);
+                cost += 0.5 * rho[0];
+                if (JtJ == nullptr)
+                    continue;
+
+                for (int i = 0; i < kNumResiduals; i++) {
+                    Gradient J = Gradient::Zero();
+                    for (int k = 0; k < set.num_blocks; k++) {
+                        const ParameterBlock &block = parameter_blocks_[set.blocks[k]];
+                        if (block.is_constant)
+                            continue;
+                        const double *J_block = jacobian_storage[k] + i * block.size;
+                        if (block.is_quaternion) {
+                            J.template segment<3>(block.offset) =
+                                plus_jacobians[k].transpose() * Eigen::Map<const Eigen::Vector4d>(J_block);
+                        } else {
+                            for (int c = 0; c < block.size; c++)
+                                J(block.offset + c) = J_block[c];
+                        }
+                    }
+                    JtJ->template selfadjointView<Eigen::Lower>().rankUpdate(J, rho[1]);
+                    *Jtr += rho[1] * r[i] * J;
+                }
+            }
+        }
+        return cost;
+    }
+
+    InlineVector<ParameterBlock, kMaxNumBlocks> parameter_blocks_;
+    InlineVector<ResidualSet, 3> residual_sets_;
+    ceres::EvaluationCallback *evaluation_callback_ = nullptr;
+};
+
+} // namespace madpose
@@ -1,487 +1,520 @@
 #pragma once
 
 #include "cost_functions.h"
+#include "hybrid_ransac_profile.h"
+#include "lm_refiner.h"
 #include "optimizer_config.h"
 #include "pose.h"
 
-namespace madpose {
-
-class HybridPoseOptimizer {
-  protected:
-    const Eigen::Matrix3d &K0_, &K1_, K0_inv_, K1_inv_;
-    const Eigen::MatrixXd &x0_, &x1_;
-    const Eigen::VectorXd &d0_, &d1_;
-    Eigen::Vector4d qvec_;
-    Eigen::Vector3d tvec_;
-    double scale_, offset0_, offset1_;
-    Eigen::Vector2d min_depth_;
-    OptimizerConfig config_;
-
-    const std::vector<int> &indices_reproj_0_, &indices_reproj_1_;
-    const std::vector<int> &indices_sampson_;
+#include <initializer_list>
+#include <utility>
 
-    // ceres
-    std::unique_ptr<ceres::Problem> problem_;
-    ceres::Solver::Summary summary_;
+namespace madpose {
 
+// The residual blocks of one type of a problem that is solved repeatedly on
+// different subsets of the data points. The cost function of a data point is
+// created the first time the point is activated and reused afterwards, and
+// only the blocks that enter or leave the active subset are added to or
+// removed from the problem. If batched, the active data points instead share
+// a single BatchedCostFunction block, which is rebuilt on every activation.
+// The same cached cost functions are handed to a LevenbergMarquardtRefiner.
+class ResidualBlockPool {
   public:
-    HybridPoseOptimizer(const Eigen::MatrixXd &x0, const Eigen::MatrixXd &x1, const Eigen::VectorXd &depth0,
-                        const Eigen::VectorXd &depth1, const std::vector<int> &indices_reproj_0,
-                        const std::vector<int> &indices_reproj_1, const std::vector<int> &indices_sampson,
-                        const Eigen::Vector2d &min_depth, const PoseScaleOffset &pose, const Eigen::Matrix3d &K0,
-                        const Eigen::Matrix3d &K1, const OptimizerConfig &config = OptimizerConfig())
-        : K0_(K0), K1_(K1), K0_inv_(K0.inverse()), K1_inv_(K1.inverse()), x0_(x0), x1_(x1), d0_(depth0), d1_(depth1),
-          indices_reproj_0_(indices_reproj_0), indices_reproj_1_(indices_reproj_1), indices_sampson_(indices_sampson),
-          min_depth_(min_depth), config_(config) {
-        qvec_ = RotationMatrixToQuaternion<double>(pose.R());
-        tvec_ = pose.t();
-        offset0_ = pose.offset0;
-        offset1_ = pose.offset1;
-        scale_ = pose.scale;
-
-        if (config_.reproj_loss_function.get() == nullptr)
-            config_.reproj_loss_function.reset(new ceres::TrivialLoss());
-        if (config_.sampson_loss_function.get() == nullptr)
-            config_.sampson_loss_function.reset(new ceres::TrivialLoss());
+    void Init(const int num_data, const std::vector<double *> &parameter_blocks, ceres::LossFunction *loss_function,
+              const bool batched = false) {
+        cost_functions_.clear();
+        cost_functions_.resize(num_data);
+        blocks_.assign(num_data, nullptr);
+        is_requested_.assign(num_data, 0);
+        active_.clear();
+        parameter_blocks_ = parameter_blocks;
+        loss_function_ = loss_function;
+        batch_.reset(batched ? new BatchedCostFunction(loss_function) : nullptr);
+        batch_block_ = nullptr;
     }
 
-    void SetUp() {
-        problem_.reset(new ceres::Problem(config_.problem_options));
-
-        ceres::LossFunction *proj_loss_func = config_.reproj_loss_function.get();
-        ceres::LossFunction *sampson_loss_func = config_.sampson_loss_function.get();
-
-        if (config_.use_reprojection) {
-            for (auto &i : indices_reproj_0_) {
-                ceres::CostFunction *reproj_cost_0 =
-                    LiftProjectionFunctor0::Create(K0_inv_ * x0_.col(i), x1_.col(i), d0_(i), K1_);
-                problem_->AddResidualBlock(reproj_cost_0, proj_loss_func, &offset0_, qvec_.data(), tvec_.data());
-            }
-            for (auto &i : indices_reproj_1_) {
-                ceres::CostFunction *reproj_cost_1 =
-                    LiftProjectionFunctor1::Create(K1_inv_ * x1_.col(i), x0_.col(i), d1_(i), K0_);
-                problem_->AddResidualBlock(reproj_cost_1, proj_loss_func, &scale_, &offset1_, qvec_.data(),
-                                           tvec_.data());
-            }
+    // Makes the blocks of the data points in indices the active blocks of this
+    // type in problem. create(i) returns a new cost function for the i-th data
+    // point.
+    template <typename CreateFn>
+    void Activate(ceres::Problem *problem, const std::vector<int> &indices, CreateFn &&create) {
+        if (batch_ != nullptr) {
+            ActivateBatch(problem, indices, create);
+            return;
         }
-
-        if (config_.use_sampson) {
-            for (auto &i : indices_sampson_) {
-                Eigen::Vector3d x0 = K0_inv_ * x0_.col(i);
-                Eigen::Vector3d x1 = K1_inv_ * x1_.col(i);
-                ceres::CostFunction *sampson_cost =
-                    SampsonErrorFunctor::Create(x0, x1, K0_, K1_, config_.weight_sampson);
-                problem_->AddResidualBlock(sampson_cost, sampson_loss_func, qvec_.data(), tvec_.data());
+        for (const int i : indices)
+            is_requested_[i] = 1;
+        int num_kept = 0;
+        for (const int i : active_) {
+            if (is_requested_[i]) {
+                active_[num_kept++] = i;
+                continue;
             }
+            problem->RemoveResidualBlock(blocks_[i]);
+            blocks_[i] = nullptr;
         }
-
-        if (problem_->HasParameterBlock(&scale_)) {
-            problem_->SetParameterLowerBound(&scale_, 0, 1e-2); // scale >= 0
-        }
-        if (config_.min_depth_constraint && problem_->HasParameterBlock(&offset0_)) {
-            problem_->SetParameterLowerBound(&offset0_, 0,
-                                             -min_depth_(0) + 1e-2); // offset0 >= -min_depth_(0)
-        }
-        if (config_.min_depth_constraint && problem_->HasParameterBlock(&offset1_)) {
-            problem_->SetParameterLowerBound(&offset1_, 0,
-                                             -min_depth_(1) + 1e-2); // offset1 >= -min_depth_(1)
-        }
-        if (!config_.use_shift) {
-            if (problem_->HasParameterBlock(&offset0_))
-                problem_->SetParameterBlockConstant(&offset0_);
-            if (problem_->HasParameterBlock(&offset1_))
-                problem_->SetParameterBlockConstant(&offset1_);
+        active_.resize(num_kept);
+        for (const int i : indices) {
+            // Duplicated indices are added once.
+            if (!is_requested_[i])
+                continue;
+            is_requested_[i] = 0;
+            if (blocks_[i] != nullptr)
+                continue;
+            blocks_[i] = problem->AddResidualBlock(CostFunction(i, create), loss_function_, parameter_blocks_);
+            active_.push_back(i);
         }
+    }
 
-        if (problem_->HasParameterBlock(qvec_.data())) {
-            if (config_.constant_pose) {
-                problem_->SetParameterBlockConstant(qvec_.data());
-                problem_->SetParameterBlockConstant(tvec_.data());
-            } else {
-#ifdef CERES_PARAMETERIZATION_ENABLED
-                ceres::LocalParameterization *quaternion_parameterization = new ceres::QuaternionParameterization;
-                problem_->SetParameterization(qvec_.data(), quaternion_parameterization);
-#else
-                ceres::Manifold *quaternion_manifold = new ceres::QuaternionManifold;
-                problem_->SetManifold(qvec_.data(), quaternion_manifold);
-#endif
-            }
+    // Adds the cost functions of the data points in indices to refiner, whose
+    // residual blocks are cleared before each activation.
+    template <int kMaxNumParameters, typename CreateFn>
+    void Activate(LevenbergMarquardtRefiner<kMaxNumParameters> *refiner, const std::vector<int> &indices,
+                  CreateFn &&create) {
+        selected_.clear();
+        for (const int i : indices) {
+            if (is_requested_[i])
+                continue;
+            is_requested_[i] = 1;
+            selected_.push_back(CostFunction(i, create));
         }
+        for (const int i : indices)
+            is_requested_[i] = 0;
+        if (!selected_.empty())
+            refiner->AddResidualBlocks(selected_, parameter_blocks_, loss_function_);
     }
 
-    bool Solve() {
-        if (problem_->NumResiduals() == 0)
-            return false;
-        ceres::Solver::Options solver_options = config_.solver_options;
+  private:
+    template <typename CreateFn> ceres::CostFunction *CostFunction(const int i, CreateFn &&create) {
+        if (cost_functions_[i] == nullptr)
+            cost_functions_[i].reset(create(i));
+        return cost_functions_[i].get();
+    }
 
-        solver_options.linear_solver_type = ceres::DENSE_QR;
-        solver_options.num_threads = 1;
+    template <typename CreateFn>
+    void ActivateBatch(ceres::Problem *problem, const std::vector<int> &indices, CreateFn &&create) {
+        // The number of residuals of the block changes, so it is added again.
+        if (batch_block_ != nullptr)
+            problem->RemoveResidualBlock(batch_block_);
+        batch_block_ = nullptr;
+        batch_->Clear();
+        for (const int i : indices)
+            batch_->Add(CostFunction(i, create));
+        if (batch_->num_residuals() > 0)
+            batch_block_ = problem->AddResidualBlock(batch_.get(), nullptr, parameter_blocks_);
+    }
 
-        std::string solver_error;
-        CHECK(solver_options.IsValid(&solver_error)) << solver_error;
+    std::vector<std::unique_ptr<ceres::CostFunction>> cost_functions_;
+    std::vector<ceres::ResidualBlockId> blocks_;
+    std::vector<char> is_requested_;
+    std::vector<int> active_;
+    std::vector<double *> parameter_blocks_;
+    ceres::LossFunction *loss_function_ = nullptr;
+    std::unique_ptr<BatchedCostFunction> batch_;
+    ceres::ResidualBlockId batch_block_ = nullptr;
+    std::vector<const ceres::CostFunction *> selected_;
+};
 
-        ceres::Solve(solver_options, problem_.get(), &summary_);
-        return true;
+// Returns the options of a problem whose residual blocks are managed by
+// ResidualBlockPools, with the given evaluation callback.
+inline ceres::Problem::Options PooledProblemOptions(const ceres::Problem::Options &options,
+                                                    ceres::EvaluationCallback *evaluation_callback) {
+    ceres::Problem::Options pooled_options = options;
+    pooled_options.cost_function_ownership = ceres::DO_NOT_TAKE_OWNERSHIP;
+    pooled_options.enable_fast_removal = true;
+    pooled_options.evaluation_callback = evaluation_callback;
+    return pooled_options;
+}
+
+// Adds the quaternion qvec to problem, either as a constant block or with the
+// quaternion manifold.
+inline void AddQuaternionParameterBlock(ceres::Problem *problem, double *qvec, const bool constant) {
+    problem->AddParameterBlock(qvec, 4);
+    if (constant) {
+        problem->SetParameterBlockConstant(qvec);
+        return;
     }
+#ifdef CERES_PARAMETERIZATION_ENABLED
+    ceres::LocalParameterization *quaternion_parameterization = new ceres::QuaternionParameterization;
+    problem->SetParameterization(qvec, quaternion_parameterization);
+#else
+    ceres::Manifold *quaternion_manifold = new ceres::QuaternionManifold;
+    problem->SetManifold(qvec, quaternion_manifold);
+#endif
+}
+
+template <int kMaxNumParameters>
+inline void AddQuaternionParameterBlock(LevenbergMarquardtRefiner<kMaxNumParameters> *refiner, double *qvec,
+                                        const bool constant) {
+    refiner->AddParameterBlock(qvec, 4, true);
+    if (constant)
+        refiner->SetParameterBlockConstant(qvec);
+}
+
+// Camera models of HybridOptimizer. A camera model holds the intrinsics and
+// the focal length parameters of the two views, and creates the cost
+// functions of the data points.
+
+// Both views are calibrated, the data points are in pixels.
+class CalibratedCamera {
+  public:
+    typedef OptimizerConfig Config;
+    static constexpr int kNumFocals = 0;
 
-    PoseScaleOffset GetSolution() {
-        Eigen::Matrix3d R = QuaternionToRotationMatrix<double>(qvec_);
-        return PoseScaleOffset(R, tvec_, scale_, offset0_, offset1_);
-    }
-};
+    CalibratedCamera(const Eigen::Matrix3d &K0, const Eigen::Matrix3d &K1)
+        : K0_(K0), K1_(K1), K0_inv_(K0.inverse()), K1_inv_(K1.inverse()) {}
 
-class HybridPoseOptimizerScaleOnly {
-  protected:
-    const Eigen::Matrix3d &K0_, &K1_, K0_inv_, K1_inv_;
-    const Eigen::MatrixXd &x0_, &x1_;
-    const Eigen::VectorXd &d0_, &d1_;
-    Eigen::Vector4d qvec_;
-    Eigen::Vector3d tvec_;
-    double scale_, offset0_, offset1_;
-    OptimizerConfig config_;
+    template <typename ProblemT> void AddParameterBlocks(ProblemT *problem, const Config &config) {}
+    void AppendParameterBlocks(std::vector<double *> *parameter_blocks) {}
+    const double *FocalBlock(const int view) const { return nullptr; }
 
-    const std::vector<int> &indices_reproj_0_, &indices_reproj_1_;
-    const std::vector<int> &indices_sampson_;
+    template <class Model> void Reset(const Model &pose) {}
+    template <class Model> Model Solution(const Model &pose) const { return pose; }
 
-    // ceres
-    std::unique_ptr<ceres::Problem> problem_;
-    ceres::Solver::Summary summary_;
+    ceres::CostFunction *CreateReprojectionCost0(const Eigen::MatrixXd &x0, const Eigen::MatrixXd &x1,
+                                                 const Eigen::VectorXd &d0, const int i, const Config &config,
+                                                 const PoseEvaluationState *state) const {
+        return config.use_analytic_jacobians
+                   ? LiftProjectionCostFunction0::Create(K0_inv_ * x0.col(i), x1.col(i), d0(i), K1_, state)
+                   : LiftProjectionFunctor0::Create(K0_inv_ * x0.col(i), x1.col(i), d0(i), K1_);
+    }
 
-  public:
-    HybridPoseOptimizerScaleOnly(const Eigen::MatrixXd &x0, const Eigen::MatrixXd &x1, const Eigen::VectorXd &depth0,
-                                 const Eigen::VectorXd &depth1, const std::vector<int> &indices_reproj_0,
-                                 const std::vector<int> &indices_reproj_1, const std::vector<int> &indices_sampson,
-                                 const PoseAndScale &pose, const Eigen::Matrix3d &K0, const Eigen::Matrix3d &K1,
-                                 const OptimizerConfig &config = OptimizerConfig())
-        : K0_(K0), K1_(K1), K0_inv_(K0.inverse()), K1_inv_(K1.inverse()), x0_(x0), x1_(x1), d0_(depth0), d1_(depth1),
-          indices_reproj_0_(indices_reproj_0), indices_reproj_1_(indices_reproj_1), indices_sampson_(indices_sampson),
-          config_(config) {
-        qvec_ = RotationMatrixToQuaternion<double>(pose.R());
-        tvec_ = pose.t();
-        offset0_ = 0;
-        offset1_ = 0;
-        scale_ = pose.scale;
+    ceres::CostFunction *CreateReprojectionCost1(const Eigen::MatrixXd &x0, const Eigen::MatrixXd &x1,
+                                                 const Eigen::VectorXd &d1, const int i, const Config &config,
+                                                 const PoseEvaluationState *state) const {
+        return config.use_analytic_jacobians
+                   ? LiftProjectionCostFunction1::Create(K1_inv_ * x1.col(i), x0.col(i), d1(i), K0_, state)
+                   : LiftProjectionFunctor1::Create(K1_inv_ * x1.col(i), x0.col(i), d1(i), K0_);
+    }
 
-        if (config_.reproj_loss_function.get() == nullptr)
-            config_.reproj_loss_function.reset(new ceres::TrivialLoss());
-        if (config_.sampson_loss_function.get() == nullptr)
-            config_.sampson_loss_function.reset(new ceres::TrivialLoss());
+    ceres::CostFunction *CreateSampsonCost(const Eigen::MatrixXd &x0, const Eigen::MatrixXd &x1, const int i,
+                                           const Config &config, const PoseEvaluationState *state) const {
+        Eigen::Vector3d x0_calib = K0_inv_ * x0.col(i);
+        Eigen::Vector3d x1_calib = K1_inv_ * x1.col(i);
+        return config.use_analytic_jacobians
+                   ? SampsonErrorCostFunction::Create(x0_calib, x1_calib, K0_, K1_, config.weight_sampson, state)
+                   : SampsonErrorFunctor::Create(x0_calib, x1_calib, K0_, K1_, config.weight_sampson);
     }
 
-    void SetUp() {
-        problem_.reset(new ceres::Problem(config_.problem_options));
+  private:
+    Eigen::Matrix3d K0_, K1_, K0_inv_, K1_inv_;
+};
 
-        ceres::LossFunction *proj_loss_func = config_.reproj_loss_function.get();
-        ceres::LossFunction *sampson_loss_func = config_.sampson_loss_function.get();
+// Both views share an unknown focal length, the data points are normalized
+// by the principal points.
+class SharedFocalCamera {
+  public:
+    typedef SharedFocalOptimizerConfig Config;
+    static constexpr int kNumFocals = 1;
 
-        if (config_.use_reprojection) {
-            for (auto &i : indices_reproj_0_) {
-                ceres::CostFunction *reproj_cost_0 =
-                    LiftProjectionFunctor0::Create(K0_inv_ * x0_.col(i), x1_.col(i), d0_(i), K1_);
-                problem_->AddResidualBlock(reproj_cost_0, proj_loss_func, &offset0_, qvec_.data(), tvec_.data());
-            }
-            for (auto &i : indices_reproj_1_) {
-                ceres::CostFunction *reproj_cost_1 =
-                    LiftProjectionFunctor1::Create(K1_inv_ * x1_.col(i), x0_.col(i), d1_(i), K0_);
-                problem_->AddResidualBlock(reproj_cost_1, proj_loss_func, &scale_, &offset1_, qvec_.data(),
-                                           tvec_.data());
-            }
-        }
+    template <typename ProblemT> void AddParameterBlocks(ProblemT *problem, const Config &config) {
+        problem->AddParameterBlock(&focal, 1);
+    }
+    void AppendParameterBlocks(std::vector<double *> *parameter_blocks) { parameter_blocks->push_back(&focal); }
+    const double *FocalBlock(const int view) const { return &focal; }
 
-        if (config_.use_sampson) {
-            for (auto &i : indices_sampson_) {
-                Eigen::Vector3d x0 = K0_inv_ * x0_.col(i);
-                Eigen::Vector3d x1 = K1_inv_ * x1_.col(i);
-                ceres::CostFunction *sampson_cost =
-                    SampsonErrorFunctor::Create(x0, x1, K0_, K1_, config_.weight_sampson);
-                problem_->AddResidualBlock(sampson_cost, sampson_loss_func, qvec_.data(), tvec_.data());
-            }
-        }
+    void Reset(const PoseScaleOffsetSharedFocal &pose) { focal = pose.focal; }
+    PoseScaleOffsetSharedFocal Solution(const PoseScaleOffset &pose) const {
+        return PoseScaleOffsetSharedFocal(pose.pose, pose.scale, pose.offset0, pose.offset1, focal);
+    }
 
-        if (problem_->HasParameterBlock(&scale_)) {
-            problem_->SetParameterLowerBound(&scale_, 0, 1e-2); // scale >= 0
-        }
+    ceres::CostFunction *CreateReprojectionCost0(const Eigen::MatrixXd &x0, const Eigen::MatrixXd &x1,
+                                                 const Eigen::VectorXd &d0, const int i, const Config &config,
+                                                 const PoseEvaluationState *state) const {
+        return config.use_analytic_jacobians
+                   ? LiftProjectionSharedFocalCostFunction0::Create(x0.col(i), x1.col(i), d0(i), state)
+                   : LiftProjectionSharedFocalFunctor0::Create(x0.col(i), x1.col(i), d0(i));
+    }
 
-        if (problem_->HasParameterBlock(&offset0_))
-            problem_->SetParameterBlockConstant(&offset0_);
-        if (problem_->HasParameterBlock(&offset1_))
-            problem_->SetParameterBlockConstant(&offset1_);
+    ceres::CostFunction *CreateReprojectionCost1(const Eigen::MatrixXd &x0, const Eigen::MatrixXd &x1,
+                                                 const Eigen::VectorXd &d1, const int i, const Config &config,
+                                                 const PoseEvaluationState *state) const {
+        return config.use_analytic_jacobians
+                   ? LiftProjectionSharedFocalCostFunction1::Create(x1.col(i), x0.col(i), d1(i), state)
+                   : LiftProjectionSharedFocalFunctor1::Create(x1.col(i), x0.col(i), d1(i));
+    }
 
-        if (problem_->HasParameterBlock(qvec_.data())) {
-            if (config_.constant_pose) {
-                problem_->SetParameterBlockConstant(qvec_.data());
-                problem_->SetParameterBlockConstant(tvec_.data());
-            } else {
-#ifdef CERES_PARAMETERIZATION_ENABLED
-                ceres::LocalParameterization *quaternion_parameterization = new ceres::QuaternionParameterization;
-                problem_->SetParameterization(qvec_.data(), quaternion_parameterization);
-#else
-                ceres::Manifold *quaternion_manifold = new ceres::QuaternionManifold;
-                problem_->SetManifold(qvec_.data(), quaternion_manifold);
-#endif
-            }
-        }
+    ceres::CostFunction *CreateSampsonCost(const Eigen::MatrixXd &x0, const Eigen::MatrixXd &x1, const int i,
+                                           const Config &config, const PoseEvaluationState *state) const {
+        return config.use_analytic_jacobians
+                   ? SampsonErrorSharedFocalCostFunction::Create(x0.col(i), x1.col(i), config.weight_sampson, state)
+                   : SampsonErrorSharedFocalFunctor::Create(x0.col(i), x1.col(i), config.weight_sampson);
     }
 
-    bool Solve() {
-        if (problem_->NumResiduals() == 0)
-            return false;
-        ceres::Solver::Options solver_options = config_.solver_options;
+    double focal;
+};
 
-        solver_options.linear_solver_type = ceres::DENSE_QR;
-        solver_options.num_threads = 1;
+// Each view has its own unknown focal length, the data points are normalized
+// by the principal points.
+class TwoFocalCamera {
+  public:
+    typedef TwoFocalOptimizerConfig Config;
+    static constexpr int kNumFocals = 2;
+
+    template <typename ProblemT> void AddParameterBlocks(ProblemT *problem, const Config &config) {
+        problem->AddParameterBlock(&focal0, 1);
+        problem->AddParameterBlock(&focal1, 1);
+        problem->SetParameterLowerBound(&focal0, 0, 1e-6); // focal0 >= 0
+        problem->SetParameterLowerBound(&focal1, 0, 1e-6); // focal1 >= 0
+    }
+    void AppendParameterBlocks(std::vector<double *> *parameter_blocks) {
+        parameter_blocks->push_back(&focal0);
+        parameter_blocks->push_back(&focal1);
+    }
+    const double *FocalBlock(const int view) const { return view == 0 ? &focal0 : &focal1; }
 
-        std::string solver_error;
-        CHECK(solver_options.IsValid(&solver_error)) << solver_error;
+    void Reset(const PoseScaleOffsetTwoFocal &pose) {
+        focal0 = pose.focal0;
+        focal1 = pose.focal1;
+    }
+    PoseScaleOffsetTwoFocal Solution(const PoseScaleOffset &pose) const {
+        return PoseScaleOffsetTwoFocal(pose.pose, pose.scale, pose.offset0, pose.offset1, focal0, focal1);
+    }
 
-        ceres::Solve(solver_options, problem_.get(), &summary_);
-        return true;
+    ceres::CostFunction *CreateReprojectionCost0(const Eigen::MatrixXd &x0, const Eigen::MatrixXd &x1,
+                                                 const Eigen::VectorXd &d0, const int i, const Config &config,
+                                                 const PoseEvaluationState *state) const {
+        return config.use_analytic_jacobians
+                   ? LiftProjectionTwoFocalCostFunction0::Create(x0.col(i), x1.col(i), d0(i), state)
+                   : LiftProjectionTwoFocalFunctor0::Create(x0.col(i), x1.col(i), d0(i));
     }
 
-    PoseAndScale GetSolution() {
-        Eigen::Matrix3d R = QuaternionToRotationMatrix<double>(qvec_);
-        return PoseAndScale(R, tvec_, scale_);
+    ceres::CostFunction *CreateReprojectionCost1(const Eigen::MatrixXd &x0, const Eigen::MatrixXd &x1,
+                                                 const Eigen::VectorXd &d1, const int i, const Config &config,
+                                                 const PoseEvaluationState *state) const {
+        return config.use_analytic_jacobians
+                   ? LiftProjectionTwoFocalCostFunction1::Create(x1.col(i), x0.col(i), d1(i), state)
+                   : LiftProjectionTwoFocalFunctor1::Create(x1.col(i), x0.col(i), d1(i));
     }
-};
 
-class HybridSharedFocalPoseOptimizer {
-  protected:
-    const Eigen::MatrixXd &x0_, &x1_;
-    const Eigen::VectorXd &d0_, &d1_;
-    Eigen::Vector4d qvec_;
-    Eigen::Vector3d tvec_;
-    double focal_;
-    double scale_, offset0_, offset1_;
-    Eigen::Vector2d min_depth_;
-    SharedFocalOptimizerConfig config_;
+    ceres::CostFunction *CreateSampsonCost(const Eigen::MatrixXd &x0, const Eigen::MatrixXd &x1, const int i,
+                                           const Config &config, const PoseEvaluationState *state) const {
+        return config.use_analytic_jacobians
+                   ? SampsonErrorTwoFocalCostFunction::Create(x0.col(i), x1.col(i), config.weight_sampson, state)
+                   : SampsonErrorTwoFocalFunctor::Create(x0.col(i), x1.col(i), config.weight_sampson);
+    }
 
-    const std::vector<int> &indices_reproj_0_, &indices_reproj_1_;
-    const std::vector<int> &indices_sampson_;
+    double focal0, focal1;
+};
 
-    // ceres
-    std::unique_ptr<ceres::Problem> problem_;
-    ceres::Solver::Summary summary_;
+// Depth models of HybridOptimizer, which hold the scale and the offsets that
+// relate the depth maps of the two views.
 
+// Only the scale is estimated, the offsets are fixed at 0.
+class ScaleOnlyDepth {
   public:
-    HybridSharedFocalPoseOptimizer(const Eigen::MatrixXd &x0, const Eigen::MatrixXd &x1, const Eigen::VectorXd &depth0,
-                                   const Eigen::VectorXd &depth1, const std::vector<int> &indices_reproj_0,
-                                   const std::vector<int> &indices_reproj_1, const std::vector<int> &indices_sampson,
-                                   const Eigen::Vector2d &min_depth, const PoseScaleOffsetSharedFocal &pose,
-                                   const SharedFocalOptimizerConfig &config = SharedFocalOptimizerConfig())
-        : x0_(x0), x1_(x1), d0_(depth0), d1_(depth1), indices_reproj_0_(indices_reproj_0),
-          indices_reproj_1_(indices_reproj_1), indices_sampson_(indices_sampson), min_depth_(min_depth),
-          config_(config) {
-        qvec_ = RotationMatrixToQuaternion<double>(pose.R());
-        tvec_ = pose.t();
-        offset0_ = pose.offset0;
-        offset1_ = pose.offset1;
-        scale_ = pose.scale;
-        focal_ = pose.focal;
-
-        if (config_.reproj_loss_function.get() == nullptr)
-            config_.reproj_loss_function.reset(new ceres::TrivialLoss());
-        if (config_.sampson_loss_function.get() == nullptr)
-            config_.sampson_loss_function.reset(new ceres::TrivialLoss());
+    template <typename ProblemT> void AddParameterBlocks(ProblemT *problem, const OptimizerConfig &config) {
+        problem->AddParameterBlock(&scale, 1);
+        problem->AddParameterBlock(&offset0, 1);
+        problem->AddParameterBlock(&offset1, 1);
+        problem->SetParameterLowerBound(&scale, 0, 1e-2); // scale >= 0
+        problem->SetParameterBlockConstant(&offset0);
+        problem->SetParameterBlockConstant(&offset1);
     }
 
-    void SetUp() {
-        problem_.reset(new ceres::Problem(config_.problem_options));
-
-        ceres::LossFunction *proj_loss_func = config_.reproj_loss_function.get();
-        ceres::LossFunction *sampson_loss_func = config_.sampson_loss_function.get();
-
-        if (config_.use_reprojection) {
-            for (auto &i : indices_reproj_0_) {
-                ceres::CostFunction *reproj_cost_0 =
-                    LiftProjectionSharedFocalFunctor0::Create(x0_.col(i), x1_.col(i), d0_(i));
-                problem_->AddResidualBlock(reproj_cost_0, proj_loss_func, &offset0_, qvec_.data(), tvec_.data(),
-                                           &focal_);
-            }
-            for (auto &i : indices_reproj_1_) {
-                ceres::CostFunction *reproj_cost_1 =
-                    LiftProjectionSharedFocalFunctor1::Create(x1_.col(i), x0_.col(i), d1_(i));
-                problem_->AddResidualBlock(reproj_cost_1, proj_loss_func, &scale_, &offset1_, qvec_.data(),
-                                           tvec_.data(), &focal_);
-            }
-        }
+    void Reset(const PoseAndScale &pose) { scale = pose.scale; }
+    PoseAndScale Solution(const Eigen::Matrix3d &R, const Eigen::Vector3d &t) const {
+        return PoseAndScale(R, t, scale);
+    }
 
-        for (auto &i : indices_sampson_) {
-            if (config_.use_sampson) {
-                ceres::CostFunction *sampson_cost =
-                    SampsonErrorSharedFocalFunctor::Create(x0_.col(i), x1_.col(i), config_.weight_sampson);
-                problem_->AddResidualBlock(sampson_cost, sampson_loss_func, qvec_.data(), tvec_.data(), &focal_);
-            }
-        }
+    double scale, offset0 = 0.0, offset1 = 0.0;
+};
 
-        if (problem_->HasParameterBlock(&scale_)) {
-            problem_->SetParameterLowerBound(&scale_, 0, 1e-2); // scale >= 0
-        }
-        if (config_.min_depth_constraint && problem_->HasParameterBlock(&offset0_)) {
-            problem_->SetParameterLowerBound(&offset0_, 0,
-                                             -min_depth_(0) + 1e-2); // offset0 >= -min_depth_(0)
-        }
-        if (config_.min_depth_constraint && problem_->HasParameterBlock(&offset1_)) {
-            problem_->SetParameterLowerBound(&offset1_, 0,
-                                             -min_depth_(1) + 1e-2); // offset1 >= -min_depth_(1)
-        }
-        if (!config_.use_shift) {
-            if (problem_->HasParameterBlock(&offset0_))
-                problem_->SetParameterBlockConstant(&offset0_);
-            if (problem_->HasParameterBlock(&offset1_))
-                problem_->SetParameterBlockConstant(&offset1_);
+// The scale and the offsets are estimated, the offsets only if
+// OptimizerConfig::use_shift is set.
+class ScaleShiftDepth {
+  public:
+    explicit ScaleShiftDepth(const Eigen::Vector2d &min_depth) : min_depth_(min_depth) {}
+
+    template <typename ProblemT> void AddParameterBlocks(ProblemT *problem, const OptimizerConfig &config) {
+        problem->AddParameterBlock(&scale, 1);
+        problem->AddParameterBlock(&offset0, 1);
+        problem->AddParameterBlock(&offset1, 1);
+        problem->SetParameterLowerBound(&scale, 0, 1e-2); // scale >= 0
+        if (config.min_depth_constraint) {
+            problem->SetParameterLowerBound(&offset0, 0, -min_depth_(0) + 1e-2); // offset0 >= -min_depth_(0)
+            problem->SetParameterLowerBound(&offset1, 0, -min_depth_(1) + 1e-2); // offset1 >= -min_depth_(1)
         }
-
-        if (problem_->HasParameterBlock(qvec_.data())) {
-            if (config_.constant_pose) {
-                problem_->SetParameterBlockConstant(qvec_.data());
-                problem_->SetParameterBlockConstant(tvec_.data());
-            } else {
-#ifdef CERES_PARAMETERIZATION_ENABLED
-                ceres::LocalParameterization *quaternion_parameterization = new ceres::QuaternionParameterization;
-                problem_->SetParameterization(qvec_.data(), quaternion_parameterization);
-#else
-                ceres::Manifold *quaternion_manifold = new ceres::QuaternionManifold;
-                problem_->SetManifold(qvec_.data(), quaternion_manifold);
-#endif
-            }
+        if (!config.use_shift) {
+            problem->SetParameterBlockConstant(&offset0);
+            problem->SetParameterBlockConstant(&offset1);
         }
     }
 
-    bool Solve() {
-        if (problem_->NumResiduals() == 0)
-            return false;
-        ceres::Solver::Options solver_options = config_.solver_options;
-
-        solver_options.linear_solver_type = ceres::DENSE_QR;
-        solver_options.num_threads = 1;
-
-        std::string solver_error;
-        CHECK(solver_options.IsValid(&solver_error)) << solver_error;
-
-        ceres::Solve(solver_options, problem_.get(), &summary_);
-        return true;
+    void Reset(const PoseScaleOffset &pose) {
+        scale = pose.scale;
+        offset0 = pose.offset0;
+        offset1 = pose.offset1;
     }
-
-    PoseScaleOffsetSharedFocal GetSolution() {
-        Eigen::Matrix3d R = QuaternionToRotationMatrix<double>(qvec_);
-        return PoseScaleOffsetSharedFocal(R, tvec_, scale_, offset0_, offset1_, focal_);
+    PoseScaleOffset Solution(const Eigen::Matrix3d &R, const Eigen::Vector3d &t) const {
+        return PoseScaleOffset(R, t, scale, offset0, offset1);
     }
+
+    double scale, offset0, offset1;
+
+  private:
+    Eigen::Vector2d min_depth_;
 };
 
-class HybridTwoFocalPoseOptimizer {
+// Optimizes the pose, the depth parameters of DepthModel and the focal
+// lengths of CameraModel over the reprojection and Sampson residuals of the
+// data points. The parameter blocks, their bounds and the cost functions are
+// selected by the two models at compile time.
+//
+// The optimizer is either constructed for a single solve on the given data
+// points, or constructed once as a workspace and solved repeatedly, calling
+// Reset() before each SetUp(). The problem, its parameter blocks and the cost
+// functions are kept across calls to SetUp().
+template <class CameraModel, class DepthModel> class HybridOptimizer {
+  public:
+    typedef typename CameraModel::Config Config;
+    // The solution type, e.g. PoseScaleOffsetSharedFocal.
+    typedef decltype(std::declval<const CameraModel &>().Solution(std::declval<const DepthModel &>().Solution(
+        std::declval<Eigen::Matrix3d>(), std::declval<Eigen::Vector3d>()))) Model;
+
   protected:
     const Eigen::MatrixXd &x0_, &x1_;
     const Eigen::VectorXd &d0_, &d1_;
+    CameraModel camera_;
+    DepthModel depth_;
     Eigen::Vector4d qvec_;
     Eigen::Vector3d tvec_;
-    double focal0_, focal1_;
-    double scale_, offset0_, offset1_;
-    Eigen::Vector2d min_depth_;
-    TwoFocalOptimizerConfig config_;
+    Config config_;
 
-    const std::vector<int> &indices_reproj_0_, &indices_reproj_1_;
-    const std::vector<int> &indices_sampson_;
+    const std::vector<int> *indices_reproj_0_, *indices_reproj_1_;
+    const std::vector<int> *indices_sampson_;
 
     // ceres
     std::unique_ptr<ceres::Problem> problem_;
+    typedef LevenbergMarquardtRefiner<9 + CameraModel::kNumFocals> Refiner;
+    std::unique_ptr<Refiner> refiner_;
+    ResidualBlockPool reproj_0_blocks_, reproj_1_blocks_, sampson_blocks_;
     ceres::Solver::Summary summary_;
-
-  public:
-    HybridTwoFocalPoseOptimizer(const Eigen::MatrixXd &x0, const Eigen::MatrixXd &x1, const Eigen::VectorXd &depth0,
-                                const Eigen::VectorXd &depth1, const std::vector<int> &indices_reproj_0,
-                                const std::vector<int> &indices_reproj_1, const std::vector<int> &indices_sampson,
-                                const Eigen::Vector2d &min_depth, const PoseScaleOffsetTwoFocal &pose,
-                                const TwoFocalOptimizerConfig &config = TwoFocalOptimizerConfig())
-        : x0_(x0), x1_(x1), d0_(depth0), d1_(depth1), indices_reproj_0_(indices_reproj_0),
-          indices_reproj_1_(indices_reproj_1), indices_sampson_(indices_sampson), min_depth_(min_depth),
-          config_(config) {
-        qvec_ = RotationMatrixToQuaternion<double>(pose.R());
-        tvec_ = pose.t();
-        offset0_ = pose.offset0;
-        offset1_ = pose.offset1;
-        scale_ = pose.scale;
-        focal0_ = pose.focal0;
-        focal1_ = pose.focal1;
-
-        if (config_.reproj_loss_function.get() == nullptr)
-            config_.reproj_loss_function.reset(new ceres::TrivialLoss());
-        if (config_.sampson_loss_function.get() == nullptr)
-            config_.sampson_loss_function.reset(new ceres::TrivialLoss());
+    // Keeps the state read by the analytic cost functions.
+    PoseEvaluationCallback evaluation_callback_;
+
+    template <typename ProblemT> void AddParameterBlocks(ProblemT *problem) {
+        depth_.AddParameterBlocks(problem, config_);
+        camera_.AddParameterBlocks(problem, config_);
+        problem->AddParameterBlock(tvec_.data(), 3);
+        AddQuaternionParameterBlock(problem, qvec_.data(), config_.constant_pose);
+        if (config_.constant_pose)
+            problem->SetParameterBlockConstant(tvec_.data());
     }
 
-    void SetUp() {
-        problem_.reset(new ceres::Problem(config_.problem_options));
+    // Returns the given pose and depth parameter blocks followed by the focal
+    // length blocks of the camera model.
+    std::vector<double *> ParameterBlocks(std::initializer_list<double *> blocks) {
+        std::vector<double *> parameter_blocks(blocks);
+        camera_.AppendParameterBlocks(&parameter_blocks);
+        return parameter_blocks;
+    }
 
+    void InitPools() {
         ceres::LossFunction *proj_loss_func = config_.reproj_loss_function.get();
         ceres::LossFunction *sampson_loss_func = config_.sampson_loss_function.get();
+        reproj_0_blocks_.Init(x0_.cols(), ParameterBlocks({&depth_.offset0, qvec_.data(), tvec_.data()}),
+                              proj_loss_func, config_.batch_residuals);
+        reproj_1_blocks_.Init(x0_.cols(), ParameterBlocks({&depth_.scale, &depth_.offset1, qvec_.data(), tvec_.data()}),
+                              proj_loss_func, config_.batch_residuals);
+        sampson_blocks_.Init(x0_.cols(), ParameterBlocks({qvec_.data(), tvec_.data()}), sampson_loss_func,
+                             config_.batch_residuals);
+    }
 
+    template <typename ProblemT> void ActivateBlocks(ProblemT *problem) {
+        const PoseEvaluationState *state = evaluation_callback_.state();
         if (config_.use_reprojection) {
-            for (auto &i : indices_reproj_0_) {
-                ceres::CostFunction *reproj_cost_0 =
-                    LiftProjectionTwoFocalFunctor0::Create(x0_.col(i), x1_.col(i), d0_(i));
-                problem_->AddResidualBlock(reproj_cost_0, proj_loss_func, &offset0_, qvec_.data(), tvec_.data(),
-                                           &focal0_, &focal1_);
-            }
-            for (auto &i : indices_reproj_1_) {
-                ceres::CostFunction *reproj_cost_1 =
-                    LiftProjectionTwoFocalFunctor1::Create(x1_.col(i), x0_.col(i), d1_(i));
-                problem_->AddResidualBlock(reproj_cost_1, proj_loss_func, &scale_, &offset1_, qvec_.data(),
-                                           tvec_.data(), &focal0_, &focal1_);
-            }
+            reproj_0_blocks_.Activate(problem, *indices_reproj_0_, [&](const int i) {
+                return camera_.CreateReprojectionCost0(x0_, x1_, d0_, i, config_, state);
+            });
+            reproj_1_blocks_.Activate(problem, *indices_reproj_1_, [&](const int i) {
+                return camera_.CreateReprojectionCost1(x0_, x1_, d1_, i, config_, state);
+            });
         }
 
-        for (auto &i : indices_sampson_) {
-            if (config_.use_sampson) {
-                ceres::CostFunction *sampson_cost =
-                    SampsonErrorTwoFocalFunctor::Create(x0_.col(i), x1_.col(i), config_.weight_sampson);
-                problem_->AddResidualBlock(sampson_cost, sampson_loss_func, qvec_.data(), tvec_.data(), &focal0_,
-                                           &focal1_);
-            }
+        if (config_.use_sampson) {
+            sampson_blocks_.Activate(problem, *indices_sampson_, [&](const int i) {
+                return camera_.CreateSampsonCost(x0_, x1_, i, config_, state);
+            });
         }
+    }
 
-        if (problem_->HasParameterBlock(&scale_)) {
-            problem_->SetParameterLowerBound(&scale_, 0, 1e-2); // scale >= 0
-        }
-        if (config_.min_depth_constraint && problem_->HasParameterBlock(&offset0_)) {
-            problem_->SetParameterLowerBound(&offset0_, 0,
-                                             -min_depth_(0) + 1e-2); // offset0 >= -min_depth_(0)
-        }
-        if (config_.min_depth_constraint && problem_->HasParameterBlock(&offset1_)) {
-            problem_->SetParameterLowerBound(&offset1_, 0,
-                                             -min_depth_(1) + 1e-2); // offset1 >= -min_depth_(1)
-        }
-        if (!config_.use_shift) {
-            if (problem_->HasParameterBlock(&offset0_))
-                problem_->SetParameterBlockConstant(&offset0_);
-            if (problem_->HasParameterBlock(&offset1_))
-                problem_->SetParameterBlockConstant(&offset1_);
-        }
+  public:
+    HybridOptimizer(const Eigen::MatrixXd &x0, const Eigen::MatrixXd &x1, const Eigen::VectorXd &depth0,
+                    const Eigen::VectorXd &depth1, const std::vector<int> &indices_reproj_0,
+                    const std::vector<int> &indices_reproj_1, const std::vector<int> &indices_sampson,
+                    const Model &pose, const CameraModel &camera, const DepthModel &depth,
+                    const Config &config = Config())
+        : HybridOptimizer(x0, x1, depth0, depth1, camera, depth, config) {
+        Reset(indices_reproj_0, indices_reproj_1, indices_sampson, pose);
+    }
 
-        if (problem_->HasParameterBlock(&focal0_)) {
-            problem_->SetParameterLowerBound(&focal0_, 0, 1e-6); // focal0 >= 0
-            problem_->SetParameterLowerBound(&focal1_, 0, 1e-6); // focal1 >= 0
-        }
+    // Constructs a workspace for repeated solves.
+    HybridOptimizer(const Eigen::MatrixXd &x0, const Eigen::MatrixXd &x1, const Eigen::VectorXd &depth0,
+                    const Eigen::VectorXd &depth1, const CameraModel &camera, const DepthModel &depth,
+                    const Config &config = Config())
+        : x0_(x0), x1_(x1), d0_(depth0), d1_(depth1), camera_(camera), depth_(depth), config_(config),
+          indices_reproj_0_(nullptr), indices_reproj_1_(nullptr), indices_sampson_(nullptr),
+          evaluation_callback_(qvec_.data(), tvec_.data(), camera_.FocalBlock(0), camera_.FocalBlock(1)) {
+        if (config_.reproj_loss_function.get() == nullptr)
+            config_.reproj_loss_function.reset(new ceres::TrivialLoss());
+        if (config_.sampson_loss_function.get() == nullptr)
+            config_.sampson_loss_function.reset(new ceres::TrivialLoss());
+        InitPools();
+    }
 
-        if (problem_->HasParameterBlock(qvec_.data())) {
-            if (config_.constant_pose) {
-                problem_->SetParameterBlockConstant(qvec_.data());
-                problem_->SetParameterBlockConstant(tvec_.data());
-            } else {
-#ifdef CERES_PARAMETERIZATION_ENABLED
-                ceres::LocalParameterization *quaternion_parameterization = new ceres::QuaternionParameterization;
-                problem_->SetParameterization(qvec_.data(), quaternion_parameterization);
-#else
-                ceres::Manifold *quaternion_manifold = new ceres::QuaternionManifold;
-                problem_->SetManifold(qvec_.data(), quaternion_manifold);
-#endif
+    // Sets the data points of the next SetUp(), which must outlive the call to
+    // Solve(), and the initial values of the parameters.
+    void Reset(const std::vector<int> &indices_reproj_0, const std::vector<int> &indices_reproj_1,
+               const std::vector<int> &indices_sampson, const Model &pose) {
+        indices_reproj_0_ = &indices_reproj_0;
+        indices_reproj_1_ = &indices_reproj_1;
+        indices_sampson_ = &indices_sampson;
+        qvec_ = RotationMatrixToQuaternion<double>(pose.R());
+        tvec_ = pose.t();
+        depth_.Reset(pose);
+        camera_.Reset(pose);
+    }
+
+    ceres::Solver::Options *mutable_solver_options() { return &config_.solver_options; }
+
+    // Selects the solver of the following SetUp() and Solve() calls, see
+    // OptimizerConfig::use_lm_refiner.
+    void set_use_lm_refiner(const bool use_lm_refiner) { config_.use_lm_refiner = use_lm_refiner; }
+
+    void SetUp() {
+        ceres::EvaluationCallback *callback = config_.use_analytic_jacobians ? &evaluation_callback_ : nullptr;
+        if (config_.use_lm_refiner) {
+            if (refiner_ == nullptr) {
+                refiner_.reset(new Refiner);
+                refiner_->SetEvaluationCallback(callback);
+                AddParameterBlocks(refiner_.get());
             }
+            refiner_->ClearResidualBlocks();
+            ActivateBlocks(refiner_.get());
+            return;
         }
+        if (problem_ == nullptr) {
+            problem_.reset(new ceres::Problem(PooledProblemOptions(config_.problem_options, callback)));
+            AddParameterBlocks(problem_.get());
+        }
+        ActivateBlocks(problem_.get());
     }
 
+    // Returns false if there is nothing to solve or the active time limit
+    // (see SolveTimeLimit) has run out.
     bool Solve() {
+        ceres::Solver::Options solver_options = config_.solver_options;
+        if (!ApplySolveTimeLimit(&solver_options.max_solver_time_in_seconds))
+            return false;
+        if (config_.use_lm_refiner) {
+            if (refiner_->NumResidualBlocks() == 0)
+                return false;
+            RecordRefinerSolve(refiner_->Solve(solver_options));
+            return true;
+        }
         if (problem_->NumResiduals() == 0)
             return false;
-        ceres::Solver::Options solver_options = config_.solver_options;
 
         solver_options.linear_solver_type = ceres::DENSE_QR;
         solver_options.num_threads = 1;
@@ -490,13 +523,19 @@ class HybridTwoFocalPoseOptimizer {
         CHECK(solver_options.IsValid(&solver_error)) << solver_error;
 
         ceres::Solve(solver_options, problem_.get(), &summary_);
+        RecordCeresSolve(summary_.iterations.size());
         return true;
     }
 
-    PoseScaleOffsetTwoFocal GetSolution() {
+    Model GetSolution() {
         Eigen::Matrix3d R = QuaternionToRotationMatrix<double>(qvec_);
-        return PoseScaleOffsetTwoFocal(R, tvec_, scale_, offset0_, offset1_, focal0_, focal1_);
+        return camera_.Solution(depth_.Solution(R, tvec_));
     }
 };
 
+typedef HybridOptimizer<CalibratedCamera, ScaleShiftDepth> HybridPoseOptimizer;
+typedef HybridOptimizer<CalibratedCamera, ScaleOnlyDepth> HybridPoseOptimizerScaleOnly;
+typedef HybridOptimizer<SharedFocalCamera, ScaleShiftDepth> HybridSharedFocalPoseOptimizer;
+typedef HybridOptimizer<TwoFocalCamera, ScaleShiftDepth> HybridTwoFocalPoseOptimizer;
+
 } // namespace madpose
@@ -23,6 +23,9 @@ class OptimizerConfig {
         ASSIGN_PYDICT_ITEM(dict, constant_pose, bool);
         ASSIGN_PYDICT_ITEM(dict, constant_scale, bool);
         ASSIGN_PYDICT_ITEM(dict, constant_offset, bool);
+        ASSIGN_PYDICT_ITEM(dict, use_analytic_jacobians, bool);
+        ASSIGN_PYDICT_ITEM(dict, batch_residuals, bool);
+        ASSIGN_PYDICT_ITEM(dict, use_lm_refiner, bool);
         if (dict.contains("solver_options"))
             AssignSolverOptionsFromDict(solver_options, dict["solver_options"]);
     }
@@ -38,6 +41,23 @@ class OptimizerConfig {
 
     bool squared_cost = false;
 
+    // Whether the cost functions compute their Jacobians analytically instead
+    // of by automatic differentiation. The analytic cost functions read the
+    // rotation and essential matrix computed once per evaluation by a
+    // PoseEvaluationCallback. tests/cost_functions_test.cpp checks them
+    // against the autodiff functors.
+    bool use_analytic_jacobians = true;
+
+    // Whether the residuals of each type are stacked into a single residual
+    // block instead of one block per data point. The loss functions are then
+    // applied inside the blocks.
+    bool batch_residuals = false;
+
+    // Whether Solve() uses the built-in Levenberg-Marquardt refiner of
+    // lm_refiner.h instead of Ceres. Of solver_options, only the iteration
+    // and time limits, the tolerances and the trust region radii apply to it.
+    bool use_lm_refiner = false;
+
     double weight_sampson = 1.0;
     std::shared_ptr<ceres::LossFunction> reproj_loss_function;
     std::shared_ptr<ceres::LossFunction> sampson_loss_function;
@@ -0,0 +1,242 @@
+#pragma once
+
+#include <Eigen/Dense>
+
+#include <algorithm>
+#include <cmath>
+
+namespace madpose {
+
+// Coefficients c[0..N] of the characteristic polynomial
+// det(x I - A) = c[0] + c[1] x + ... + c[N] x^N of A, with c[N] = 1. Reduces A
+// to upper Hessenberg form and expands the determinant with La Budde's
+// recurrence over its leading principal blocks.
+template <int N> Eigen::Matrix<double, N + 1, 1> CharacteristicPolynomial(const Eigen::Matrix<double, N, N> &A) {
+    const Eigen::Matrix<double, N, N> H = Eigen::HessenbergDecomposition<Eigen::Matrix<double, N, N>>(A).matrixH();
+
+    // p.col(i) holds the characteristic polynomial of the leading i x i block
+    // of H.
+    Eigen::Matrix<double, N + 1, N + 1> p = Eigen::Matrix<double, N + 1, N + 1>::Zero();
+    p(0, 0) = 1.0;
+    for (int i = 1; i <= N; ++i) {
+        p.col(i).segment(1, i) = p.col(i - 1).head(i);
+        p.col(i).head(i) -= H(i - 1, i - 1) * p.col(i - 1).head(i);
+        double subdiagonal_product = 1.0;
+        for (int m = 1; m < i; ++m) {
+            subdiagonal_product *= H(i - m, i - m - 1);
+            p.col(i).head(i - m) -= (H(i - m - 1, i - 1) * subdiagonal_product) * p.col(i - m - 1).head(i - m);
+        }
+    }
+    return p.col(N);
+}
+
+namespace internal {
+
+inline double EvaluatePolynomial(const double *c, const int degree, const double x) {
+    double value = c[degree];
+    for (int i = degree - 1; i >= 0; --i)
+        value = value * x + c[i];
+    return value;
+}
+
+// Sturm sequence of a polynomial of degree N. Every member is scaled to unit
+// maximum coefficient, which leaves its signs unchanged.
+template <int N> class SturmSequence {
+  public:
+    explicit SturmSequence(const double *c) {
+        for (int i = 0; i <= N; ++i)
+            seq_[0][i] = c[i];
+        degree_[0] = N;
+        for (int i = 0; i < N; ++i)
+            seq_[1][i] = (i + 1) * c[i + 1];
+        degree_[1] = N - 1;
+        Normalize(0);
+        Normalize(1);
+        size_ = 2;
+
+        // seq[k + 1] = -(seq[k - 1] mod seq[k]). A vanishing remainder means
+        // that the polynomial has multiple roots, the sequence then ends with
+        // their greatest common divisor and still counts distinct roots.
+        while (degree_[size_ - 1] > 0) {
+            const double *b = seq_[size_ - 1];
+            const int kDegreeB = degree_[size_ - 1];
+            double r[N + 1];
+            std::copy(seq_[size_ - 2], seq_[size_ - 2] + degree_[size_ - 2] + 1, r);
+            for (int k = degree_[size_ - 2] - kDegreeB; k >= 0; --k) {
+                const double q = r[k + kDegreeB] / b[kDegreeB];
+                for (int j = 0; j <= kDegreeB; ++j)
+                    r[k + j] -= q * b[j];
+            }
+
+            int degree_r = kDegreeB - 1;
+            double max_coeff = 0.0;
+            for (int j = 0; j <= degree_r; ++j)
+                max_coeff = std::max(max_coeff, std::abs(r[j]));
+            if (max_coeff <= kZeroRemainder)
+                break;
+            while (std::abs(r[degree_r]) <= kZeroRemainder * max_coeff)
+                --degree_r;
+
+            for (int j = 0; j <= degree_r; ++j)
+                seq_[size_][j] = -r[j];
+            degree_[size_] = degree_r;
+            Normalize(size_);
+            ++size_;
+        }
+    }
+
+    // Number of sign changes of the sequence at x. The number of distinct real
+    // roots in (a, b] is SignChanges(a) - SignChanges(b).
+    int SignChanges(const double x) const {
+        int changes = 0;
+        double last = 0.0;
+        for (int k = 0; k < size_; ++k) {
+            const double value = EvaluatePolynomial(seq_[k], degree_[k], x);
+            if (value == 0.0)
+                continue;
+            if (last * value < 0.0)
+                ++changes;
+            last = value;
+        }
+        return changes;
+    }
+
+  private:
+    void Normalize(const int k) {
+        double max_coeff = 0.0;
+        for (int j = 0; j <= degree_[k]; ++j)
+            max_coeff = std::max(max_coeff, std::abs(seq_[k][j]));
+        if (max_coeff > 0.0) {
+            for (int j = 0; j <= degree_[k]; ++j)
+                seq_[k][j] /= max_coeff;
+        }
+    }
+
+    // Remainders below this relative magnitude are treated as zero.
+    static constexpr double kZeroRemainder = 1e-13;
+
+    double seq_[N + 1][N + 1];
+    int degree_[N + 1];
+    int size_;
+};
+
+// Refines the single root of c in (a, b] by Newton steps safeguarded with
+// bisection. Falls back to bisection on the Sturm sequence if c does not change
+// sign on the interval, i.e. for a root of even multiplicity.
+template <int N>
+double RefineRoot(const double *c, const SturmSequence<N> &sturm, double a, double b, const double tolerance) {
+    const double kValueA = EvaluatePolynomial(c, N, a);
+    if (EvaluatePolynomial(c, N, b) == 0.0)
+        return b;
+
+    if (kValueA * EvaluatePolynomial(c, N, b) > 0.0) {
+        const int kChangesA = sturm.SignChanges(a);
+        while (b - a > tolerance * std::max(1.0, std::abs(b))) {
+            const double m = 0.5 * (a + b);
+            if (sturm.SignChanges(m) < kChangesA)
+                b = m;
+            else
+                a = m;
+        }
+        return 0.5 * (a + b);
+    }
+
+    double x = 0.5 * (a + b);
+    for (int iter = 0; iter < 100; ++iter) {
+        double value = c[N], derivative = 0.0;
+        for (int i = N - 1; i >= 0; --i) {
+            derivative = derivative * x + value;
+            value = value * x + c[i];
+        }
+        if (value == 0.0)
+            return x;
+        if ((value < 0.0) == (kValueA < 0.0))
+            a = x;
+        else
+            b = x;
+
+        double next = x - value / derivative;
+        if (!(next > a && next < b))
+            next = 0.5 * (a + b);
+        if (std::abs(next - x) <= tolerance * std::max(1.0, std::abs(next)))
+            return next;
+        x = next;
+    }
+    return x;
+}
+
+} // namespace internal
+
+// Finds the distinct real roots of the polynomial c[0] + c[1] x + ... + c[N] x^N
+// with c[N] != 0. The roots are isolated by bisection on its Sturm sequence and
+// then refined individually. Writes them to roots[0, N) in increasing order and
+// returns their number.
+template <int N> int FindRealRoots(const Eigen::Matrix<double, N + 1, 1> &c, double *roots) {
+    constexpr double kTolerance = 1e-14;
+    const Eigen::Matrix<double, N + 1, 1> kMonic = c / c(N);
+    const internal::SturmSequence<N> sturm(kMonic.data());
+
+    // Fujiwara's bound on the magnitude of the roots.
+    double bound = 0.0;
+    for (int i = 0; i < N; ++i) {
+        const double kTerm = (i == 0 ? 0.5 : 1.0) * std::abs(kMonic(i));
+        bound = std::max(bound, std::pow(kTerm, 1.0 / (N - i)));
+    }
+    bound = 2.0 * bound + kTolerance;
+
+    // Disjoint intervals (a, b] that contain at least one root, so at most N
+    // are pending.
+    struct Interval {
+        double a, b;
+        int changes_a, changes_b;
+    };
+    Interval stack[N];
+    int stack_size = 0;
+    stack[stack_size++] = {-bound, bound, sturm.SignChanges(-bound), sturm.SignChanges(bound)};
+
+    int num_roots = 0;
+    while (stack_size > 0 && num_roots < N) {
+        const Interval kInterval = stack[--stack_size];
+        const int kNumRoots = kInterval.changes_a - kInterval.changes_b;
+        if (kNumRoots <= 0)
+            continue;
+        if (kNumRoots == 1) {
+            roots[num_roots++] = internal::RefineRoot<N>(kMonic.data(), sturm, kInterval.a, kInterval.b, kTolerance);
+            continue;
+        }
+
+        const double m = 0.5 * (kInterval.a + kInterval.b);
+        if (kInterval.b - kInterval.a <= kTolerance * std::max(1.0, std::abs(m))) {
+            // A cluster of roots that cannot be separated in double precision.
+            roots[num_roots++] = m;
+            continue;
+        }
+        const int kChangesM = sturm.SignChanges(m);
+        if (kInterval.changes_a > kChangesM && stack_size < N)
+            stack[stack_size++] = {kInterval.a, m, kInterval.changes_a, kChangesM};
+        if (kChangesM > kInterval.changes_b && stack_size < N)
+            stack[stack_size++] = {m, kInterval.b, kChangesM, kInterval.changes_b};
+    }
+
+    std::sort(roots, roots + num_roots);
+    return num_roots;
+}
+
+// Eigenvector v of A for its real eigenvalue lambda, scaled to v(0) = 1. The
+// kernel of A - lambda I is read off its LU decomposition with full pivoting.
+template <int N>
+Eigen::Matrix<double, N, 1> EigenvectorForEigenvalue(const Eigen::Matrix<double, N, N> &A, const double lambda) {
+    Eigen::Matrix<double, N, N> B = A;
+    B.diagonal().array() -= lambda;
+    const Eigen::FullPivLU<Eigen::Matrix<double, N, N>> lu(B);
+    const Eigen::Matrix<double, N, N> &LU = lu.matrixLU();
+
+    Eigen::Matrix<double, N, 1> y;
+    y(N - 1) = 1.0;
+    y.template head<N - 1>() = LU.template topLeftCorner<N - 1, N - 1>().template triangularView<Eigen::Upper>().solve(
+        -LU.col(N - 1).template head<N - 1>());
+    const Eigen::Matrix<double, N, 1> v = lu.permutationQ() * y;
+    return v / v(0);
+}
+
+} // namespace madpose
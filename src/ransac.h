@@ -83,8 +83,8 @@ class LocallyOptimizedMSAC : public RansacBase {
             // Finds the best model among all estimated models.
             double best_local_score = std::numeric_limits<double>::max();
             int best_local_model_id = 0;
-            GetBestEstimatedModelId(solver, estimated_models, kNumEstimatedModels, kSqrInlierThresh, &best_local_score,
-                                    &best_local_model_id);
+            GetBestEstimatedModelId(solver, estimated_models, kNumEstimatedModels, kSqrInlierThresh,
+                                    best_min_model_score, &best_local_score, &best_local_model_id);
 
             // Updates the best model found so far.
             if (best_local_score < best_min_model_score || stats.num_iterations == options.lo_starting_iterations_) {
@@ -145,7 +145,7 @@ class LocallyOptimizedMSAC : public RansacBase {
             solver.LeastSquares(stats.inlier_indices, &refined_model);
 
             double score = std::numeric_limits<double>::max();
-            ScoreModel(solver, refined_model, kSqrInlierThresh, &score);
+            ScoreModel(solver, refined_model, kSqrInlierThresh, &score, stats.best_model_score);
             if (score < stats.best_model_score) {
                 stats.best_model_score = score;
                 *best_model = refined_model;
@@ -160,12 +160,13 @@ class LocallyOptimizedMSAC : public RansacBase {
 
   protected:
     void GetBestEstimatedModelId(const Solver &solver, const ModelVector &models, const int num_models,
-                                 const double squared_inlier_threshold, double *best_score, int *best_model_id) const {
+                                 const double squared_inlier_threshold, const double score_bound, double *best_score,
+                                 int *best_model_id) const {
         *best_score = std::numeric_limits<double>::max();
         *best_model_id = 0;
         for (int m = 0; m < num_models; ++m) {
             double score = std::numeric_limits<double>::max();
-            ScoreModel(solver, models[m], squared_inlier_threshold, &score);
+            ScoreModel(solver, models[m], squared_inlier_threshold, &score, std::min(score_bound, *best_score));
 
             if (score < *best_score) {
                 *best_score = score;
@@ -174,13 +175,20 @@ class LocallyOptimizedMSAC : public RansacBase {
         }
     }
 
-    void ScoreModel(const Solver &solver, const Model &model, const double squared_inlier_threshold,
-                    double *score) const {
+    // Computes the MSAC score of the model. The evaluation stops as soon as
+    // the partial score reaches score_bound, in which case the score is set to
+    // std::numeric_limits<double>::max(). Scores below score_bound are exact.
+    void ScoreModel(const Solver &solver, const Model &model, const double squared_inlier_threshold, double *score,
+                    const double score_bound = std::numeric_limits<double>::max()) const {
         const int kNumData = solver.num_data();
         *score = 0.0;
         for (int i = 0; i < kNumData; ++i) {
             double squared_error = solver.EvaluateModelOnPoint(model, i);
             *score += ComputeScore(squared_error, squared_inlier_threshold);
+            if (*score >= score_bound) {
+                *score = std::numeric_limits<double>::max();
+                return;
+            }
         }
     }
 
@@ -241,7 +249,7 @@ class LocallyOptimizedMSAC : public RansacBase {
         LeastSquaresFit(options, kSqInThresh * kThreshMult, solver, rng, &m_init);
 
         double score = std::numeric_limits<double>::max();
-        ScoreModel(solver, m_init, kSqInThresh, &score);
+        ScoreModel(solver, m_init, kSqInThresh, &score, *score_best_minimal_model);
         UpdateBestModel(score, m_init, score_best_minimal_model, best_minimal_model);
 
         std::vector<int> inliers_base;
@@ -262,7 +270,7 @@ class LocallyOptimizedMSAC : public RansacBase {
             if (!solver.NonMinimalSolver(sample, &m_non_min))
                 continue;
 
-            ScoreModel(solver, m_non_min, kSqInThresh, &score);
+            ScoreModel(solver, m_non_min, kSqInThresh, &score, *score_best_minimal_model);
             UpdateBestModel(score, m_non_min, score_best_minimal_model, best_minimal_model);
 
             // Iterative least squares refinement.
@@ -275,7 +283,7 @@ class LocallyOptimizedMSAC : public RansacBase {
             for (int i = 0; i < options.num_lsq_iterations_; ++i) {
                 LeastSquaresFit(options, thresh, solver, rng, &m_non_min);
 
-                ScoreModel(solver, m_non_min, kSqInThresh, &score);
+                ScoreModel(solver, m_non_min, kSqInThresh, &score, *score_best_minimal_model);
                 UpdateBestModel(score, m_non_min, score_best_minimal_model, best_minimal_model);
                 thresh -= thresh_mult_update;
             }
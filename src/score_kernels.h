@@ -0,0 +1,234 @@
+#pragma once
+
+#include "view_data.h"
+
+#include <Eigen/Core>
+#include <algorithm>
+#include <limits>
+
+namespace madpose {
+
+// Batched residual kernels used to score models on ranges [begin, end) of
+// points stored in structure-of-arrays form (see ViewData). The loops are
+// written without early exits and branches so that the compiler can
+// vectorize them (SSE/AVX2 on x86, NEON on ARM). Rejected points are marked
+// with std::numeric_limits<double>::max() through selects instead.
+
+// Maps points of one image, lifted to 3D with their affine corrected depth
+// priors, into the other image:
+//   X = [coord_scale * x, coord_scale * y, 1] * (d + offset) * depth_scale
+//   p = M * X + c,   error = |p.head<2>() / p(2) - [u, v]|^2
+// where M and c already contain the intrinsics of the other image. Points
+// with p(2) < 1e-2, or with d < 1e-2 if check_depth is set, are rejected.
+struct LiftedProjection {
+    Eigen::Matrix3d M;
+    Eigen::Vector3d c;
+    double coord_scale = 1.0;
+    double offset = 0.0;
+    double depth_scale = 1.0;
+    bool check_depth = false;
+};
+
+// Squared Sampson error with respect to the essential or fundamental matrix
+// E, divided by normalization. If check_cheirality is set, correspondences
+// whose triangulation with (R, t) is behind either camera are rejected.
+struct EpipolarGeometry {
+    Eigen::Matrix3d E;
+    double normalization = 1.0;
+    bool check_cheirality = false;
+    Eigen::Matrix3d R;
+    Eigen::Vector3d t;
+};
+
+// Per-model quantities shared by all data points of the hybrid estimators.
+// Computed once per model so that scoring does not rebuild them for every
+// point. The data types are reprojection 0->1, reprojection 1->0 and the
+// Sampson error.
+struct PreparedTwoViewModel {
+    LiftedProjection proj01, proj10;
+    EpipolarGeometry epipolar;
+};
+
+inline void LiftedReprojectionErrors(const ViewData &from, const double *d, const ViewData &to,
+                                     const LiftedProjection &proj, const int begin, const int end, double *errors) {
+    const double kMax = std::numeric_limits<double>::max();
+    const double *x = from.x.data(), *y = from.y.data(), *u = to.u.data(), *v = to.v.data();
+    const double m00 = proj.M(0, 0), m01 = proj.M(0, 1), m02 = proj.M(0, 2);
+    const double m10 = proj.M(1, 0), m11 = proj.M(1, 1), m12 = proj.M(1, 2);
+    const double m20 = proj.M(2, 0), m21 = proj.M(2, 1), m22 = proj.M(2, 2);
+    const double c0 = proj.c(0), c1 = proj.c(1), c2 = proj.c(2);
+    const double kCoordScale = proj.coord_scale, kOffset = proj.offset, kDepthScale = proj.depth_scale;
+    const double kMinDepth = proj.check_depth ? 1e-2 : -kMax;
+
+    for (int i = begin; i < end; ++i) {
+        const double s = (d[i] + kOffset) * kDepthScale;
+        const double X = kCoordScale * x[i] * s;
+        const double Y = kCoordScale * y[i] * s;
+        const double px = m00 * X + m01 * Y + m02 * s + c0;
+        const double py = m10 * X + m11 * Y + m12 * s + c1;
+        const double pz = m20 * X + m21 * Y + m22 * s + c2;
+        const double ex = px / pz - u[i];
+        const double ey = py / pz - v[i];
+        const bool kValid = (pz >= 1e-2) & (d[i] >= kMinDepth);
+        errors[i - begin] = kValid ? ex * ex + ey * ey : kMax;
+    }
+}
+
+inline void SampsonErrors(const ViewData &view0, const ViewData &view1, const EpipolarGeometry &epipolar,
+                          const int begin, const int end, double *errors) {
+    const double kMax = std::numeric_limits<double>::max();
+    const double *x0 = view0.x.data(), *y0 = view0.y.data(), *x1 = view1.x.data(), *y1 = view1.y.data();
+    const double e00 = epipolar.E(0, 0), e01 = epipolar.E(0, 1), e02 = epipolar.E(0, 2);
+    const double e10 = epipolar.E(1, 0), e11 = epipolar.E(1, 1), e12 = epipolar.E(1, 2);
+    const double e20 = epipolar.E(2, 0), e21 = epipolar.E(2, 1), e22 = epipolar.E(2, 2);
+    const double kNormalization = epipolar.normalization;
+
+    for (int i = begin; i < end; ++i) {
+        const double Ex1_0 = e00 * x0[i] + e01 * y0[i] + e02;
+        const double Ex1_1 = e10 * x0[i] + e11 * y0[i] + e12;
+        const double Ex1_2 = e20 * x0[i] + e21 * y0[i] + e22;
+        const double Ex2_0 = e00 * x1[i] + e10 * y1[i] + e20;
+        const double Ex2_1 = e01 * x1[i] + e11 * y1[i] + e21;
+        const double C = x1[i] * Ex1_0 + y1[i] * Ex1_1 + Ex1_2;
+        const double Cx = Ex1_0 * Ex1_0 + Ex1_1 * Ex1_1;
+        const double Cy = Ex2_0 * Ex2_0 + Ex2_1 * Ex2_1;
+        errors[i - begin] = C * C / (Cx + Cy) / kNormalization;
+    }
+
+    if (!epipolar.check_cheirality)
+        return;
+
+    // Same test as poselib::check_cheirality with a minimum depth of 1e-2.
+    const double *b0x = view0.bx.data(), *b0y = view0.by.data(), *b0z = view0.bz.data();
+    const double *b1x = view1.bx.data(), *b1y = view1.by.data(), *b1z = view1.bz.data();
+    const double r00 = epipolar.R(0, 0), r01 = epipolar.R(0, 1), r02 = epipolar.R(0, 2);
+    const double r10 = epipolar.R(1, 0), r11 = epipolar.R(1, 1), r12 = epipolar.R(1, 2);
+    const double r20 = epipolar.R(2, 0), r21 = epipolar.R(2, 1), r22 = epipolar.R(2, 2);
+    const double t0 = epipolar.t(0), t1 = epipolar.t(1), t2 = epipolar.t(2);
+
+    for (int i = begin; i < end; ++i) {
+        const double Rx0 = r00 * b0x[i] + r01 * b0y[i] + r02 * b0z[i];
+        const double Rx1 = r10 * b0x[i] + r11 * b0y[i] + r12 * b0z[i];
+        const double Rx2 = r20 * b0x[i] + r21 * b0y[i] + r22 * b0z[i];
+        const double a = -(Rx0 * b1x[i] + Rx1 * b1y[i] + Rx2 * b1z[i]);
+        const double b1 = -(Rx0 * t0 + Rx1 * t1 + Rx2 * t2);
+        const double b2 = b1x[i] * t0 + b1y[i] * t1 + b1z[i] * t2;
+        const double lambda1 = b1 - a * b2;
+        const double lambda2 = -a * b1 + b2;
+        const double kMinDepth = 1e-2 * (1 - a * a);
+        const bool kValid = (lambda1 > kMinDepth) & (lambda2 > kMinDepth);
+        errors[i - begin] = kValid ? errors[i - begin] : kMax;
+    }
+}
+
+// Evaluates data type t of a prepared model on the points [begin, end).
+inline void TwoViewErrors(const ViewData &view0, const double *d0, const ViewData &view1, const double *d1,
+                          const PreparedTwoViewModel &model, const int t, const int begin, const int end,
+                          double *errors) {
+    if (t == 0) {
+        LiftedReprojectionErrors(view0, d0, view1, model.proj01, begin, end, errors);
+    } else if (t == 1) {
+        LiftedReprojectionErrors(view1, d1, view0, model.proj10, begin, end, errors);
+    } else if (t == 2) {
+        SampsonErrors(view0, view1, model.epipolar, begin, end, errors);
+    }
+}
+
+template <bool kCheckCheirality>
+inline void FusedTwoViewErrors(const ViewData &view0, const double *d0, const ViewData &view1, const double *d1,
+                               const PreparedTwoViewModel &model, const int begin, const int end, double *errors0,
+                               double *errors1, double *errors2) {
+    const double kMax = std::numeric_limits<double>::max();
+    const double *x0 = view0.x.data(), *y0 = view0.y.data(), *u0 = view0.u.data(), *v0 = view0.v.data();
+    const double *x1 = view1.x.data(), *y1 = view1.y.data(), *u1 = view1.u.data(), *v1 = view1.v.data();
+    const double *b0x = view0.bx.data(), *b0y = view0.by.data(), *b0z = view0.bz.data();
+    const double *b1x = view1.bx.data(), *b1y = view1.by.data(), *b1z = view1.bz.data();
+
+    const LiftedProjection &p01 = model.proj01, &p10 = model.proj10;
+    const double a00 = p01.M(0, 0), a01 = p01.M(0, 1), a02 = p01.M(0, 2), ac0 = p01.c(0);
+    const double a10 = p01.M(1, 0), a11 = p01.M(1, 1), a12 = p01.M(1, 2), ac1 = p01.c(1);
+    const double a20 = p01.M(2, 0), a21 = p01.M(2, 1), a22 = p01.M(2, 2), ac2 = p01.c(2);
+    const double b00 = p10.M(0, 0), b01 = p10.M(0, 1), b02 = p10.M(0, 2), bc0 = p10.c(0);
+    const double b10 = p10.M(1, 0), b11 = p10.M(1, 1), b12 = p10.M(1, 2), bc1 = p10.c(1);
+    const double b20 = p10.M(2, 0), b21 = p10.M(2, 1), b22 = p10.M(2, 2), bc2 = p10.c(2);
+    const double kCoordScale0 = p01.coord_scale, kOffset0 = p01.offset, kDepthScale0 = p01.depth_scale;
+    const double kCoordScale1 = p10.coord_scale, kOffset1 = p10.offset, kDepthScale1 = p10.depth_scale;
+    const double kMinDepth0 = p01.check_depth ? 1e-2 : -kMax;
+    const double kMinDepth1 = p10.check_depth ? 1e-2 : -kMax;
+
+    const EpipolarGeometry &epi = model.epipolar;
+    const double e00 = epi.E(0, 0), e01 = epi.E(0, 1), e02 = epi.E(0, 2);
+    const double e10 = epi.E(1, 0), e11 = epi.E(1, 1), e12 = epi.E(1, 2);
+    const double e20 = epi.E(2, 0), e21 = epi.E(2, 1), e22 = epi.E(2, 2);
+    const double r00 = epi.R(0, 0), r01 = epi.R(0, 1), r02 = epi.R(0, 2);
+    const double r10 = epi.R(1, 0), r11 = epi.R(1, 1), r12 = epi.R(1, 2);
+    const double r20 = epi.R(2, 0), r21 = epi.R(2, 1), r22 = epi.R(2, 2);
+    const double t0 = epi.t(0), t1 = epi.t(1), t2 = epi.t(2);
+    const double kNormalization = epi.normalization;
+
+    for (int i = begin; i < end; ++i) {
+        // Reprojection 0->1.
+        const double s0 = (d0[i] + kOffset0) * kDepthScale0;
+        const double X0 = kCoordScale0 * x0[i] * s0;
+        const double Y0 = kCoordScale0 * y0[i] * s0;
+        const double p0x = a00 * X0 + a01 * Y0 + a02 * s0 + ac0;
+        const double p0y = a10 * X0 + a11 * Y0 + a12 * s0 + ac1;
+        const double p0z = a20 * X0 + a21 * Y0 + a22 * s0 + ac2;
+        const double e0x = p0x / p0z - u1[i];
+        const double e0y = p0y / p0z - v1[i];
+        const bool kValid0 = (p0z >= 1e-2) & (d0[i] >= kMinDepth0);
+        errors0[i - begin] = kValid0 ? e0x * e0x + e0y * e0y : kMax;
+
+        // Reprojection 1->0.
+        const double s1 = (d1[i] + kOffset1) * kDepthScale1;
+        const double X1 = kCoordScale1 * x1[i] * s1;
+        const double Y1 = kCoordScale1 * y1[i] * s1;
+        const double p1x = b00 * X1 + b01 * Y1 + b02 * s1 + bc0;
+        const double p1y = b10 * X1 + b11 * Y1 + b12 * s1 + bc1;
+        const double p1z = b20 * X1 + b21 * Y1 + b22 * s1 + bc2;
+        const double e1x = p1x / p1z - u0[i];
+        const double e1y = p1y / p1z - v0[i];
+        const bool kValid1 = (p1z >= 1e-2) & (d1[i] >= kMinDepth1);
+        errors1[i - begin] = kValid1 ? e1x * e1x + e1y * e1y : kMax;
+
+        // Sampson error.
+        const double Ex1_0 = e00 * x0[i] + e01 * y0[i] + e02;
+        const double Ex1_1 = e10 * x0[i] + e11 * y0[i] + e12;
+        const double Ex1_2 = e20 * x0[i] + e21 * y0[i] + e22;
+        const double Ex2_0 = e00 * x1[i] + e10 * y1[i] + e20;
+        const double Ex2_1 = e01 * x1[i] + e11 * y1[i] + e21;
+        const double C = x1[i] * Ex1_0 + y1[i] * Ex1_1 + Ex1_2;
+        const double Cx = Ex1_0 * Ex1_0 + Ex1_1 * Ex1_1;
+        const double Cy = Ex2_0 * Ex2_0 + Ex2_1 * Ex2_1;
+
+        bool kValid2 = true;
+        if (kCheckCheirality) {
+            const double Rx0 = r00 * b0x[i] + r01 * b0y[i] + r02 * b0z[i];
+            const double Rx1 = r10 * b0x[i] + r11 * b0y[i] + r12 * b0z[i];
+            const double Rx2 = r20 * b0x[i] + r21 * b0y[i] + r22 * b0z[i];
+            const double a = -(Rx0 * b1x[i] + Rx1 * b1y[i] + Rx2 * b1z[i]);
+            const double lb1 = -(Rx0 * t0 + Rx1 * t1 + Rx2 * t2);
+            const double lb2 = b1x[i] * t0 + b1y[i] * t1 + b1z[i] * t2;
+            const double lambda1 = lb1 - a * lb2;
+            const double lambda2 = -a * lb1 + lb2;
+            const double kMinDepth = 1e-2 * (1 - a * a);
+            kValid2 = (lambda1 > kMinDepth) & (lambda2 > kMinDepth);
+        }
+        errors2[i - begin] = kValid2 ? C * C / (Cx + Cy) / kNormalization : kMax;
+    }
+}
+
+// Fused version of TwoViewErrors that evaluates all three data types in a
+// single pass over the points [begin, end), so that every correspondence is
+// loaded only once.
+inline void TwoViewErrors(const ViewData &view0, const double *d0, const ViewData &view1, const double *d1,
+                          const PreparedTwoViewModel &model, const int begin, const int end, double *errors0,
+                          double *errors1, double *errors2) {
+    if (model.epipolar.check_cheirality) {
+        FusedTwoViewErrors<true>(view0, d0, view1, d1, model, begin, end, errors0, errors1, errors2);
+    } else {
+        FusedTwoViewErrors<false>(view0, d0, view1, d1, model, begin, end, errors0, errors1, errors2);
+    }
+}
+
+} // namespace madpose
@@ -1,145 +1,159 @@
 #include "solver.h"
 
-namespace madpose {
-
-PoseAndScale estimate_scale_and_pose(const Eigen::MatrixXd &X, const Eigen::MatrixXd &Y, const Eigen::VectorXd &W) {
-    // X: 3 x N
-    // Y: 3 x N
-    // W: N x 1
-
-    // 1. Compute the weighted centroid of X and Y
-    Eigen::Vector3d centroid_X = X * W / W.sum();
-    Eigen::Vector3d centroid_Y = Y * W / W.sum();
-
-    Eigen::MatrixXd X_centered = X.colwise() - centroid_X;
-    Eigen::MatrixXd Y_centered = Y.colwise() - centroid_Y;
+#include "alignment.h"
+#include "polynomial.h"
 
-    Eigen::Matrix3d S = Y_centered * W.asDiagonal() * X_centered.transpose();
+#include <iterator>
 
-    Eigen::JacobiSVD<Eigen::MatrixXd> svd(S, Eigen::ComputeFullU | Eigen::ComputeFullV);
-    Eigen::Matrix3d U = svd.matrixU();
-    Eigen::Matrix3d V = svd.matrixV();
+namespace madpose {
 
-    if (U.determinant() * V.determinant() < 0) {
-        U.col(2) *= -1;
+namespace {
+
+// Similarity transform that aligns the columns of X to those of Y, with the
+// rotation and translation fitted with weights W and the scale fitted without.
+template <typename DerivedX, typename DerivedY, typename DerivedW>
+PoseAndScale weighted_scale_and_pose(const Eigen::MatrixBase<DerivedX> &X, const Eigen::MatrixBase<DerivedY> &Y,
+                                     const Eigen::MatrixBase<DerivedW> &W) {
+    // 1. Compute the weighted centroids and cross-covariance of X and Y
+    Eigen::Vector3d centroid_X, centroid_Y;
+    Eigen::Matrix3d S;
+    CenteredCrossCovariance(X, Y, W, &centroid_X, &centroid_Y, &S);
+
+    // 2. Rotation and (unweighted) least squares scale
+    Eigen::Matrix3d R = RotationFromCrossCovariance(S);
+
+    double num = 0.0, denom = 0.0;
+    for (Eigen::Index i = 0; i < X.cols(); i++) {
+        const Eigen::Vector3d x_rotated = R * (X.col(i) - centroid_X);
+        num += (Y.col(i) - centroid_Y).dot(x_rotated);
+        denom += x_rotated.squaredNorm();
     }
-    Eigen::Matrix3d R = U * V.transpose();
-
-    Eigen::MatrixXd X_rotated = R * X_centered;
-    double scale = Y_centered.cwiseProduct(X_rotated).sum() / X_rotated.cwiseProduct(X_rotated).sum();
+    double scale = num / denom;
 
     Eigen::Vector3d t = centroid_Y - scale * R * centroid_X;
     return PoseAndScale(R, t, scale);
 }
 
-std::vector<Eigen::Vector4d> solve_scale_and_shift(const Eigen::Matrix3d &x_homo, const Eigen::Matrix3d &y_homo,
-                                                   const Eigen::Vector3d &depth_x, const Eigen::Vector3d &depth_y) {
-    // X: 3 x 3, column vectors are homogeneous of 2D points
-    // Y: 3 x 3, column vectors are homogeneous of 2D points
-    Eigen::Matrix3d x1 = x_homo.transpose();
-    Eigen::Matrix3d x2 = y_homo.transpose();
-    const Eigen::Vector3d &d1 = depth_x;
-    const Eigen::Vector3d &d2 = depth_y;
-    Eigen::VectorXd coeffs = Eigen::VectorXd::Zero(18);
-
-    coeffs[0] = 2 * x2.row(0).dot(x2.row(1)) - x2.row(0).dot(x2.row(0)) - x2.row(1).dot(x2.row(1));
-    coeffs[1] = x1.row(0).dot(x1.row(0)) + x1.row(1).dot(x1.row(1)) - 2 * x1.row(0).dot(x1.row(1));
-    coeffs[2] = 2 * (d2[0] + d2[1]) * x2.row(0).dot(x2.row(1)) - 2 * d2[0] * x2.row(0).dot(x2.row(0)) -
-                2 * d2[1] * x2.row(1).dot(x2.row(1));
-    coeffs[3] = 2 * d2[0] * d2[1] * x2.row(0).dot(x2.row(1)) - d2[0] * d2[0] * x2.row(0).dot(x2.row(0)) -
-                d2[1] * d2[1] * x2.row(1).dot(x2.row(1));
-    coeffs[4] = 2 * d1[0] * x1.row(0).dot(x1.row(0)) + 2 * d1[1] * x1.row(1).dot(x1.row(1)) -
-                2 * (d1[0] + d1[1]) * x1.row(0).dot(x1.row(1));
-    coeffs[5] = d1[0] * d1[0] * x1.row(0).dot(x1.row(0)) + d1[1] * d1[1] * x1.row(1).dot(x1.row(1)) -
-                2 * d1[0] * d1[1] * x1.row(0).dot(x1.row(1));
-    coeffs[6] = 2 * x2.row(0).dot(x2.row(2)) - x2.row(0).dot(x2.row(0)) - x2.row(2).dot(x2.row(2));
-    coeffs[7] = x1.row(0).dot(x1.row(0)) + x1.row(2).dot(x1.row(2)) - 2 * x1.row(0).dot(x1.row(2));
-    coeffs[8] = 2 * (d2[0] + d2[2]) * x2.row(0).dot(x2.row(2)) - 2 * d2[0] * x2.row(0).dot(x2.row(0)) -
-                2 * d2[2] * x2.row(2).dot(x2.row(2));
-    coeffs[9] = 2 * d2[0] * d2[2] * x2.row(0).dot(x2.row(2)) - d2[0] * d2[0] * x2.row(0).dot(x2.row(0)) -
-                d2[2] * d2[2] * x2.row(2).dot(x2.row(2));
-    coeffs[10] = 2 * d1[0] * x1.row(0).dot(x1.row(0)) + 2 * d1[2] * x1.row(2).dot(x1.row(2)) -
-                 2 * (d1[0] + d1[2]) * x1.row(0).dot(x1.row(2));
-    coeffs[11] = d1[0] * d1[0] * x1.row(0).dot(x1.row(0)) + d1[2] * d1[2] * x1.row(2).dot(x1.row(2)) -
-                 2 * d1[0] * d1[2] * x1.row(0).dot(x1.row(2));
-    coeffs[12] = 2 * x2.row(1).dot(x2.row(2)) - x2.row(1).dot(x2.row(1)) - x2.row(2).dot(x2.row(2));
-    coeffs[13] = x1.row(1).dot(x1.row(1)) + x1.row(2).dot(x1.row(2)) - 2 * x1.row(1).dot(x1.row(2));
-    coeffs[14] = 2 * (d2[1] + d2[2]) * x2.row(1).dot(x2.row(2)) - 2 * d2[1] * x2.row(1).dot(x2.row(1)) -
-                 2 * d2[2] * x2.row(2).dot(x2.row(2));
-    coeffs[15] = 2 * d2[1] * d2[2] * x2.row(1).dot(x2.row(2)) - d2[1] * d2[1] * x2.row(1).dot(x2.row(1)) -
-                 d2[2] * d2[2] * x2.row(2).dot(x2.row(2));
-    coeffs[16] = 2 * d1[1] * x1.row(1).dot(x1.row(1)) + 2 * d1[2] * x1.row(2).dot(x1.row(2)) -
-                 2 * (d1[1] + d1[2]) * x1.row(1).dot(x1.row(2));
-    coeffs[17] = d1[1] * d1[1] * x1.row(1).dot(x1.row(1)) + d1[2] * d1[2] * x1.row(2).dot(x1.row(2)) -
-                 2 * d1[1] * d1[2] * x1.row(1).dot(x1.row(2));
-
-    const std::vector<int> coeff_ind0 = {0, 6,  12, 1,  7,  13, 2,  8, 0,  6,  12, 14, 6, 0, 12, 1,  7,  13, 3,
-                                         9, 2,  8,  14, 15, 4,  10, 7, 1,  16, 13, 8,  2, 6, 12, 0,  14, 9,  3,
-                                         8, 14, 2,  15, 3,  9,  15, 4, 10, 16, 7,  13, 1, 5, 11, 10, 4,  17, 16};
-    const std::vector<int> coeff_ind1 = {11, 17, 5, 9, 15, 3, 5, 11, 17, 10, 16, 4, 11, 5, 17};
-    const std::vector<int> ind0 = {0,   1,   9,   12,  13,  21,  24,  25,  26,  28,  29,  33,  39,  42,  47,
-                                   50,  52,  53,  60,  61,  62,  64,  65,  69,  72,  73,  75,  78,  81,  83,
-                                   87,  90,  91,  92,  94,  95,  99,  102, 103, 104, 106, 107, 110, 112, 113,
-                                   122, 124, 125, 127, 128, 130, 132, 133, 135, 138, 141, 143};
-    const std::vector<int> ind1 = {7, 8, 10, 19, 20, 22, 26, 28, 29, 31, 32, 34, 39, 42, 47};
-    Eigen::MatrixXd C0 = Eigen::MatrixXd::Zero(12, 12);
-    Eigen::MatrixXd C1 = Eigen::MatrixXd::Zero(12, 4);
-
-    for (int k = 0; k < ind0.size(); k++) {
-        int i = ind0[k] % 12;
-        int j = ind0[k] / 12;
-        C0(i, j) = coeffs[coeff_ind0[k]];
+} // namespace
+
+PoseAndScale estimate_scale_and_pose(const Eigen::MatrixXd &X, const Eigen::MatrixXd &Y, const Eigen::VectorXd &W) {
+    // X: 3 x N
+    // Y: 3 x N
+    // W: N x 1
+    return weighted_scale_and_pose(X, Y, W);
+}
+
+PoseAndScale estimate_scale_and_pose(const Eigen::Matrix3d &X, const Eigen::Matrix3d &Y) {
+    return weighted_scale_and_pose(X, Y, Eigen::Vector3d::Ones());
+}
+
+namespace {
+
+// Copies a sample to the layout of the coefficient functions,
+// x1[i][r] = x_homo(r, i).
+template <int N>
+void unpack_sample(const Eigen::Matrix<double, 3, N> &x_homo, const Eigen::Matrix<double, 3, N> &y_homo,
+                   const Eigen::Matrix<double, N, 1> &depth_x, const Eigen::Matrix<double, N, 1> &depth_y,
+                   double (&x1)[N][3], double (&x2)[N][3], double (&d1)[N], double (&d2)[N]) {
+    for (int i = 0; i < N; i++) {
+        for (int r = 0; r < 3; r++) {
+            x1[i][r] = x_homo(r, i);
+            x2[i][r] = y_homo(r, i);
+        }
+        d1[i] = depth_x(i);
+        d2[i] = depth_y(i);
     }
+}
 
-    for (int k = 0; k < ind1.size(); k++) {
-        int i = ind1[k] % 12;
-        int j = ind1[k] / 12;
-        C1(i, j) = coeffs[coeff_ind1[k]];
+// The coefficients of the polynomial system of solve_scale_and_shift. The
+// points are given as x1[i][r] = x_homo(r, i).
+void scale_and_shift_coefficients(const double (&x1)[3][3], const double (&x2)[3][3], const double (&d1)[3],
+                                  const double (&d2)[3], double *coeffs) {
+    // Every pair of points contributes 6 coefficients of the same form.
+    static constexpr int kPairs[3][2] = {{0, 1}, {0, 2}, {1, 2}};
+    for (int p = 0; p < 3; p++) {
+        const int i = kPairs[p][0], j = kPairs[p][1];
+        const double x1_ii = x1[i][0] * x1[i][0] + x1[i][1] * x1[i][1] + x1[i][2] * x1[i][2];
+        const double x1_jj = x1[j][0] * x1[j][0] + x1[j][1] * x1[j][1] + x1[j][2] * x1[j][2];
+        const double x1_ij = x1[i][0] * x1[j][0] + x1[i][1] * x1[j][1] + x1[i][2] * x1[j][2];
+        const double x2_ii = x2[i][0] * x2[i][0] + x2[i][1] * x2[i][1] + x2[i][2] * x2[i][2];
+        const double x2_jj = x2[j][0] * x2[j][0] + x2[j][1] * x2[j][1] + x2[j][2] * x2[j][2];
+        const double x2_ij = x2[i][0] * x2[j][0] + x2[i][1] * x2[j][1] + x2[i][2] * x2[j][2];
+
+        double *c = coeffs + 6 * p;
+        c[0] = 2 * x2_ij - x2_ii - x2_jj;
+        c[1] = x1_ii + x1_jj - 2 * x1_ij;
+        c[2] = 2 * (d2[i] + d2[j]) * x2_ij - 2 * d2[i] * x2_ii - 2 * d2[j] * x2_jj;
+        c[3] = 2 * d2[i] * d2[j] * x2_ij - d2[i] * d2[i] * x2_ii - d2[j] * d2[j] * x2_jj;
+        c[4] = 2 * d1[i] * x1_ii + 2 * d1[j] * x1_jj - 2 * (d1[i] + d1[j]) * x1_ij;
+        c[5] = d1[i] * d1[i] * x1_ii + d1[j] * d1[j] * x1_jj - 2 * d1[i] * d1[j] * x1_ij;
     }
+}
 
-    Eigen::MatrixXd C2 = C0.colPivHouseholderQr().solve(C1);
+int scale_and_shift_from_coefficients(const double *coeffs, Eigen::Matrix4d *solutions) {
+    // Elimination template. The entries of C0 and C1 are given by their
+    // column-major linear index and the coefficient they take.
+    static constexpr int kCoeffInd0[] = {0,  6, 12, 1,  7,  13, 2,  8,  0,  6,  12, 14, 6,  0,  12, 1,  7,  13, 3,
+                                         9,  2, 8,  14, 15, 4,  10, 7,  1,  16, 13, 8,  2,  6,  12, 0,  14, 9,  3,
+                                         8,  14, 2, 15, 3,  9,  15, 4,  10, 16, 7,  13, 1,  5,  11, 10, 4,  17, 16};
+    static constexpr int kCoeffInd1[] = {11, 17, 5, 9, 15, 3, 5, 11, 17, 10, 16, 4, 11, 5, 17};
+    static constexpr int kInd0[] = {0,   1,   9,   12,  13,  21,  24,  25,  26,  28,  29,  33,  39,  42,  47,
+                                    50,  52,  53,  60,  61,  62,  64,  65,  69,  72,  73,  75,  78,  81,  83,
+                                    87,  90,  91,  92,  94,  95,  99,  102, 103, 104, 106, 107, 110, 112, 113,
+                                    122, 124, 125, 127, 128, 130, 132, 133, 135, 138, 141, 143};
+    static constexpr int kInd1[] = {7, 8, 10, 19, 20, 22, 26, 28, 29, 31, 32, 34, 39, 42, 47};
+    Eigen::Matrix<double, 12, 12> C0 = Eigen::Matrix<double, 12, 12>::Zero();
+    Eigen::Matrix<double, 12, 4> C1 = Eigen::Matrix<double, 12, 4>::Zero();
+    for (int k = 0; k < static_cast<int>(std::size(kInd0)); k++)
+        C0.data()[kInd0[k]] = coeffs[kCoeffInd0[k]];
+    for (int k = 0; k < static_cast<int>(std::size(kInd1)); k++)
+        C1.data()[kInd1[k]] = coeffs[kCoeffInd1[k]];
+
+    const Eigen::Matrix<double, 12, 4> C2 = C0.partialPivLu().solve(C1);
     Eigen::Matrix4d AM;
     AM << Eigen::RowVector4d(0, 0, 1, 0), -C2.row(9), -C2.row(10), -C2.row(11);
 
-    Eigen::EigenSolver<Eigen::Matrix4d> es(AM);
-    Eigen::Vector4cd D = es.eigenvalues();
-    Eigen::Matrix4cd V = es.eigenvectors();
-
-    Eigen::MatrixXcd sols = Eigen::MatrixXcd(4, 3);
-    sols.col(0) = V.row(1).array() / V.row(0).array();
-    sols.col(1) = D;
-    sols.col(2) = V.row(3).array() / V.row(0).array();
-
-    std::vector<Eigen::Vector4d> solutions;
-    for (int i = 0; i < 4; i++) {
-        if (D[i].imag() != 0)
-            continue;
-        double a2 = std::sqrt(sols(i, 0).real());
-        double b1 = sols(i, 1).real(), b2 = sols(i, 2).real();
-        Eigen::Vector4d sol;
-        sol << 1.0, b1, a2, b2 * a2;
-        solutions.push_back(sol);
+    // Only the real eigenvalues of the action matrix are needed, they are the
+    // real roots of its characteristic polynomial.
+    double eigenvalues[4];
+    const int kNumEigenvalues = FindRealRoots<4>(CharacteristicPolynomial<4>(AM), eigenvalues);
+
+    int num_solutions = 0;
+    for (int i = 0; i < kNumEigenvalues; i++) {
+        const Eigen::Vector4d V = EigenvectorForEigenvalue<4>(AM, eigenvalues[i]);
+        double a2 = std::sqrt(V(1));
+        double b1 = eigenvalues[i], b2 = V(3);
+        solutions->col(num_solutions++) << 1.0, b1, a2, b2 * a2;
     }
 
-    return solutions;
+    return num_solutions;
 }
 
-std::vector<Eigen::Vector<double, 5>> solve_scale_and_shift_shared_focal(const Eigen::Matrix3x4d &x_homo,
-                                                                         const Eigen::Matrix3x4d &y_homo,
-                                                                         const Eigen::Vector4d &depth_x,
-                                                                         const Eigen::Vector4d &depth_y) {
-    Eigen::Matrix<double, 4, 3> x1 = x_homo.transpose();
-    Eigen::Matrix<double, 4, 3> x2 = y_homo.transpose();
-
-    double f1_0 = x1.block<4, 2>(0, 0).cwiseAbs().mean();
-    double f2_0 = x2.block<4, 2>(0, 0).cwiseAbs().mean();
-    double f0 = 0.5 * (f1_0 + f2_0);
-    x1.block<4, 2>(0, 0) /= f0;
-    x2.block<4, 2>(0, 0) /= f0;
+// The coefficients of the polynomial system of
+// solve_scale_and_shift_shared_focal. The image coordinates are normalized by
+// their mean magnitude f0.
+void scale_and_shift_shared_focal_coefficients(const double (&points1)[4][3], const double (&points2)[4][3],
+                                               const double (&depths1)[4], const double (&depths2)[4], double *coeffs,
+                                               double *f0) {
+    double f1_0 = std::abs(points1[0][0]) + std::abs(points1[0][1]);
+    double f2_0 = std::abs(points2[0][0]) + std::abs(points2[0][1]);
+    for (int i = 1; i < 4; i++) {
+        f1_0 += std::abs(points1[i][0]) + std::abs(points1[i][1]);
+        f2_0 += std::abs(points2[i][0]) + std::abs(points2[i][1]);
+    }
+    *f0 = 0.5 * (f1_0 / 8.0 + f2_0 / 8.0);
 
-    const Eigen::Vector4d &d1 = depth_x;
-    const Eigen::Vector4d &d2 = depth_y;
-    Eigen::VectorXd coeffs = Eigen::VectorXd::Zero(32);
+    double x1_data[4][2], x2_data[4][2];
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < 2; j++) {
+            x1_data[i][j] = points1[i][j] / *f0;
+            x2_data[i][j] = points2[i][j] / *f0;
+        }
+    }
+    const auto x1 = [&x1_data](const int i, const int j) -> const double & { return x1_data[i][j]; };
+    const auto x2 = [&x2_data](const int i, const int j) -> const double & { return x2_data[i][j]; };
+    const auto d1 = [&depths1](const int i) -> const double & { return depths1[i]; };
+    const auto d2 = [&depths2](const int i) -> const double & { return depths2[i]; };
 
     coeffs[0] = 2 * x2(0, 0) * x2(1, 0) + 2 * x2(0, 1) * x2(1, 1) - x2(0, 0) * x2(0, 0) - x2(0, 1) * x2(0, 1) -
                 x2(1, 0) * x2(1, 0) - x2(1, 1) * x2(1, 1);
@@ -213,8 +227,11 @@ std::vector<Eigen::Vector<double, 5>> solve_scale_and_shift_shared_focal(const E
                  d1(3) * d1(3) * x1(3, 0) * x1(3, 0) + d1(3) * d1(3) * x1(3, 1) * x1(3, 1) -
                  2 * d1(0) * d1(3) * x1(0, 0) * x1(3, 0) - 2 * d1(0) * d1(3) * x1(0, 1) * x1(3, 1);
     coeffs[31] = d1(0) * d1(0) - 2 * d1(0) * d1(3) + d1(3) * d1(3);
+}
 
-    const std::vector<int> coeff_ind0 = {
+int scale_and_shift_shared_focal_from_coefficients(const double *coeffs, const double f0,
+                                                  Eigen::Matrix<double, 5, 8> *solutions) {
+    static constexpr int kCoeffInd0[] = {
         0,  8,  16, 24, 1,  9,  17, 25, 2,  10, 0,  8,  16, 18, 24, 26, 0,  8,  16, 24, 0,  8,  16, 24, 0,  8,  16, 24,
         1,  9,  17, 25, 1,  9,  17, 25, 3,  11, 2,  10, 18, 19, 26, 27, 4,  12, 2,  1,  10, 9,  20, 18, 17, 28, 26, 25,
         1,  9,  17, 25, 2,  10, 8,  0,  16, 18, 24, 26, 2,  10, 0,  16, 18, 8,  24, 26, 8,  0,  16, 24, 5,  13, 21, 29,
@@ -224,10 +241,10 @@ std::vector<Eigen::Vector<double, 5>> solve_scale_and_shift_shared_focal(const E
         6,  14, 4,  20, 22, 12, 1,  17, 25, 28, 30, 9,  6,  14, 11, 3,  19, 22, 2,  18, 26, 27, 30, 10, 6,  14, 12, 22,
         4,  20, 28, 30, 14, 6,  22, 3,  19, 27, 30, 11, 14, 6,  22, 30, 5,  13, 21, 29, 6,  22, 14, 4,  20, 28, 30, 12,
         7,  15, 23, 31, 5,  13, 21, 29, 7,  15, 23, 31, 7,  15, 5,  13, 23, 21, 31, 29};
-    const std::vector<int> coeff_ind1 = {7,  23, 31, 15, 6,  22, 30, 14, 7,  23, 15, 31, 7,  15, 23,
+    static constexpr int kCoeffInd1[] = {7,  23, 31, 15, 6,  22, 30, 14, 7,  23, 15, 31, 7,  15, 23,
                                          5,  31, 21, 13, 29, 15, 7,  23, 31, 7,  15, 13, 5,  21, 23,
                                          29, 31, 15, 7,  23, 5,  21, 29, 31, 13, 13, 5,  21, 29};
-    const std::vector<int> ind0 = {
+    static constexpr int kInd0[] = {
         0,    1,    14,   30,   36,   37,   50,   66,   72,   73,   74,   78,   80,   86,   87,   102,  111,  115,
         126,  139,  148,  153,  167,  177,  185,  190,  199,  215,  218,  222,  224,  231,  255,  259,  270,  283,
         288,  289,  290,  294,  296,  302,  303,  318,  324,  325,  327,  328,  331,  333,  338,  342,  347,  354,
@@ -242,71 +259,64 @@ std::vector<Eigen::Vector<double, 5>> solve_scale_and_shift_shared_focal(const E
         1000, 1007, 1019, 1024, 1030, 1033, 1034, 1035, 1040, 1042, 1057, 1064, 1065, 1072, 1082, 1086, 1088, 1095,
         1128, 1133, 1140, 1141, 1142, 1143, 1145, 1150, 1155, 1159, 1170, 1183, 1191, 1195, 1206, 1219, 1229, 1234,
         1243, 1259, 1260, 1261, 1265, 1270, 1274, 1279, 1290, 1295};
-    const std::vector<int> ind1 = {25,  26,  27,  34,  61,  62,  63,  70,  84,  89,  96,  101, 110, 114, 116,
+    static constexpr int kInd1[] = {25,  26,  27,  34,  61,  62,  63,  70,  84,  89,  96,  101, 110, 114, 116,
                                    120, 123, 125, 132, 137, 157, 164, 165, 172, 184, 189, 193, 200, 201, 203,
                                    208, 213, 227, 232, 238, 241, 242, 243, 248, 250, 263, 268, 274, 284};
-    Eigen::MatrixXd C0 = Eigen::MatrixXd::Zero(36, 36);
-    Eigen::MatrixXd C1 = Eigen::MatrixXd::Zero(36, 8);
-
-    for (int k = 0; k < ind0.size(); k++) {
-        int i = ind0[k] % 36;
-        int j = ind0[k] / 36;
-        C0(i, j) = coeffs[coeff_ind0[k]];
-    }
+    Eigen::Matrix<double, 36, 36> C0 = Eigen::Matrix<double, 36, 36>::Zero();
+    Eigen::Matrix<double, 36, 8> C1 = Eigen::Matrix<double, 36, 8>::Zero();
+    for (int k = 0; k < static_cast<int>(std::size(kInd0)); k++)
+        C0.data()[kInd0[k]] = coeffs[kCoeffInd0[k]];
+    for (int k = 0; k < static_cast<int>(std::size(kInd1)); k++)
+        C1.data()[kInd1[k]] = coeffs[kCoeffInd1[k]];
 
-    for (int k = 0; k < ind1.size(); k++) {
-        int i = ind1[k] % 36;
-        int j = ind1[k] / 36;
-        C1(i, j) = coeffs[coeff_ind1[k]];
-    }
-
-    Eigen::MatrixXd C2 = C0.fullPivHouseholderQr().solve(C1);
+    const Eigen::Matrix<double, 36, 8> C2 = C0.partialPivLu().solve(C1);
 
     Eigen::Matrix<double, 8, 8> AM;
     AM << Eigen::RowVector<double, 8>(0, 0, 1, 0, 0, 0, 0, 0), -C2.row(31), -C2.row(32), -C2.row(33), -C2.row(34),
         -C2.row(35), Eigen::RowVector<double, 8>(0, 0, 0, 1, 0, 0, 0, 0), -C2.row(30);
 
-    Eigen::EigenSolver<Eigen::Matrix<double, 8, 8>> es(AM);
-    Eigen::Vector<std::complex<double>, 8> D = es.eigenvalues();
-    Eigen::Matrix<std::complex<double>, 8, 8> V = es.eigenvectors();
+    double eigenvalues[8];
+    const int kNumEigenvalues = FindRealRoots<8>(CharacteristicPolynomial<8>(AM), eigenvalues);
 
-    Eigen::MatrixXcd sols = Eigen::MatrixXcd(8, 4);
-    sols.col(0) = V.row(6).array() / V.row(0).array();
-    sols.col(1) = D;
-    sols.col(2) = V.row(4).array() / V.row(0).array();
-    sols.col(3) = V.row(1).array() / V.row(0).array();
-
-    std::vector<Eigen::Vector<double, 5>> solutions;
-    for (int i = 0; i < sols.rows(); i++) {
-        if (D[i].imag() != 0)
-            continue;
-        if (sols(i, 3).real() < 0)
+    int num_solutions = 0;
+    for (int i = 0; i < kNumEigenvalues; i++) {
+        const Eigen::Vector<double, 8> V = EigenvectorForEigenvalue<8>(AM, eigenvalues[i]);
+        const double kFocalSq = V(1);
+        if (kFocalSq < 0)
             continue;
-        double a2 = std::sqrt(sols(i, 0).real());
-        double b1 = sols(i, 1).real(), b2 = sols(i, 2).real();
-        Eigen::Vector<double, 5> sol;
-        sol << 1.0, b1, a2, b2 * a2, f0 / std::sqrt(sols(i, 3).real());
-        solutions.push_back(sol);
+        double a2 = std::sqrt(V(6));
+        double b1 = eigenvalues[i], b2 = V(4);
+        solutions->col(num_solutions++) << 1.0, b1, a2, b2 * a2, f0 / std::sqrt(kFocalSq);
     }
 
-    return solutions;
+    return num_solutions;
 }
 
-std::vector<Eigen::Vector<double, 6>> solve_scale_and_shift_two_focal(const Eigen::Matrix3x4d &x_homo,
-                                                                      const Eigen::Matrix3x4d &y_homo,
-                                                                      const Eigen::Vector4d &depth_x,
-                                                                      const Eigen::Vector4d &depth_y) {
-    Eigen::Matrix<double, 4, 3> x1 = x_homo.transpose();
-    Eigen::Matrix<double, 4, 3> x2 = y_homo.transpose();
-
-    double f1_0 = x1.block<4, 2>(0, 0).cwiseAbs().mean();
-    double f2_0 = x2.block<4, 2>(0, 0).cwiseAbs().mean();
-    x1.block<4, 2>(0, 0) /= f1_0;
-    x2.block<4, 2>(0, 0) /= f2_0;
+// The coefficients of the polynomial system of solve_scale_and_shift_two_focal.
+// The image coordinates of each view are normalized by their mean magnitude.
+void scale_and_shift_two_focal_coefficients(const double (&points1)[4][3], const double (&points2)[4][3],
+                                            const double (&depths1)[4], const double (&depths2)[4], double *coeffs,
+                                            double *f1_0, double *f2_0) {
+    *f1_0 = std::abs(points1[0][0]) + std::abs(points1[0][1]);
+    *f2_0 = std::abs(points2[0][0]) + std::abs(points2[0][1]);
+    for (int i = 1; i < 4; i++) {
+        *f1_0 += std::abs(points1[i][0]) + std::abs(points1[i][1]);
+        *f2_0 += std::abs(points2[i][0]) + std::abs(points2[i][1]);
+    }
+    *f1_0 /= 8.0;
+    *f2_0 /= 8.0;
 
-    const Eigen::Vector4d &d1 = depth_x;
-    const Eigen::Vector4d &d2 = depth_y;
-    Eigen::VectorXd coeffs = Eigen::VectorXd::Zero(40);
+    double x1_data[4][2], x2_data[4][2];
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < 2; j++) {
+            x1_data[i][j] = points1[i][j] / *f1_0;
+            x2_data[i][j] = points2[i][j] / *f2_0;
+        }
+    }
+    const auto x1 = [&x1_data](const int i, const int j) -> const double & { return x1_data[i][j]; };
+    const auto x2 = [&x2_data](const int i, const int j) -> const double & { return x2_data[i][j]; };
+    const auto d1 = [&depths1](const int i) -> const double & { return depths1[i]; };
+    const auto d2 = [&depths2](const int i) -> const double & { return depths2[i]; };
 
     coeffs[0] = 2 * x2(0, 0) * x2(1, 0) + 2 * x2(0, 1) * x2(1, 1) - x2(0, 0) * x2(0, 0) - x2(0, 1) * x2(0, 1) -
                 x2(1, 0) * x2(1, 0) - x2(1, 1) * x2(1, 1);
@@ -398,8 +408,11 @@ std::vector<Eigen::Vector<double, 6>> solve_scale_and_shift_two_focal(const Eige
                  d1(3) * d1(3) * x1(3, 0) * x1(3, 0) + d1(3) * d1(3) * x1(3, 1) * x1(3, 1) -
                  2 * d1(1) * d1(3) * x1(1, 0) * x1(3, 0) - 2 * d1(1) * d1(3) * x1(1, 1) * x1(3, 1);
     coeffs[39] = d1(1) * d1(1) - 2 * d1(1) * d1(3) + d1(3) * d1(3);
+}
 
-    const std::vector<int> coeff_ind0 = {
+int scale_and_shift_two_focal_from_coefficients(const double *coeffs, const double f1_0, const double f2_0,
+                                               Eigen::Matrix<double, 6, 4> *solutions) {
+    static constexpr int kCoeffInd0[] = {
         0,  8,  16, 24, 32, 0,  8,  16, 24, 32, 1,  9,  17, 25, 33, 2,  10, 0,  8,  16, 18, 24, 26, 32, 34, 0,  8,  16,
         24, 32, 1,  9,  17, 25, 33, 2,  10, 8,  0,  16, 18, 24, 26, 32, 34, 8,  0,  16, 24, 32, 1,  9,  17, 25, 33, 3,
         11, 1,  9,  17, 19, 25, 27, 33, 35, 4,  12, 2,  10, 18, 20, 26, 28, 34, 36, 2,  10, 8,  16, 18, 0,  26, 24, 32,
@@ -411,8 +424,8 @@ std::vector<Eigen::Vector<double, 6>> solve_scale_and_shift_two_focal(const Eige
         38, 6,  14, 22, 30, 38, 12, 20, 4,  28, 36, 13, 5,  21, 29, 37, 13, 5,  21, 29, 37, 14, 6,  22, 30, 38, 13, 12,
         21, 5,  4,  28, 29, 37, 36, 20, 7,  15, 23, 31, 39, 14, 22, 6,  30, 38, 13, 5,  29, 37, 21, 15, 7,  23, 31, 39,
         7,  15, 23, 31, 39, 14, 6,  22, 11, 3,  30, 27, 35, 19, 38, 7,  15, 23, 31, 39};
-    const std::vector<int> coeff_ind1 = {15, 7, 31, 39, 23, 15, 7, 23, 31, 39, 14, 6, 30, 38, 22, 15, 23, 7, 31, 39};
-    const std::vector<int> ind0 = {
+    static constexpr int kCoeffInd1[] = {15, 7, 31, 39, 23, 15, 7, 23, 31, 39, 14, 6, 30, 38, 22, 15, 23, 7, 31, 39};
+    static constexpr int kInd0[] = {
         0,    2,    18,   28,   39,   41,   45,   60,   69,   78,   80,   82,   98,   108,  119,  120,  122,  123,
         128,  130,  138,  145,  148,  157,  159,  164,  169,  177,  186,  194,  201,  205,  220,  229,  238,  241,
         245,  246,  252,  254,  260,  263,  269,  276,  278,  287,  293,  302,  310,  313,  323,  328,  330,  345,
@@ -430,68 +443,49 @@ std::vector<Eigen::Vector<double, 6>> solve_scale_and_shift_two_focal(const Eige
         1296, 1299, 1301, 1304, 1307, 1311, 1312, 1315, 1324, 1329, 1337, 1346, 1354, 1371, 1376, 1379, 1387, 1391,
         1415, 1421, 1424, 1432, 1435, 1446, 1452, 1454, 1463, 1476, 1481, 1485, 1500, 1509, 1518, 1526, 1532, 1534,
         1535, 1541, 1543, 1544, 1552, 1555, 1556, 1563, 1568, 1570, 1585, 1597};
-    const std::vector<int> ind1 = {15, 21,  24,  32,  35,  47,  53,  62,  70,  73,
+    static constexpr int kInd1[] = {15, 21,  24,  32,  35,  47,  53,  62,  70,  73,
                                    95, 101, 104, 112, 115, 131, 136, 139, 147, 151};
-    Eigen::MatrixXd C0 = Eigen::MatrixXd::Zero(40, 40);
-    Eigen::MatrixXd C1 = Eigen::MatrixXd::Zero(40, 4);
-
-    for (int k = 0; k < ind0.size(); k++) {
-        int i = ind0[k] % 40;
-        int j = ind0[k] / 40;
-        C0(i, j) = coeffs[coeff_ind0[k]];
-    }
-
-    for (int k = 0; k < ind1.size(); k++) {
-        int i = ind1[k] % 40;
-        int j = ind1[k] / 40;
-        C1(i, j) = coeffs[coeff_ind1[k]];
-    }
+    Eigen::Matrix<double, 40, 40> C0 = Eigen::Matrix<double, 40, 40>::Zero();
+    Eigen::Matrix<double, 40, 4> C1 = Eigen::Matrix<double, 40, 4>::Zero();
+    for (int k = 0; k < static_cast<int>(std::size(kInd0)); k++)
+        C0.data()[kInd0[k]] = coeffs[kCoeffInd0[k]];
+    for (int k = 0; k < static_cast<int>(std::size(kInd1)); k++)
+        C1.data()[kInd1[k]] = coeffs[kCoeffInd1[k]];
 
-    Eigen::MatrixXd C2 = C0.fullPivHouseholderQr().solve(C1);
+    const Eigen::Matrix<double, 40, 4> C2 = C0.partialPivLu().solve(C1);
 
     Eigen::Matrix4d AM;
     AM << -C2.row(36), -C2.row(37), -C2.row(38), -C2.row(39);
 
-    Eigen::EigenSolver<Eigen::Matrix4d> es(AM);
-    Eigen::Vector4cd D = es.eigenvalues();
-    Eigen::Matrix4cd V = es.eigenvectors();
-
-    Eigen::MatrixXcd sols = Eigen::MatrixXcd(4, 5);
-    sols.col(0) = (-C2.row(35) * V).array() / V.row(0).array();
-    sols.col(1) = D;
-    sols.col(2) = V.row(1).array() / V.row(0).array();
-    sols.col(3) = V.row(2).array() / V.row(0).array();
-    sols.col(4) = V.row(3).array() / V.row(0).array();
+    double eigenvalues[4];
+    const int kNumEigenvalues = FindRealRoots<4>(CharacteristicPolynomial<4>(AM), eigenvalues);
 
-    std::vector<Eigen::Vector<double, 6>> solutions;
-    for (int i = 0; i < sols.rows(); i++) {
-        if (D[i].imag() != 0)
+    int num_solutions = 0;
+    for (int i = 0; i < kNumEigenvalues; i++) {
+        const Eigen::Vector4d V = EigenvectorForEigenvalue<4>(AM, eigenvalues[i]);
+        const double kFocal1Sq = V(2), kFocal2Sq = V(3);
+        if (kFocal1Sq < 0 || kFocal2Sq < 0)
             continue;
-        if (sols(i, 3).real() < 0 || sols(i, 4).real() < 0)
-            continue;
-        double a2 = std::sqrt(sols(i, 0).real());
-        double b1 = sols(i, 1).real(), b2 = sols(i, 2).real();
-        Eigen::Vector<double, 6> sol;
-        sol << 1.0, b1, a2, b2 * a2, f1_0 / std::sqrt(sols(i, 3).real()), f2_0 / std::sqrt(sols(i, 4).real());
-        solutions.push_back(sol);
+        double a2 = std::sqrt(-C2.row(35).dot(V));
+        double b1 = eigenvalues[i], b2 = V(1);
+        solutions->col(num_solutions++) << 1.0, b1, a2, b2 * a2, f1_0 / std::sqrt(kFocal1Sq),
+            f2_0 / std::sqrt(kFocal2Sq);
     }
 
-    return solutions;
+    return num_solutions;
 }
 
-int solve_scale_shift_pose(const Eigen::Matrix3d &x_homo, const Eigen::Matrix3d &y_homo, const Eigen::Vector3d &depth_x,
-                           const Eigen::Vector3d &depth_y, std::vector<PoseScaleOffset> *output, bool scale_on_x) {
-    // X: 3 x 3, column vectors are homogeneous 2D points
-    // Y: 3 x 3, column vectors are homogeneous 2D points
-    std::vector<Eigen::Vector4d> solutions;
-    if (scale_on_x)
-        solutions = solve_scale_and_shift(y_homo, x_homo, depth_y, depth_x);
-    else
-        solutions = solve_scale_and_shift(x_homo, y_homo, depth_x, depth_y);
+// Recovers the pose of every solution of solve_scale_and_shift by aligning the
+// back-projected points of both views. Solutions with non-positive depths are
+// discarded.
+int scale_shift_poses(const Eigen::Matrix3d &x_homo, const Eigen::Matrix3d &y_homo, const Eigen::Vector3d &depth_x,
+                      const Eigen::Vector3d &depth_y, const Eigen::Matrix4d &solutions, const int num_solutions,
+                      const bool scale_on_x, ScaleShiftPoses *output) {
     output->clear();
 
     int sol_count = 0;
-    for (auto &sol : solutions) {
+    for (int k = 0; k < num_solutions; k++) {
+        const Eigen::Vector4d sol = solutions.col(k);
         Eigen::Vector3d d1, d2;
         if (scale_on_x) {
             d1 = depth_x.array() * sol(2) + sol(3);
@@ -506,23 +500,9 @@ int solve_scale_shift_pose(const Eigen::Matrix3d &x_homo, const Eigen::Matrix3d
         Eigen::Matrix3d X = x_homo.array().rowwise() * d1.transpose().array();
         Eigen::Matrix3d Y = y_homo.array().rowwise() * d2.transpose().array();
 
-        Eigen::Vector3d centroid_X = X.rowwise().mean();
-        Eigen::Vector3d centroid_Y = Y.rowwise().mean();
-
-        Eigen::MatrixXd X_centered = X.colwise() - centroid_X;
-        Eigen::MatrixXd Y_centered = Y.colwise() - centroid_Y;
-
-        Eigen::Matrix3d S = Y_centered * X_centered.transpose();
-
-        Eigen::JacobiSVD<Eigen::MatrixXd> svd(S, Eigen::ComputeFullU | Eigen::ComputeFullV);
-        Eigen::Matrix3d U = svd.matrixU();
-        Eigen::Matrix3d V = svd.matrixV();
-
-        if (U.determinant() * V.determinant() < 0) {
-            U.col(2) *= -1;
-        }
-        Eigen::Matrix3d R = U * V.transpose();
-        Eigen::Vector3d t = centroid_Y - R * centroid_X;
+        Eigen::Matrix3d R;
+        Eigen::Vector3d t;
+        AlignPoints(X, Y, &R, &t);
 
         double b2 = sol(1), a1 = sol(2), b1 = sol(3);
         if (!scale_on_x)
@@ -533,18 +513,16 @@ int solve_scale_shift_pose(const Eigen::Matrix3d &x_homo, const Eigen::Matrix3d
     return sol_count;
 }
 
-int solve_scale_shift_pose_shared_focal(const Eigen::Matrix3x4d &x_homo, const Eigen::Matrix3x4d &y_homo,
-                                        const Eigen::Vector4d &depth_x, const Eigen::Vector4d &depth_y,
-                                        std::vector<PoseScaleOffsetSharedFocal> *output, bool scale_on_x) {
-    std::vector<Eigen::Vector<double, 5>> solutions;
-    if (scale_on_x)
-        solutions = solve_scale_and_shift_shared_focal(y_homo, x_homo, depth_y, depth_x);
-    else
-        solutions = solve_scale_and_shift_shared_focal(x_homo, y_homo, depth_x, depth_y);
+// As scale_shift_poses, for the solutions of solve_scale_and_shift_shared_focal.
+int scale_shift_poses_shared_focal(const Eigen::Matrix3x4d &x_homo, const Eigen::Matrix3x4d &y_homo,
+                                   const Eigen::Vector4d &depth_x, const Eigen::Vector4d &depth_y,
+                                   const Eigen::Matrix<double, 5, 8> &solutions, const int num_solutions,
+                                   const bool scale_on_x, ScaleShiftSharedFocalPoses *output) {
     output->clear();
 
     int sol_count = 0;
-    for (auto &sol : solutions) {
+    for (int k = 0; k < num_solutions; k++) {
+        const Eigen::Vector<double, 5> sol = solutions.col(k);
         Eigen::Vector4d d1, d2;
         if (scale_on_x) {
             d1 = depth_x.array() * sol(2) + sol(3);
@@ -565,23 +543,9 @@ int solve_scale_shift_pose_shared_focal(const Eigen::Matrix3x4d &x_homo, const E
         Eigen::Matrix3x4d X = xu.array().rowwise() * d1.transpose().array();
         Eigen::Matrix3x4d Y = yu.array().rowwise() * d2.transpose().array();
 
-        Eigen::Vector3d centroid_X = X.rowwise().mean();
-        Eigen::Vector3d centroid_Y = Y.rowwise().mean();
-
-        Eigen::MatrixXd X_centered = X.colwise() - centroid_X;
-        Eigen::MatrixXd Y_centered = Y.colwise() - centroid_Y;
-
-        Eigen::Matrix3d S = Y_centered * X_centered.transpose();
-
-        Eigen::JacobiSVD<Eigen::MatrixXd> svd(S, Eigen::ComputeFullU | Eigen::ComputeFullV);
-        Eigen::Matrix3d U = svd.matrixU();
-        Eigen::Matrix3d V = svd.matrixV();
-
-        if (U.determinant() * V.determinant() < 0) {
-            U.col(2) *= -1;
-        }
-        Eigen::Matrix3d R = U * V.transpose();
-        Eigen::Vector3d t = centroid_Y - R * centroid_X;
+        Eigen::Matrix3d R;
+        Eigen::Vector3d t;
+        AlignPoints(X, Y, &R, &t);
 
         double b2 = sol(1), a1 = sol(2), b1 = sol(3), f = sol(4);
         if (!scale_on_x)
@@ -592,18 +556,16 @@ int solve_scale_shift_pose_shared_focal(const Eigen::Matrix3x4d &x_homo, const E
     return sol_count;
 }
 
-int solve_scale_shift_pose_two_focal(const Eigen::Matrix3x4d &x_homo, const Eigen::Matrix3x4d &y_homo,
-                                     const Eigen::Vector4d &depth_x, const Eigen::Vector4d &depth_y,
-                                     std::vector<PoseScaleOffsetTwoFocal> *output, bool scale_on_x) {
-    std::vector<Eigen::Vector<double, 6>> solutions;
-    if (scale_on_x)
-        solutions = solve_scale_and_shift_two_focal(y_homo, x_homo, depth_y, depth_x);
-    else
-        solutions = solve_scale_and_shift_two_focal(x_homo, y_homo, depth_x, depth_y);
+// As scale_shift_poses, for the solutions of solve_scale_and_shift_two_focal.
+int scale_shift_poses_two_focal(const Eigen::Matrix3x4d &x_homo, const Eigen::Matrix3x4d &y_homo,
+                                const Eigen::Vector4d &depth_x, const Eigen::Vector4d &depth_y,
+                                const Eigen::Matrix<double, 6, 4> &solutions, const int num_solutions,
+                                const bool scale_on_x, ScaleShiftTwoFocalPoses *output) {
     output->clear();
 
     int sol_count = 0;
-    for (auto &sol : solutions) {
+    for (int k = 0; k < num_solutions; k++) {
+        const Eigen::Vector<double, 6> sol = solutions.col(k);
         Eigen::Vector4d d1, d2;
         if (scale_on_x) {
             d1 = depth_x.array() * sol(2) + sol(3);
@@ -624,23 +586,9 @@ int solve_scale_shift_pose_two_focal(const Eigen::Matrix3x4d &x_homo, const Eige
         Eigen::Matrix3x4d X = xu.array().rowwise() * d1.transpose().array();
         Eigen::Matrix3x4d Y = yu.array().rowwise() * d2.transpose().array();
 
-        Eigen::Vector3d centroid_X = X.rowwise().mean();
-        Eigen::Vector3d centroid_Y = Y.rowwise().mean();
-
-        Eigen::MatrixXd X_centered = X.colwise() - centroid_X;
-        Eigen::MatrixXd Y_centered = Y.colwise() - centroid_Y;
-
-        Eigen::Matrix3d S = Y_centered * X_centered.transpose();
-
-        Eigen::JacobiSVD<Eigen::MatrixXd> svd(S, Eigen::ComputeFullU | Eigen::ComputeFullV);
-        Eigen::Matrix3d U = svd.matrixU();
-        Eigen::Matrix3d V = svd.matrixV();
-
-        if (U.determinant() * V.determinant() < 0) {
-            U.col(2) *= -1;
-        }
-        Eigen::Matrix3d R = U * V.transpose();
-        Eigen::Vector3d t = centroid_Y - R * centroid_X;
+        Eigen::Matrix3d R;
+        Eigen::Vector3d t;
+        AlignPoints(X, Y, &R, &t);
 
         double b2 = sol(1), a1 = sol(2), b1 = sol(3), f1 = sol(4), f2 = sol(5);
         if (!scale_on_x)
@@ -651,31 +599,137 @@ int solve_scale_shift_pose_two_focal(const Eigen::Matrix3x4d &x_homo, const Eige
     return sol_count;
 }
 
+} // namespace
+
+int solve_scale_and_shift(const Eigen::Matrix3d &x_homo, const Eigen::Matrix3d &y_homo, const Eigen::Vector3d &depth_x,
+                          const Eigen::Vector3d &depth_y, Eigen::Matrix4d *solutions) {
+    double x1[3][3], x2[3][3], d1[3], d2[3];
+    unpack_sample(x_homo, y_homo, depth_x, depth_y, x1, x2, d1, d2);
+    double coeffs[18];
+    scale_and_shift_coefficients(x1, x2, d1, d2, coeffs);
+    return scale_and_shift_from_coefficients(coeffs, solutions);
+}
+
+std::vector<Eigen::Vector4d> solve_scale_and_shift_wrapper(const Eigen::Matrix3d &x_homo,
+                                                           const Eigen::Matrix3d &y_homo,
+                                                           const Eigen::Vector3d &depth_x,
+                                                           const Eigen::Vector3d &depth_y) {
+    Eigen::Matrix4d solutions;
+    int sol_num = solve_scale_and_shift(x_homo, y_homo, depth_x, depth_y, &solutions);
+    std::vector<Eigen::Vector4d> output(sol_num);
+    for (int i = 0; i < sol_num; i++)
+        output[i] = solutions.col(i);
+    return output;
+}
+
+int solve_scale_and_shift_shared_focal(const Eigen::Matrix3x4d &x_homo, const Eigen::Matrix3x4d &y_homo,
+                                       const Eigen::Vector4d &depth_x, const Eigen::Vector4d &depth_y,
+                                       Eigen::Matrix<double, 5, 8> *solutions) {
+    double x1[4][3], x2[4][3], d1[4], d2[4];
+    unpack_sample(x_homo, y_homo, depth_x, depth_y, x1, x2, d1, d2);
+    double coeffs[32], f0;
+    scale_and_shift_shared_focal_coefficients(x1, x2, d1, d2, coeffs, &f0);
+    return scale_and_shift_shared_focal_from_coefficients(coeffs, f0, solutions);
+}
+
+std::vector<Eigen::Vector<double, 5>> solve_scale_and_shift_shared_focal_wrapper(const Eigen::Matrix3x4d &x_homo,
+                                                                                 const Eigen::Matrix3x4d &y_homo,
+                                                                                 const Eigen::Vector4d &depth_x,
+                                                                                 const Eigen::Vector4d &depth_y) {
+    Eigen::Matrix<double, 5, 8> solutions;
+    int sol_num = solve_scale_and_shift_shared_focal(x_homo, y_homo, depth_x, depth_y, &solutions);
+    std::vector<Eigen::Vector<double, 5>> output(sol_num);
+    for (int i = 0; i < sol_num; i++)
+        output[i] = solutions.col(i);
+    return output;
+}
+
+int solve_scale_and_shift_two_focal(const Eigen::Matrix3x4d &x_homo, const Eigen::Matrix3x4d &y_homo,
+                                    const Eigen::Vector4d &depth_x, const Eigen::Vector4d &depth_y,
+                                    Eigen::Matrix<double, 6, 4> *solutions) {
+    double x1[4][3], x2[4][3], d1[4], d2[4];
+    unpack_sample(x_homo, y_homo, depth_x, depth_y, x1, x2, d1, d2);
+    double coeffs[40], f1_0, f2_0;
+    scale_and_shift_two_focal_coefficients(x1, x2, d1, d2, coeffs, &f1_0, &f2_0);
+    return scale_and_shift_two_focal_from_coefficients(coeffs, f1_0, f2_0, solutions);
+}
+
+std::vector<Eigen::Vector<double, 6>> solve_scale_and_shift_two_focal_wrapper(const Eigen::Matrix3x4d &x_homo,
+                                                                              const Eigen::Matrix3x4d &y_homo,
+                                                                              const Eigen::Vector4d &depth_x,
+                                                                              const Eigen::Vector4d &depth_y) {
+    Eigen::Matrix<double, 6, 4> solutions;
+    int sol_num = solve_scale_and_shift_two_focal(x_homo, y_homo, depth_x, depth_y, &solutions);
+    std::vector<Eigen::Vector<double, 6>> output(sol_num);
+    for (int i = 0; i < sol_num; i++)
+        output[i] = solutions.col(i);
+    return output;
+}
+
+int solve_scale_shift_pose(const Eigen::Matrix3d &x_homo, const Eigen::Matrix3d &y_homo, const Eigen::Vector3d &depth_x,
+                           const Eigen::Vector3d &depth_y, ScaleShiftPoses *output, bool scale_on_x) {
+    // X: 3 x 3, column vectors are homogeneous 2D points
+    // Y: 3 x 3, column vectors are homogeneous 2D points
+    Eigen::Matrix4d solutions;
+    int num_solutions;
+    if (scale_on_x)
+        num_solutions = solve_scale_and_shift(y_homo, x_homo, depth_y, depth_x, &solutions);
+    else
+        num_solutions = solve_scale_and_shift(x_homo, y_homo, depth_x, depth_y, &solutions);
+    return scale_shift_poses(x_homo, y_homo, depth_x, depth_y, solutions, num_solutions, scale_on_x, output);
+}
+
+int solve_scale_shift_pose_shared_focal(const Eigen::Matrix3x4d &x_homo, const Eigen::Matrix3x4d &y_homo,
+                                        const Eigen::Vector4d &depth_x, const Eigen::Vector4d &depth_y,
+                                        ScaleShiftSharedFocalPoses *output, bool scale_on_x) {
+    Eigen::Matrix<double, 5, 8> solutions;
+    int num_solutions;
+    if (scale_on_x)
+        num_solutions = solve_scale_and_shift_shared_focal(y_homo, x_homo, depth_y, depth_x, &solutions);
+    else
+        num_solutions = solve_scale_and_shift_shared_focal(x_homo, y_homo, depth_x, depth_y, &solutions);
+    return scale_shift_poses_shared_focal(x_homo, y_homo, depth_x, depth_y, solutions, num_solutions, scale_on_x,
+                                          output);
+}
+
+int solve_scale_shift_pose_two_focal(const Eigen::Matrix3x4d &x_homo, const Eigen::Matrix3x4d &y_homo,
+                                     const Eigen::Vector4d &depth_x, const Eigen::Vector4d &depth_y,
+                                     ScaleShiftTwoFocalPoses *output, bool scale_on_x) {
+    Eigen::Matrix<double, 6, 4> solutions;
+    int num_solutions;
+    if (scale_on_x)
+        num_solutions = solve_scale_and_shift_two_focal(y_homo, x_homo, depth_y, depth_x, &solutions);
+    else
+        num_solutions = solve_scale_and_shift_two_focal(x_homo, y_homo, depth_x, depth_y, &solutions);
+    return scale_shift_poses_two_focal(x_homo, y_homo, depth_x, depth_y, solutions, num_solutions, scale_on_x,
+                                       output);
+}
+
 std::vector<PoseScaleOffset> solve_scale_shift_pose_wrapper(const Eigen::Matrix3d &x_homo,
                                                             const Eigen::Matrix3d &y_homo,
                                                             const Eigen::Vector3d &depth_x,
                                                             const Eigen::Vector3d &depth_y) {
-    std::vector<PoseScaleOffset> output;
-    int sol_num = solve_scale_shift_pose(x_homo, y_homo, depth_x, depth_y, &output);
-    return output;
+    ScaleShiftPoses poses;
+    solve_scale_shift_pose(x_homo, y_homo, depth_x, depth_y, &poses);
+    return std::vector<PoseScaleOffset>(poses.begin(), poses.end());
 }
 
 std::vector<PoseScaleOffsetSharedFocal> solve_scale_shift_pose_shared_focal_wrapper(const Eigen::Matrix3x4d &x_homo,
                                                                                     const Eigen::Matrix3x4d &y_homo,
                                                                                     const Eigen::Vector4d &depth_x,
                                                                                     const Eigen::Vector4d &depth_y) {
-    std::vector<PoseScaleOffsetSharedFocal> output;
-    int sol_num = solve_scale_shift_pose_shared_focal(x_homo, y_homo, depth_x, depth_y, &output);
-    return output;
+    ScaleShiftSharedFocalPoses poses;
+    solve_scale_shift_pose_shared_focal(x_homo, y_homo, depth_x, depth_y, &poses);
+    return std::vector<PoseScaleOffsetSharedFocal>(poses.begin(), poses.end());
 }
 
 std::vector<PoseScaleOffsetTwoFocal> solve_scale_shift_pose_two_focal_wrapper(const Eigen::Matrix3x4d &x_homo,
                                                                               const Eigen::Matrix3x4d &y_homo,
                                                                               const Eigen::Vector4d &depth_x,
                                                                               const Eigen::Vector4d &depth_y) {
-    std::vector<PoseScaleOffsetTwoFocal> output;
-    int sol_num = solve_scale_shift_pose_two_focal(x_homo, y_homo, depth_x, depth_y, &output);
-    return output;
+    ScaleShiftTwoFocalPoses poses;
+    solve_scale_shift_pose_two_focal(x_homo, y_homo, depth_x, depth_y, &poses);
+    return std::vector<PoseScaleOffsetTwoFocal>(poses.begin(), poses.end());
 }
 
 }; // namespace madpose
\ No newline at end of file
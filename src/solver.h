@@ -1,5 +1,6 @@
 #pragma once
 
+#include "inline_vector.h"
 #include "pose.h"
 #include "utils.h"
 
@@ -9,35 +10,63 @@ namespace madpose {
 
 PoseAndScale estimate_scale_and_pose(const Eigen::MatrixXd &X, const Eigen::MatrixXd &Y, const Eigen::VectorXd &W);
 
+// Unweighted estimate_scale_and_pose of 3 points. Does not allocate.
+PoseAndScale estimate_scale_and_pose(const Eigen::Matrix3d &X, const Eigen::Matrix3d &Y);
+
 std::vector<PoseScaleOffset> estimate_scale_and_pose_with_offset_3pts_wrap(const Eigen::Matrix3d &x_homo,
                                                                            const Eigen::Matrix3d &y_homo,
                                                                            const Eigen::Vector3d &depth_x,
                                                                            const Eigen::Vector3d &depth_y);
 
-std::vector<Eigen::Vector4d> solve_scale_and_shift(const Eigen::Matrix3d &x_homo, const Eigen::Matrix3d &y_homo,
-                                                   const Eigen::Vector3d &depth_x, const Eigen::Vector3d &depth_y);
+// The poses recovered from the solutions of the scale and shift solvers, at
+// most as many as the degree of the solver.
+typedef InlineVector<PoseScaleOffset, 4> ScaleShiftPoses;
+typedef InlineVector<PoseScaleOffsetSharedFocal, 8> ScaleShiftSharedFocalPoses;
+typedef InlineVector<PoseScaleOffsetTwoFocal, 4> ScaleShiftTwoFocalPoses;
+
+// Solves for the scale and shifts of 3 point correspondences with depths.
+// Writes the real solutions to the columns of solutions and returns their
+// number. Does not allocate.
+int solve_scale_and_shift(const Eigen::Matrix3d &x_homo, const Eigen::Matrix3d &y_homo, const Eigen::Vector3d &depth_x,
+                          const Eigen::Vector3d &depth_y, Eigen::Matrix4d *solutions);
 
-std::vector<Eigen::Vector<double, 5>> solve_scale_and_shift_shared_focal(const Eigen::Matrix3x4d &x_homo,
-                                                                         const Eigen::Matrix3x4d &y_homo,
-                                                                         const Eigen::Vector4d &depth_x,
-                                                                         const Eigen::Vector4d &depth_y);
+// Solves for the scale, shifts and shared focal length of 4 point
+// correspondences with depths. Writes the real solutions to the columns of
+// solutions and returns their number. Does not allocate.
+int solve_scale_and_shift_shared_focal(const Eigen::Matrix3x4d &x_homo, const Eigen::Matrix3x4d &y_homo,
+                                       const Eigen::Vector4d &depth_x, const Eigen::Vector4d &depth_y,
+                                       Eigen::Matrix<double, 5, 8> *solutions);
 
-std::vector<Eigen::Vector<double, 6>> solve_scale_and_shift_two_focal(const Eigen::Matrix3x4d &x_homo,
-                                                                      const Eigen::Matrix3x4d &y_homo,
-                                                                      const Eigen::Vector4d &depth_x,
-                                                                      const Eigen::Vector4d &depth_y);
+// As solve_scale_and_shift_shared_focal, but with a focal length per camera.
+int solve_scale_and_shift_two_focal(const Eigen::Matrix3x4d &x_homo, const Eigen::Matrix3x4d &y_homo,
+                                    const Eigen::Vector4d &depth_x, const Eigen::Vector4d &depth_y,
+                                    Eigen::Matrix<double, 6, 4> *solutions);
 
 int solve_scale_shift_pose(const Eigen::Matrix3d &x_homo, const Eigen::Matrix3d &y_homo, const Eigen::Vector3d &depth_x,
-                           const Eigen::Vector3d &depth_y, std::vector<PoseScaleOffset> *output,
-                           bool scale_on_x = false);
+                           const Eigen::Vector3d &depth_y, ScaleShiftPoses *output, bool scale_on_x = false);
 
 int solve_scale_shift_pose_shared_focal(const Eigen::Matrix3x4d &x_homo, const Eigen::Matrix3x4d &y_homo,
                                         const Eigen::Vector4d &depth_x, const Eigen::Vector4d &depth_y,
-                                        std::vector<PoseScaleOffsetSharedFocal> *output, bool scale_on_x = false);
+                                        ScaleShiftSharedFocalPoses *output, bool scale_on_x = false);
 
 int solve_scale_shift_pose_two_focal(const Eigen::Matrix3x4d &x_homo, const Eigen::Matrix3x4d &y_homo,
                                      const Eigen::Vector4d &depth_x, const Eigen::Vector4d &depth_y,
-                                     std::vector<PoseScaleOffsetTwoFocal> *output, bool scale_on_x = false);
+                                     ScaleShiftTwoFocalPoses *output, bool scale_on_x = false);
+
+std::vector<Eigen::Vector4d> solve_scale_and_shift_wrapper(const Eigen::Matrix3d &x_homo,
+                                                           const Eigen::Matrix3d &y_homo,
+                                                           const Eigen::Vector3d &depth_x,
+                                                           const Eigen::Vector3d &depth_y);
+
+std::vector<Eigen::Vector<double, 5>> solve_scale_and_shift_shared_focal_wrapper(const Eigen::Matrix3x4d &x_homo,
+                                                                                 const Eigen::Matrix3x4d &y_homo,
+                                                                                 const Eigen::Vector4d &depth_x,
+                                                                                 const Eigen::Vector4d &depth_y);
+
+std::vector<Eigen::Vector<double, 6>> solve_scale_and_shift_two_focal_wrapper(const Eigen::Matrix3x4d &x_homo,
+                                                                              const Eigen::Matrix3x4d &y_homo,
+                                                                              const Eigen::Vector4d &depth_x,
+                                                                              const Eigen::Vector4d &depth_y);
 
 std::vector<PoseScaleOffset> solve_scale_shift_pose_wrapper(const Eigen::Matrix3d &x_homo,
                                                             const Eigen::Matrix3d &y_homo,
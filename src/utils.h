@@ -20,37 +20,65 @@ using Matrix3x4d = Matrix<double, 3, 4>;
 namespace py = pybind11;
 namespace madpose {
 
-// -------- Triangulation functions from COLMAP 3.9 --------
-inline Eigen::Vector3d TriangulatePoint(const Eigen::Matrix3x4d &cam1_from_world,
-                                        const Eigen::Matrix3x4d &cam2_from_world, const Eigen::Vector2d &point1,
-                                        const Eigen::Vector2d &point2) {
-    Eigen::Matrix4d A;
-
-    A.row(0) = point1(0) * cam1_from_world.row(2) - cam1_from_world.row(0);
-    A.row(1) = point1(1) * cam1_from_world.row(2) - cam1_from_world.row(1);
-    A.row(2) = point2(0) * cam2_from_world.row(2) - cam2_from_world.row(0);
-    A.row(3) = point2(1) * cam2_from_world.row(2) - cam2_from_world.row(1);
-
-    Eigen::JacobiSVD<Eigen::Matrix4d> svd(A, Eigen::ComputeFullV);
-
-    return svd.matrixV().col(3).hnormalized();
+// Depths of the two-view triangulation of the correspondences (x0_i, x1_i),
+// given in calibrated homogeneous coordinates, between the cameras [I | 0] and
+// [R | t]: depth0_i * x0_i and depth1_i * x1_i are the closest points of the
+// two viewing rays in the respective camera frames. Solves the 2 x 2 normal
+// equations of all points at once.
+template <int N>
+inline void TriangulateDepths(const Eigen::Matrix3d &R, const Eigen::Vector3d &t, const Eigen::Matrix<double, 3, N> &x0,
+                              const Eigen::Matrix<double, 3, N> &x1, Eigen::Matrix<double, N, 1> *depth0,
+                              Eigen::Matrix<double, N, 1> *depth1) {
+    const Eigen::Matrix<double, 3, N> Rx0 = R * x0;
+    const Eigen::Array<double, 1, N> kAA = Rx0.colwise().squaredNorm().array();
+    const Eigen::Array<double, 1, N> kBB = x1.colwise().squaredNorm().array();
+    const Eigen::Array<double, 1, N> kAB = Rx0.cwiseProduct(x1).colwise().sum().array();
+    const Eigen::Array<double, 1, N> kAT = (t.transpose() * Rx0).array();
+    const Eigen::Array<double, 1, N> kBT = (t.transpose() * x1).array();
+    const Eigen::Array<double, 1, N> kDet = kAA * kBB - kAB * kAB;
+    *depth0 = ((kAB * kBT - kBB * kAT) / kDet).matrix().transpose();
+    *depth1 = ((kAA * kBT - kAB * kAT) / kDet).matrix().transpose();
 }
 
-inline std::vector<Eigen::Vector3d> TriangulatePoints(const Eigen::Matrix3x4d &cam1_from_world,
-                                                      const Eigen::Matrix3x4d &cam2_from_world,
-                                                      const std::vector<Eigen::Vector2d> &points1,
-                                                      const std::vector<Eigen::Vector2d> &points2) {
-    CHECK_EQ(points1.size(), points2.size());
-
-    std::vector<Eigen::Vector3d> points3D(points1.size());
-
-    for (size_t i = 0; i < points3D.size(); ++i) {
-        points3D[i] = TriangulatePoint(cam1_from_world, cam2_from_world, points1[i], points2[i]);
+// Least squares fit of target_i = scale * (depth_i + offset), or of
+// target_i = scale * depth_i if use_shift is false, by the closed-form solution
+// of the 2 x 2 normal equations.
+template <int N>
+inline void FitScaleOffset(const Eigen::Matrix<double, N, 1> &depth, const Eigen::Matrix<double, N, 1> &target,
+                           const bool use_shift, double *scale, double *offset) {
+    const double kDD = depth.squaredNorm();
+    const double kDT = depth.dot(target);
+    if (!use_shift) {
+        *scale = kDT / kDD;
+        *offset = 0.0;
+        return;
     }
+    const double kD = depth.sum();
+    const double kT = target.sum();
+    const double kDet = N * kDD - kD * kD;
+    *scale = (N * kDT - kD * kT) / kDet;
+    *offset = (kDD * kT - kD * kDT) / kDet / *scale;
+}
 
-    return points3D;
+// Aligns the depth priors of a minimal sample with its triangulation under the
+// relative pose [R | t] estimated by an epipolar solver. depth0 is fitted to
+// the triangulated depths in the first camera as s0 * (depth0 + offset0),
+// which fixes the scale of the reconstruction, and depth1 to the depths in the
+// second camera of the reconstruction divided by s0 as
+// scale * (depth1 + offset1). Returns s0, by which t is to be divided.
+template <int N>
+inline double FitDepthsToTriangulation(const Eigen::Matrix3d &R, const Eigen::Vector3d &t,
+                                       const Eigen::Matrix<double, 3, N> &x0, const Eigen::Matrix<double, 3, N> &x1,
+                                       const Eigen::Matrix<double, N, 1> &depth0,
+                                       const Eigen::Matrix<double, N, 1> &depth1, const bool use_shift,
+                                       double *offset0, double *scale, double *offset1) {
+    Eigen::Matrix<double, N, 1> tri_depth0, tri_depth1;
+    TriangulateDepths(R, t, x0, x1, &tri_depth0, &tri_depth1);
+    double s0;
+    FitScaleOffset(depth0, tri_depth0, use_shift, &s0, offset0);
+    FitScaleOffset(depth1, Eigen::Matrix<double, N, 1>(tri_depth1 / s0), use_shift, scale, offset1);
+    return s0;
 }
-// ---------------------------------------------------------
 
 inline Eigen::Matrix3d to_essential_matrix(Eigen::Matrix3d R, Eigen::Vector3d t) {
     Eigen::Matrix3d E;
@@ -59,6 +87,56 @@ inline Eigen::Matrix3d to_essential_matrix(Eigen::Matrix3d R, Eigen::Vector3d t)
     return E;
 }
 
+// Decomposes the essential matrix E into the relative pose [R | t], with unit
+// t, that places the most of the correspondences (x0_i, x1_i) in front of both
+// cameras. The points are calibrated homogeneous coordinates. The four
+// candidates are tried in the same order as cv::recoverPose, and the depths are
+// those of the midpoint triangulation as in PoseLib's cheirality check. Returns
+// the number of points in front of both cameras for the selected pose.
+template <int N>
+int RelativePoseFromEssential(const Eigen::Matrix3d &E, const Eigen::Matrix<double, 3, N> &x0,
+                              const Eigen::Matrix<double, 3, N> &x1, Eigen::Matrix3d *R, Eigen::Vector3d *t) {
+    const Eigen::JacobiSVD<Eigen::Matrix3d> svd(E, Eigen::ComputeFullU | Eigen::ComputeFullV);
+    Eigen::Matrix3d U = svd.matrixU();
+    Eigen::Matrix3d V = svd.matrixV();
+    if (U.determinant() < 0.0)
+        U = -U;
+    if (V.determinant() < 0.0)
+        V = -V;
+
+    Eigen::Matrix3d W;
+    W << 0.0, 1.0, 0.0, -1.0, 0.0, 0.0, 0.0, 0.0, 1.0;
+    const Eigen::Matrix3d kRotations[2] = {U * W * V.transpose(), U * W.transpose() * V.transpose()};
+    const Eigen::Vector3d kTranslation = U.col(2);
+
+    int best_num_in_front = -1;
+    for (int k = 0; k < 4; ++k) {
+        const Eigen::Matrix3d &kR = kRotations[k % 2];
+        const Eigen::Vector3d kT = k < 2 ? kTranslation : Eigen::Vector3d(-kTranslation);
+
+        int num_in_front = 0;
+        for (int i = 0; i < N; ++i) {
+            // Depths (lambda0, lambda1) minimizing ||lambda0 R x0 + t -
+            // lambda1 x1||, up to the positive determinant of the normal
+            // equations.
+            const Eigen::Vector3d kRx0 = kR * x0.col(i);
+            const double kA = kRx0.dot(x1.col(i));
+            const double kB0 = kRx0.dot(kT);
+            const double kB1 = x1.col(i).dot(kT);
+            const double kLambda0 = kA * kB1 - x1.col(i).squaredNorm() * kB0;
+            const double kLambda1 = kRx0.squaredNorm() * kB1 - kA * kB0;
+            if (kLambda0 > 0.0 && kLambda1 > 0.0)
+                ++num_in_front;
+        }
+        if (num_in_front > best_num_in_front) {
+            best_num_in_front = num_in_front;
+            *R = kR;
+            *t = kT;
+        }
+    }
+    return best_num_in_front;
+}
+
 inline double compute_sampson_error(const Eigen::Vector2d &x1, const Eigen::Vector2d &x2, const Eigen::Matrix3d &E) {
     // For some reason this is a lot faster than just using nice Eigen
     // expressions...
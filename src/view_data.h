@@ -0,0 +1,51 @@
+#pragma once
+
+#include <Eigen/Core>
+#include <vector>
+
+namespace madpose {
+
+// Structure-of-arrays storage of the keypoints of one image. Every quantity
+// is precomputed once and kept in its own contiguous column, so that scoring
+// loops over large sets of correspondences stream through the data instead
+// of re-deriving it per evaluation.
+struct ViewData {
+    // Pixel coordinates.
+    Eigen::VectorXd u, v;
+    // Calibrated coordinates, i.e. K^-1 * [u, v, 1]^T.
+    Eigen::VectorXd x, y;
+    // Unit bearing vectors along [x, y, 1]^T.
+    Eigen::VectorXd bx, by, bz;
+
+    ViewData() {}
+
+    ViewData(const std::vector<Eigen::Vector2d> &points, const Eigen::Matrix3d &K_inv = Eigen::Matrix3d::Identity()) {
+        const int kNumPoints = points.size();
+        u.resize(kNumPoints);
+        v.resize(kNumPoints);
+        x.resize(kNumPoints);
+        y.resize(kNumPoints);
+        bx.resize(kNumPoints);
+        by.resize(kNumPoints);
+        bz.resize(kNumPoints);
+        for (int i = 0; i < kNumPoints; i++) {
+            u(i) = points[i](0);
+            v(i) = points[i](1);
+            Eigen::Vector3d calib = K_inv * points[i].homogeneous();
+            x(i) = calib(0);
+            y(i) = calib(1);
+            Eigen::Vector3d bearing = calib.normalized();
+            bx(i) = bearing(0);
+            by(i) = bearing(1);
+            bz(i) = bearing(2);
+        }
+    }
+
+    inline int size() const { return u.size(); }
+
+    inline Eigen::Vector2d pixel(int i) const { return Eigen::Vector2d(u(i), v(i)); }
+    inline Eigen::Vector3d calibrated(int i) const { return Eigen::Vector3d(x(i), y(i), 1.0); }
+    inline Eigen::Vector3d bearing(int i) const { return Eigen::Vector3d(bx(i), by(i), bz(i)); }
+};
+
+} // namespace madpose
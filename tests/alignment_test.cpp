@@ -0,0 +1,146 @@
+// Checks the rigid alignment in alignment.h on noise-free minimal samples of
+// 3 and 4 points, including rotations by (nearly) 180 degrees, where the
+// scalar part of the quaternion vanishes, and nearly collinear points, where
+// the two largest eigenvalues of Horn's matrix are close. Exits with a
+// non-zero status if a recovered pose differs from the true one.
+
+#include "alignment.h"
+
+#include <Eigen/Dense>
+#include <Eigen/Geometry>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace madpose {
+namespace {
+
+constexpr int kNumTrials = 2000;
+constexpr double kTolerance = 1e-12;
+// Nearly collinear points only determine the rotation to about eps / spread^2.
+constexpr double kCollinearSpread = 1e-3;
+constexpr double kCollinearTolerance = 1e-7;
+
+class AlignmentTest {
+  public:
+    AlignmentTest() : rng_(0) {}
+
+    void TestRotations(const int num_points) {
+        const std::string kSuffix = " (" + std::to_string(num_points) + " points)";
+        std::uniform_real_distribution<double> angle(0.0, M_PI);
+        std::uniform_real_distribution<double> exponent(-8.0, 0.0);
+        Check("generic rotation" + kSuffix, WellConditionedPoints(num_points), RandomRotation(angle(rng_)),
+              kTolerance);
+        Check("180 degree rotation" + kSuffix, WellConditionedPoints(num_points), RandomRotation(M_PI), kTolerance);
+        Check("nearly 180 degree rotation" + kSuffix, WellConditionedPoints(num_points),
+              RandomRotation(M_PI - std::pow(10.0, exponent(rng_))), kTolerance);
+
+        // Evenly spaced points on a random line, pushed off it by a small
+        // amount in evenly spread directions.
+        const Eigen::Matrix3d kBasis = RandomRotation(angle(rng_));
+        const Eigen::Vector3d kOrigin = RandomPoints(1);
+        Eigen::Matrix3Xd X(3, num_points);
+        for (int i = 0; i < num_points; ++i) {
+            const double kAngle = 2.0 * M_PI * i / num_points;
+            const Eigen::Vector3d kOffset(i - 0.5 * (num_points - 1), kCollinearSpread * std::cos(kAngle),
+                                          kCollinearSpread * std::sin(kAngle));
+            X.col(i) = kOrigin + kBasis * kOffset;
+        }
+        Check("nearly collinear points" + kSuffix, X, RandomRotation(angle(rng_)), kCollinearTolerance);
+    }
+
+    // The rotations by 180 degrees about the coordinate axes.
+    void TestAxisFlips() {
+        const Eigen::Vector3d kDiagonals[] = {{1.0, -1.0, -1.0}, {-1.0, 1.0, -1.0}, {-1.0, -1.0, 1.0}};
+        for (const Eigen::Vector3d &diagonal : kDiagonals) {
+            Check("180 degree rotation about an axis (3 points)", WellConditionedPoints(3),
+                  diagonal.asDiagonal().toDenseMatrix(), kTolerance);
+        }
+    }
+
+    // Prints the largest error of each case and returns the number of cases
+    // above their tolerance.
+    int Report() const {
+        int num_failures = 0;
+        for (const Result &result : results_) {
+            const bool kPassed = result.max_error <= result.tolerance;
+            std::printf("%-56s max error %.3g %s\n", result.name.c_str(), result.max_error, kPassed ? "OK" : "FAILED");
+            num_failures += kPassed ? 0 : 1;
+        }
+        return num_failures;
+    }
+
+  private:
+    struct Result {
+        std::string name;
+        double tolerance;
+        double max_error;
+    };
+
+    // Aligns X to R X + t for a random t and records the error of the
+    // recovered pose.
+    void Check(const std::string &name, const Eigen::Matrix3Xd &X, const Eigen::Matrix3d &R, const double tolerance) {
+        const Eigen::Vector3d t = RandomPoints(1);
+        const Eigen::Matrix3Xd Y = (R * X).colwise() + t;
+        Eigen::Matrix3d R_est;
+        Eigen::Vector3d t_est;
+        AlignPoints(X, Y, &R_est, &t_est);
+        double error = std::max((R_est - R).norm(), (t_est - t).norm());
+        if (!std::isfinite(error))
+            error = std::numeric_limits<double>::infinity();
+
+        auto it = std::find_if(results_.begin(), results_.end(), [&](const Result &r) { return r.name == name; });
+        if (it == results_.end())
+            results_.push_back({name, tolerance, error});
+        else
+            it->max_error = std::max(it->max_error, error);
+    }
+
+    Eigen::Matrix3Xd RandomPoints(const int num_points) {
+        Eigen::Matrix3Xd X(3, num_points);
+        for (int i = 0; i < num_points; ++i)
+            X.col(i) << normal_(rng_), normal_(rng_), normal_(rng_);
+        return X;
+    }
+
+    // Random points whose centered spread is not close to a line (or, for
+    // more than 3 points, a plane), so the pose is well determined.
+    Eigen::Matrix3Xd WellConditionedPoints(const int num_points) {
+        const int kRank = std::min(num_points - 1, 3);
+        while (true) {
+            const Eigen::Matrix3Xd X = RandomPoints(num_points);
+            const Eigen::Matrix3Xd kCentered = X.colwise() - X.rowwise().mean();
+            const Eigen::Vector3d kSingularValues = Eigen::JacobiSVD<Eigen::Matrix3Xd>(kCentered).singularValues();
+            if (kSingularValues(kRank - 1) > 0.3 * kSingularValues(0))
+                return X;
+        }
+    }
+
+    Eigen::Vector3d RandomUnitVector() { return RandomPoints(1).col(0).normalized(); }
+
+    Eigen::Matrix3d RandomRotation(const double angle) {
+        return Eigen::AngleAxisd(angle, RandomUnitVector()).toRotationMatrix();
+    }
+
+    std::mt19937 rng_;
+    std::normal_distribution<double> normal_;
+    std::vector<Result> results_;
+};
+
+} // namespace
+} // namespace madpose
+
+int main() {
+    madpose::AlignmentTest test;
+    for (int trial = 0; trial < madpose::kNumTrials; ++trial) {
+        test.TestRotations(3);
+        test.TestRotations(4);
+    }
+    test.TestAxisFlips();
+    return test.Report() == 0 ? 0 : 1;
+}
@@ -0,0 +1,251 @@
+// Compares the cost functions with analytic derivatives in cost_functions.h
+// with the automatically differentiated functors they replace, on random
+// poses and correspondences. Both the standalone evaluation and the one on a
+// state shared through a PoseEvaluationCallback are checked. Exits with a
+// non-zero status if a residual or Jacobian differs.
+
+#include "cost_functions.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace madpose {
+namespace {
+
+constexpr int kNumTrials = 500;
+// Relative to the magnitude of the autodiff values, or absolute below 1.
+constexpr double kTolerance = 1e-9;
+
+class CostFunctionTest {
+  public:
+    CostFunctionTest() : rng_(0) {}
+
+    // Evaluates both cost functions on parameters, with all Jacobians
+    // requested, and returns the largest difference of their residuals and
+    // Jacobians.
+    static double MaxDifference(const ceres::CostFunction &analytic, const ceres::CostFunction &autodiff,
+                                const std::vector<std::vector<double>> &parameters) {
+        const int kNumResiduals = autodiff.num_residuals();
+        const std::vector<int32_t> &kBlockSizes = autodiff.parameter_block_sizes();
+        std::vector<const double *> parameter_ptrs;
+        for (const std::vector<double> &block : parameters)
+            parameter_ptrs.push_back(block.data());
+
+        std::vector<double> residuals[2];
+        std::vector<std::vector<double>> jacobians[2];
+        const ceres::CostFunction *cost_functions[2] = {&analytic, &autodiff};
+        for (int k = 0; k < 2; ++k) {
+            residuals[k].resize(kNumResiduals);
+            std::vector<double *> jacobian_ptrs;
+            for (const int32_t kSize : kBlockSizes) {
+                jacobians[k].emplace_back(kNumResiduals * kSize);
+                jacobian_ptrs.push_back(jacobians[k].back().data());
+            }
+            if (!cost_functions[k]->Evaluate(parameter_ptrs.data(), residuals[k].data(), jacobian_ptrs.data()))
+                return std::numeric_limits<double>::infinity();
+        }
+
+        double max_difference = 0.0;
+        auto compare = [&](const double value, const double reference) {
+            max_difference =
+                std::max(max_difference, std::abs(value - reference) / std::max(1.0, std::abs(reference)));
+        };
+        for (int i = 0; i < kNumResiduals; ++i)
+            compare(residuals[0][i], residuals[1][i]);
+        for (size_t b = 0; b < kBlockSizes.size(); ++b) {
+            for (size_t i = 0; i < jacobians[1][b].size(); ++i)
+                compare(jacobians[0][b][i], jacobians[1][b][i]);
+        }
+        return max_difference;
+    }
+
+    double Uniform(const double low, const double high) {
+        return std::uniform_real_distribution<double>(low, high)(rng_);
+    }
+
+    // A random rotation of up to about 60 degrees as an unnormalized
+    // quaternion, since the cost functions normalize it themselves.
+    std::vector<double> RandomQuaternion() {
+        Eigen::Vector4d qvec(1.0, Uniform(-0.5, 0.5), Uniform(-0.5, 0.5), Uniform(-0.5, 0.5));
+        qvec *= Uniform(0.5, 2.0);
+        return {qvec(0), qvec(1), qvec(2), qvec(3)};
+    }
+
+    std::vector<double> RandomTranslation() { return {Uniform(-1.0, 1.0), Uniform(-1.0, 1.0), Uniform(-0.2, 0.2)}; }
+
+    // A keypoint in pixels relative to the principal point.
+    Eigen::Vector3d RandomKeypoint() { return Eigen::Vector3d(Uniform(-300.0, 300.0), Uniform(-200.0, 200.0), 1.0); }
+
+    Eigen::Matrix3d RandomCalibration() {
+        Eigen::Matrix3d K = Eigen::Matrix3d::Identity();
+        K(0, 0) = Uniform(400.0, 800.0);
+        K(1, 1) = K(0, 0) * Uniform(0.95, 1.05);
+        K(0, 2) = Uniform(300.0, 340.0);
+        K(1, 2) = Uniform(220.0, 260.0);
+        return K;
+    }
+
+    // Records the difference of a pair of cost functions in the results of
+    // the test with the given name.
+    void Record(const std::string &name, const double difference) {
+        for (Result &result : results_) {
+            if (result.name == name) {
+                result.max_difference = std::max(result.max_difference, difference);
+                return;
+            }
+        }
+        results_.push_back({name, difference});
+    }
+
+    // Compares the analytic cost function created by create_analytic(state)
+    // on its own (null state) and on the state of a PoseEvaluationCallback at
+    // the given parameters.
+    template <typename CreateAnalytic>
+    void Compare(const std::string &name, CreateAnalytic &&create_analytic, ceres::CostFunction *autodiff,
+                 const std::vector<std::vector<double>> &parameters, const int qvec_block, const double *focal0,
+                 const double *focal1) {
+        std::unique_ptr<ceres::CostFunction> autodiff_cost(autodiff);
+        std::unique_ptr<ceres::CostFunction> standalone(create_analytic(nullptr));
+        Record(name, MaxDifference(*standalone, *autodiff_cost, parameters));
+
+        PoseEvaluationCallback callback(parameters[qvec_block].data(), parameters[qvec_block + 1].data(), focal0,
+                                        focal1);
+        callback.PrepareForEvaluation(true, true);
+        std::unique_ptr<ceres::CostFunction> shared(create_analytic(callback.state()));
+        Record(name + " (shared state)", MaxDifference(*shared, *autodiff_cost, parameters));
+    }
+
+    void TestCalibrated() {
+        const Eigen::Matrix3d K0 = RandomCalibration(), K1 = RandomCalibration();
+        const Eigen::Vector3d x0 = RandomKeypoint() + Eigen::Vector3d(K0(0, 2), K0(1, 2), 0.0);
+        const Eigen::Vector3d x1 = RandomKeypoint() + Eigen::Vector3d(K1(0, 2), K1(1, 2), 0.0);
+        const Eigen::Vector3d x0_calib = K0.inverse() * x0, x1_calib = K1.inverse() * x1;
+        const double kDepth0 = Uniform(2.0, 6.0), kDepth1 = Uniform(2.0, 6.0);
+        const std::vector<double> qvec = RandomQuaternion(), tvec = RandomTranslation();
+        const std::vector<double> scale = {Uniform(0.5, 2.0)}, offset0 = {Uniform(-0.5, 0.5)},
+                                  offset1 = {Uniform(-0.5, 0.5)};
+        const double kWeight = Uniform(0.1, 2.0);
+
+        Compare(
+            "LiftProjectionCostFunction0",
+            [&](const PoseEvaluationState *state) {
+                return LiftProjectionCostFunction0::Create(x0_calib, x1, kDepth0, K1, state);
+            },
+            LiftProjectionFunctor0::Create(x0_calib, x1, kDepth0, K1), {offset0, qvec, tvec}, 1, nullptr, nullptr);
+        Compare(
+            "LiftProjectionCostFunction1",
+            [&](const PoseEvaluationState *state) {
+                return LiftProjectionCostFunction1::Create(x1_calib, x0, kDepth1, K0, state);
+            },
+            LiftProjectionFunctor1::Create(x1_calib, x0, kDepth1, K0), {scale, offset1, qvec, tvec}, 2, nullptr,
+            nullptr);
+        Compare(
+            "SampsonErrorCostFunction",
+            [&](const PoseEvaluationState *state) {
+                return SampsonErrorCostFunction::Create(x0_calib, x1_calib, K0, K1, kWeight, state);
+            },
+            SampsonErrorFunctor::Create(x0_calib, x1_calib, K0, K1, kWeight), {qvec, tvec}, 0, nullptr, nullptr);
+    }
+
+    void TestSharedFocal() {
+        const Eigen::Vector3d x0 = RandomKeypoint(), x1 = RandomKeypoint();
+        const double kDepth0 = Uniform(2.0, 6.0), kDepth1 = Uniform(2.0, 6.0);
+        const std::vector<double> qvec = RandomQuaternion(), tvec = RandomTranslation();
+        const std::vector<double> scale = {Uniform(0.5, 2.0)}, offset0 = {Uniform(-0.5, 0.5)},
+                                  offset1 = {Uniform(-0.5, 0.5)}, focal = {Uniform(300.0, 1000.0)};
+        const double kWeight = Uniform(0.1, 2.0);
+
+        Compare(
+            "LiftProjectionSharedFocalCostFunction0",
+            [&](const PoseEvaluationState *state) {
+                return LiftProjectionSharedFocalCostFunction0::Create(x0, x1, kDepth0, state);
+            },
+            LiftProjectionSharedFocalFunctor0::Create(x0, x1, kDepth0), {offset0, qvec, tvec, focal}, 1,
+            focal.data(), focal.data());
+        Compare(
+            "LiftProjectionSharedFocalCostFunction1",
+            [&](const PoseEvaluationState *state) {
+                return LiftProjectionSharedFocalCostFunction1::Create(x1, x0, kDepth1, state);
+            },
+            LiftProjectionSharedFocalFunctor1::Create(x1, x0, kDepth1), {scale, offset1, qvec, tvec, focal}, 2,
+            focal.data(), focal.data());
+        Compare(
+            "SampsonErrorSharedFocalCostFunction",
+            [&](const PoseEvaluationState *state) {
+                return SampsonErrorSharedFocalCostFunction::Create(x0, x1, kWeight, state);
+            },
+            SampsonErrorSharedFocalFunctor::Create(x0, x1, kWeight), {qvec, tvec, focal}, 0, focal.data(),
+            focal.data());
+    }
+
+    void TestTwoFocal() {
+        const Eigen::Vector3d x0 = RandomKeypoint(), x1 = RandomKeypoint();
+        const double kDepth0 = Uniform(2.0, 6.0), kDepth1 = Uniform(2.0, 6.0);
+        const std::vector<double> qvec = RandomQuaternion(), tvec = RandomTranslation();
+        const std::vector<double> scale = {Uniform(0.5, 2.0)}, offset0 = {Uniform(-0.5, 0.5)},
+                                  offset1 = {Uniform(-0.5, 0.5)}, focal0 = {Uniform(300.0, 1000.0)},
+                                  focal1 = {Uniform(300.0, 1000.0)};
+        const double kWeight = Uniform(0.1, 2.0);
+
+        Compare(
+            "LiftProjectionTwoFocalCostFunction0",
+            [&](const PoseEvaluationState *state) {
+                return LiftProjectionTwoFocalCostFunction0::Create(x0, x1, kDepth0, state);
+            },
+            LiftProjectionTwoFocalFunctor0::Create(x0, x1, kDepth0), {offset0, qvec, tvec, focal0, focal1}, 1,
+            focal0.data(), focal1.data());
+        Compare(
+            "LiftProjectionTwoFocalCostFunction1",
+            [&](const PoseEvaluationState *state) {
+                return LiftProjectionTwoFocalCostFunction1::Create(x1, x0, kDepth1, state);
+            },
+            LiftProjectionTwoFocalFunctor1::Create(x1, x0, kDepth1), {scale, offset1, qvec, tvec, focal0, focal1},
+            2, focal0.data(), focal1.data());
+        Compare(
+            "SampsonErrorTwoFocalCostFunction",
+            [&](const PoseEvaluationState *state) {
+                return SampsonErrorTwoFocalCostFunction::Create(x0, x1, kWeight, state);
+            },
+            SampsonErrorTwoFocalFunctor::Create(x0, x1, kWeight), {qvec, tvec, focal0, focal1}, 0, focal0.data(),
+            focal1.data());
+    }
+
+    // Prints the results and returns the number of failed comparisons.
+    int Report() const {
+        int num_failures = 0;
+        for (const Result &result : results_) {
+            const bool kPassed = result.max_difference <= kTolerance;
+            std::printf("%-56s max difference %.3g %s\n", result.name.c_str(), result.max_difference,
+                        kPassed ? "OK" : "FAILED");
+            num_failures += kPassed ? 0 : 1;
+        }
+        return num_failures;
+    }
+
+  private:
+    struct Result {
+        std::string name;
+        double max_difference;
+    };
+
+    std::mt19937 rng_;
+    std::vector<Result> results_;
+};
+
+} // namespace
+} // namespace madpose
+
+int main() {
+    madpose::CostFunctionTest test;
+    for (int trial = 0; trial < madpose::kNumTrials; ++trial) {
+        test.TestCalibrated();
+        test.TestSharedFocal();
+        test.TestTwoFocal();
+    }
+    return test.Report() == 0 ? 0 : 1;
+}